@@ -53,16 +53,6 @@ bool compile_block(Compiler *compiler, AstNode block) {
     return true;
 }
 
-static bool compile_return(Compiler *compiler, AstNode node, uint32_t source) {
-    if (!compile_expr(compiler, node.rhs)) {
-        return false;
-    }
-
-    chunk_add_byte(compiler->chunk, OP_RETURN, source);
-
-    return true;
-}
-
 static void compiler_emit_short(Compiler *compiler, uint16_t c,
                                 uint32_t source) {
     chunk_add_byte(compiler->chunk, c >> 8, source);
@@ -83,6 +73,25 @@ static void compiler_emit_constant(Compiler *compiler, Value value,
     compiler_emit_short(compiler, c, source);
 }
 
+static bool compiler_emit_global(Compiler *compiler, const char *name,
+                                 size_t name_len, uint32_t source) {
+    ObjString *key = vm_copy_interned_string(compiler->vm, name, name_len);
+
+    uint32_t slot = vm_global_slot(compiler->vm, compiler->script, key);
+
+    if (slot > UINT16_MAX) {
+        compiler_error(compiler, source,
+                       "defining %u globals exceeds the limit of %d\n",
+                       slot + 1, UINT16_MAX + 1);
+
+        return false;
+    }
+
+    compiler_emit_short(compiler, slot, source);
+
+    return true;
+}
+
 static bool compiler_find_local(Compiler *compiler, const char *name,
                                 size_t name_len, uint32_t *index) {
     for (*index = 0; *index < compiler->locals_count; (*index)++) {
@@ -191,19 +200,67 @@ static bool compile_identifier(Compiler *compiler, AstNode node,
             chunk_add_byte(compiler->chunk, OP_GET_UPVALUE, source);
             chunk_add_byte(compiler->chunk, index, source);
         } else {
-            ObjString *key = vm_copy_string(compiler->vm, name, name_len);
             chunk_add_byte(compiler->chunk, OP_GET_GLOBAL, source);
-            compiler_emit_constant(compiler, OBJ_VAL(key), source);
+
+            if (!compiler_emit_global(compiler, name, name_len, source)) {
+                return false;
+            }
         }
     }
 
     return true;
 }
 
+// Register-style opcodes address frame slots and constants directly instead
+// of going through the stack, these find whether an operand can be encoded so
+static bool compiler_find_operand_local(Compiler *compiler, AstNode node,
+                                        uint32_t *index) {
+    if (node.tag != NODE_IDENTIFIER) {
+        return false;
+    }
+
+    const char *name = compiler->file_buffer + node.lhs;
+    size_t name_len = node.rhs - node.lhs;
+
+    if ((name_len == 4 && memcmp(name, "null", 4) == 0) ||
+        (name_len == 4 && memcmp(name, "true", 4) == 0) ||
+        (name_len == 5 && memcmp(name, "false", 5) == 0)) {
+        return false;
+    }
+
+    return compiler_find_local(compiler, name, name_len, index);
+}
+
+static bool compiler_find_operand_constant(Compiler *compiler, AstNode node,
+                                           Value *value) {
+    uint64_t v = (uint64_t)node.lhs << 32 | node.rhs;
+
+    switch (node.tag) {
+    case NODE_INT:
+        *value = NUMBER_VAL(v);
+        return true;
+
+    case NODE_FLOAT: {
+        double f;
+        memcpy(&f, &v, sizeof(double));
+        *value = NUM_VAL(f);
+        return true;
+    }
+
+    case NODE_STRING:
+        *value = OBJ_VAL(vm_copy_interned_string(
+            compiler->vm, compiler->ast.strings.items + node.lhs, node.rhs));
+        return true;
+
+    default:
+        return false;
+    }
+}
+
 static void compile_string(Compiler *compiler, AstNode node, uint32_t source) {
     const char *sv = compiler->ast.strings.items + node.lhs;
     size_t len = node.rhs;
-    ObjString *s = vm_copy_string(compiler->vm, sv, len);
+    ObjString *s = vm_copy_interned_string(compiler->vm, sv, len);
     chunk_add_byte(compiler->chunk, OP_PUSH_CONST, source);
     compiler_emit_constant(compiler, OBJ_VAL(s), source);
 }
@@ -211,7 +268,7 @@ static void compile_string(Compiler *compiler, AstNode node, uint32_t source) {
 static void compile_int(Compiler *compiler, AstNode node, uint32_t source) {
     uint64_t v = (uint64_t)node.lhs << 32 | node.rhs;
     chunk_add_byte(compiler->chunk, OP_PUSH_CONST, source);
-    compiler_emit_constant(compiler, NUM_VAL(v), source);
+    compiler_emit_constant(compiler, NUMBER_VAL(v), source);
 }
 
 static void compile_float(Compiler *compiler, AstNode node, uint32_t source) {
@@ -222,8 +279,6 @@ static void compile_float(Compiler *compiler, AstNode node, uint32_t source) {
     compiler_emit_constant(compiler, NUM_VAL(f), source);
 }
 
-static ObjMap dummy_map;
-
 static bool compile_function(Compiler *compiler, AstNode node,
                              uint32_t source) {
     Compiler fc = {
@@ -232,6 +287,7 @@ static bool compile_function(Compiler *compiler, AstNode node,
         .file_path = compiler->file_path,
         .ast = compiler->ast,
         .vm = compiler->vm,
+        .script = compiler->script,
         .locals_count = 0,
         .upvalues_count = 0,
     };
@@ -257,9 +313,10 @@ static bool compile_function(Compiler *compiler, AstNode node,
         }
     }
 
-    CallFrame *frame = &fc.vm->frames[fc.vm->frame_count++];
+    CallFrame *frame = vm_push_frame(fc.vm);
 
-    ObjFunction *fn = vm_new_function(fc.vm, &dummy_map,
+    ObjFunction *fn = vm_new_function(fc.vm, fc.script->globals,
+                                      fc.script->global_values,
                                       (Chunk){
                                           .file_path = fc.file_path,
                                           .file_content = fc.file_buffer,
@@ -308,15 +365,46 @@ static bool compile_array(Compiler *compiler, AstNode node, uint32_t source) {
     return true;
 }
 
+// Inline caches are addressed by a short, sites beyond that limit fall back to
+// the uncached opcodes
+static bool compiler_add_cache(Compiler *compiler, uint16_t *cache) {
+    if (compiler->chunk->caches.count > UINT16_MAX) {
+        return false;
+    }
+
+    *cache = chunk_add_cache(compiler->chunk);
+
+    return true;
+}
+
 static bool compile_map(Compiler *compiler, AstNode node, uint32_t source) {
+    bool has_constant_keys = true;
+
     for (uint32_t i = 0; i < node.rhs * 2; i++) {
-        if (!compile_expr(compiler, compiler->ast.extra.items[node.lhs + i])) {
+        AstNodeIdx element = compiler->ast.extra.items[node.lhs + i];
+
+        if (i % 2 == 0 &&
+            compiler->ast.nodes.items[element].tag != NODE_STRING) {
+            has_constant_keys = false;
+        }
+
+        if (!compile_expr(compiler, element)) {
             return false;
         }
     }
 
-    chunk_add_byte(compiler->chunk, OP_MAKE_MAP, source);
-    compiler_emit_word(compiler, node.rhs, source);
+    uint16_t cache;
+
+    // Maps built from the same keys in the same order have the same layout, so
+    // such a literal can give all of its maps one shape
+    if (has_constant_keys && compiler_add_cache(compiler, &cache)) {
+        chunk_add_byte(compiler->chunk, OP_MAKE_SHAPED_MAP, source);
+        compiler_emit_word(compiler, node.rhs, source);
+        compiler_emit_short(compiler, cache, source);
+    } else {
+        chunk_add_byte(compiler->chunk, OP_MAKE_MAP, source);
+        compiler_emit_word(compiler, node.rhs, source);
+    }
 
     return true;
 }
@@ -377,22 +465,36 @@ static bool compile_slice(Compiler *compiler, AstNode node, uint32_t source) {
 }
 
 static bool compile_member(Compiler *compiler, AstNode node, uint32_t source) {
-
     AstNode identifier = compiler->ast.nodes.items[node.rhs];
 
     const char *key = compiler->file_buffer + identifier.lhs;
     uint32_t key_len = identifier.rhs - identifier.lhs;
 
-    chunk_add_byte(compiler->chunk, OP_PUSH_CONST, source);
+    Value key_value =
+        OBJ_VAL(vm_copy_interned_string(compiler->vm, key, key_len));
+
+    uint16_t cache;
 
-    compiler_emit_constant(
-        compiler, OBJ_VAL(vm_copy_string(compiler->vm, key, key_len)), source);
+    if (!compiler_add_cache(compiler, &cache)) {
+        chunk_add_byte(compiler->chunk, OP_PUSH_CONST, source);
+        compiler_emit_constant(compiler, key_value, source);
+
+        if (!compile_expr(compiler, node.lhs)) {
+            return false;
+        }
+
+        chunk_add_byte(compiler->chunk, OP_GET_SUBSCRIPT, source);
+
+        return true;
+    }
 
     if (!compile_expr(compiler, node.lhs)) {
         return false;
     }
 
-    chunk_add_byte(compiler->chunk, OP_GET_SUBSCRIPT, source);
+    chunk_add_byte(compiler->chunk, OP_GET_MEMBER, source);
+    compiler_emit_constant(compiler, key_value, source);
+    compiler_emit_short(compiler, cache, source);
 
     return true;
 }
@@ -408,6 +510,33 @@ static bool compile_assign(Compiler *compiler, AstNode node, uint32_t source,
         uint32_t index;
 
         if (compiler_find_local(compiler, name, name_len, &index)) {
+            AstNode value = compiler->ast.nodes.items[node.rhs];
+
+            uint32_t rhs_index;
+            Value rhs_constant;
+
+            if (has_op &&
+                compiler_find_operand_local(compiler, value, &rhs_index)) {
+                chunk_add_byte(compiler->chunk, OP_SET_LOCAL_WITH_MATH_LOCAL,
+                               source);
+                chunk_add_byte(compiler->chunk, op, source);
+                chunk_add_byte(compiler->chunk, index, source);
+                chunk_add_byte(compiler->chunk, rhs_index, source);
+
+                return true;
+            }
+
+            if (has_op && compiler_find_operand_constant(compiler, value,
+                                                         &rhs_constant)) {
+                chunk_add_byte(compiler->chunk, OP_SET_LOCAL_WITH_MATH_CONST,
+                               source);
+                chunk_add_byte(compiler->chunk, op, source);
+                chunk_add_byte(compiler->chunk, index, source);
+                compiler_emit_constant(compiler, rhs_constant, source);
+
+                return true;
+            }
+
             if (!compile_expr(compiler, node.rhs))
                 return false;
 
@@ -452,11 +581,7 @@ static bool compile_assign(Compiler *compiler, AstNode node, uint32_t source,
                 chunk_add_byte(compiler->chunk, OP_SET_GLOBAL, source);
             }
 
-            compiler_emit_constant(
-                compiler, OBJ_VAL(vm_copy_string(compiler->vm, name, name_len)),
-                source);
-
-            return true;
+            return compiler_emit_global(compiler, name, name_len, source);
         }
 
         bool is_function =
@@ -507,11 +632,31 @@ static bool compile_assign(Compiler *compiler, AstNode node, uint32_t source,
         const char *key = compiler->file_buffer + identifier.lhs;
         uint32_t key_len = identifier.rhs - identifier.lhs;
 
-        chunk_add_byte(compiler->chunk, OP_PUSH_CONST, source);
+        Value key_value =
+        OBJ_VAL(vm_copy_interned_string(compiler->vm, key, key_len));
+
+        uint16_t cache;
+
+        if (compiler_add_cache(compiler, &cache)) {
+            if (!compile_expr(compiler, target.lhs))
+                return false;
 
-        compiler_emit_constant(
-            compiler, OBJ_VAL(vm_copy_string(compiler->vm, key, key_len)),
-            source);
+            if (has_op) {
+                chunk_add_byte(compiler->chunk, OP_SET_MEMBER_WITH_MATH,
+                               source);
+                chunk_add_byte(compiler->chunk, op, source);
+            } else {
+                chunk_add_byte(compiler->chunk, OP_SET_MEMBER, source);
+            }
+
+            compiler_emit_constant(compiler, key_value, source);
+            compiler_emit_short(compiler, cache, source);
+
+            return true;
+        }
+
+        chunk_add_byte(compiler->chunk, OP_PUSH_CONST, source);
+        compiler_emit_constant(compiler, key_value, source);
 
         if (!compile_expr(compiler, target.lhs))
             return false;
@@ -649,7 +794,7 @@ static bool node_is_float(AstNode n, double *out) {
 
 static void emit_int_const(Compiler *compiler, int64_t v, uint32_t source) {
     chunk_add_byte(compiler->chunk, OP_PUSH_CONST, source);
-    compiler_emit_constant(compiler, NUM_VAL(v), source);
+    compiler_emit_constant(compiler, NUMBER_VAL(v), source);
 }
 
 static void emit_float_const(Compiler *compiler, double v, uint32_t source) {
@@ -778,6 +923,29 @@ static bool compile_binary(Compiler *compiler, AstNode node, uint32_t source,
         }
     }
 
+    uint32_t lhs_index, rhs_index;
+    Value rhs_constant;
+
+    if (compiler_find_operand_local(compiler, lhs, &lhs_index)) {
+        if (compiler_find_operand_local(compiler, rhs, &rhs_index)) {
+            chunk_add_byte(compiler->chunk, OP_MATH_LOCAL_LOCAL, source);
+            chunk_add_byte(compiler->chunk, opcode, source);
+            chunk_add_byte(compiler->chunk, lhs_index, source);
+            chunk_add_byte(compiler->chunk, rhs_index, source);
+
+            return true;
+        }
+
+        if (compiler_find_operand_constant(compiler, rhs, &rhs_constant)) {
+            chunk_add_byte(compiler->chunk, OP_MATH_LOCAL_CONST, source);
+            chunk_add_byte(compiler->chunk, opcode, source);
+            chunk_add_byte(compiler->chunk, lhs_index, source);
+            compiler_emit_constant(compiler, rhs_constant, source);
+
+            return true;
+        }
+    }
+
     if (!compile_expr(compiler, node.lhs)) {
         return false;
     }
@@ -821,7 +989,8 @@ static bool compile_continue(Compiler *compiler, uint32_t source) {
     return true;
 }
 
-static bool compile_call(Compiler *compiler, AstNode node, uint32_t source) {
+static bool compile_call(Compiler *compiler, AstNode node, uint32_t source,
+                         OpCode op) {
     uint32_t argc = 0;
 
     if (node.rhs != INVALID_EXTRA_IDX) {
@@ -848,12 +1017,31 @@ static bool compile_call(Compiler *compiler, AstNode node, uint32_t source) {
         return false;
     }
 
-    chunk_add_byte(compiler->chunk, OP_CALL, source);
+    chunk_add_byte(compiler->chunk, op, source);
     chunk_add_byte(compiler->chunk, argc, source);
 
     return true;
 }
 
+static bool compile_return(Compiler *compiler, AstNode node, uint32_t source) {
+    AstNode rhs = compiler->ast.nodes.items[node.rhs];
+
+    // Returning a call reuses the frame, the return after it is only reached
+    // when calling a native function
+    if (rhs.tag == NODE_CALL) {
+        if (!compile_call(compiler, rhs, compiler->ast.nodes.sources[node.rhs],
+                          OP_TAIL_CALL)) {
+            return false;
+        }
+    } else if (!compile_expr(compiler, node.rhs)) {
+        return false;
+    }
+
+    chunk_add_byte(compiler->chunk, OP_RETURN, source);
+
+    return true;
+}
+
 bool compile_stmt(Compiler *compiler, AstNodeIdx node_idx) {
     AstNode node = compiler->ast.nodes.items[node_idx];
     uint32_t source = compiler->ast.nodes.sources[node_idx];
@@ -998,147 +1186,303 @@ bool compile_expr(Compiler *compiler, AstNodeIdx node_idx) {
         return compile_binary(compiler, node, source, OP_GTE);
 
     case NODE_CALL:
-        return compile_call(compiler, node, source);
+        return compile_call(compiler, node, source, OP_CALL);
 
     default:
         return false;
     }
 }
 
-void chunk_optimize(Chunk *old_chunk) {
-    size_t ip = 0;
+typedef struct {
+    uint32_t operand;
+    uint32_t target;
+    bool backward;
+} JumpPatch;
+
+typedef struct {
+    JumpPatch *items;
+    size_t count;
+    size_t capacity;
+} JumpPatches;
+
+static void chunk_add_short(Chunk *chunk, uint16_t c, uint32_t source) {
+    chunk_add_byte(chunk, c >> 8, source);
+    chunk_add_byte(chunk, c, source);
+}
 
-    Chunk new_chunk = {.file_path = old_chunk->file_path,
-                       .file_content = old_chunk->file_content,
-                       .constants = old_chunk->constants};
+static void chunk_add_jump(Chunk *chunk, JumpPatches *jumps, size_t target,
+                           bool backward, uint32_t source) {
+    JumpPatch jump = {
+        .operand = chunk->count,
+        .target = target,
+        .backward = backward,
+    };
 
-    chunk_adjust_capacity(&new_chunk, old_chunk->capacity);
+    ARRAY_PUSH(jumps, jump);
 
-    OpCode previous = UINT8_MAX;
-    OpCode opcode = UINT8_MAX;
+    chunk_add_short(chunk, 0xffff, source);
+}
 
-    while (ip < old_chunk->count) {
-        previous = opcode;
-        opcode = old_chunk->bytes[ip++];
+static bool opcode_is_binary(OpCode opcode) {
+    switch (opcode) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_POW:
+    case OP_EQL:
+    case OP_NEQ:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTE:
+    case OP_GTE:
+        return true;
 
-        uint32_t source = old_chunk->sources[ip];
+    default:
+        return false;
+    }
+}
 
-        switch (opcode) {
-        case OP_POP:
-            if (previous == OP_DUP) {
-                new_chunk.count--;
-            } else {
-                chunk_add_byte(&new_chunk, OP_POP, source);
-            }
+#define CHUNK_FUSE_MAX 4
 
-            break;
+// Tries to fuse the instructions starting at `ip` into a superinstruction,
+// returns how many bytes of the old chunk were consumed or zero when nothing
+// matched, an instruction that is a jump target is never fused with the ones
+// before it
+static size_t chunk_fuse(const Chunk *old_chunk, const bool *targets,
+                         size_t ip, Chunk *new_chunk, JumpPatches *jumps) {
+    const uint8_t *bytes = old_chunk->bytes;
+
+    size_t at[CHUNK_FUSE_MAX + 1];
+    OpCode ops[CHUNK_FUSE_MAX];
+    size_t n = 0;
+
+    at[0] = ip;
+
+    while (n < CHUNK_FUSE_MAX && at[n] < old_chunk->count &&
+           (n == 0 || !targets[at[n]])) {
+        ops[n] = bytes[at[n]];
+        at[n + 1] = at[n] + chunk_instruction_size(old_chunk, at[n]);
+        n++;
+    }
+
+    // The value of a local declaration is left on the stack as its slot
+    if (n >= 2 && ops[0] == OP_DUP && ops[1] == OP_POP) {
+        return at[2] - ip;
+    }
+
+    // Math on locals and constants, which the compiler did not see directly
+    // (e.g. a folded constant expression), optionally followed by a test
+    OpCode math = UINT8_MAX;
+    uint8_t operands[4];
+    size_t consumed = 0;
+    uint32_t source = 0;
+
+    if (n >= 3 && ops[0] == OP_GET_LOCAL && ops[1] == OP_GET_LOCAL &&
+        opcode_is_binary(ops[2])) {
+        math = OP_MATH_LOCAL_LOCAL;
+        operands[0] = ops[2];
+        operands[1] = bytes[at[0] + 1];
+        operands[2] = bytes[at[1] + 1];
+        consumed = 3;
+        source = old_chunk->sources[at[2]];
+    } else if (n >= 3 && ops[0] == OP_GET_LOCAL && ops[1] == OP_PUSH_CONST &&
+               opcode_is_binary(ops[2])) {
+        math = OP_MATH_LOCAL_CONST;
+        operands[0] = ops[2];
+        operands[1] = bytes[at[0] + 1];
+        operands[2] = bytes[at[1] + 1];
+        operands[3] = bytes[at[1] + 2];
+        consumed = 3;
+        source = old_chunk->sources[at[2]];
+    } else if (n >= 1 && (ops[0] == OP_MATH_LOCAL_LOCAL ||
+                          ops[0] == OP_MATH_LOCAL_CONST)) {
+        math = ops[0];
+        memcpy(operands, bytes + at[0] + 1, at[1] - at[0] - 1);
+        consumed = 1;
+        source = old_chunk->sources[at[0]];
+    }
+
+    if (math != UINT8_MAX) {
+        size_t operands_count = math == OP_MATH_LOCAL_LOCAL ? 3 : 4;
+
+        bool jumps_if_false =
+            n > consumed && ops[consumed] == OP_POP_JUMP_IF_FALSE;
+
+        if (jumps_if_false) {
+            chunk_add_byte(new_chunk,
+                           math == OP_MATH_LOCAL_LOCAL
+                               ? OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE
+                               : OP_MATH_LOCAL_CONST_JUMP_IF_FALSE,
+                           source);
+        } else {
+            chunk_add_byte(new_chunk, math, source);
+        }
+
+        for (size_t i = 0; i < operands_count; i++) {
+            chunk_add_byte(new_chunk, operands[i], source);
+        }
+
+        if (jumps_if_false) {
+            size_t target;
+
+            chunk_jump_target(old_chunk, at[consumed], &target);
+
+            chunk_add_jump(new_chunk, jumps, target, false, source);
+
+            consumed++;
+        }
+
+        return at[consumed] - ip;
+    }
+
+    if (n >= 2 && ops[1] == OP_POP &&
+        (ops[0] == OP_SET_LOCAL_WITH_MATH_LOCAL ||
+         ops[0] == OP_SET_LOCAL_WITH_MATH_CONST || ops[0] == OP_SET_LOCAL)) {
+        source = old_chunk->sources[at[0]];
 
-        case OP_DUP:
-        case OP_SWP:
-        case OP_PUSH_NULL:
-        case OP_PUSH_TRUE:
-        case OP_PUSH_FALSE:
-        case OP_GET_SUBSCRIPT:
-        case OP_SET_SUBSCRIPT:
-        case OP_EQL:
-        case OP_NEQ:
-        case OP_NOT:
-        case OP_NEG:
-        case OP_ADD:
-        case OP_SUB:
-        case OP_MUL:
-        case OP_DIV:
-        case OP_MOD:
-        case OP_POW:
-        case OP_LT:
-        case OP_GT:
-        case OP_LTE:
-        case OP_GTE:
-        case OP_COPY_BY_SLICING:
-        case OP_MAKE_SLICE:
-        case OP_CLOSE_UPVALUE:
-        case OP_MAKE_SLICE_UNDER:
-        case OP_MAKE_SLICE_ABOVE:
-        case OP_RETURN:
-            chunk_add_byte(&new_chunk, opcode, source);
+        switch (ops[0]) {
+        case OP_SET_LOCAL_WITH_MATH_LOCAL:
+            chunk_add_byte(new_chunk, OP_SET_LOCAL_WITH_MATH_LOCAL_POP, source);
             break;
 
-        case OP_GET_LOCAL:
-        case OP_SET_LOCAL:
-        case OP_GET_UPVALUE:
-        case OP_SET_UPVALUE:
-        case OP_CALL:
-        case OP_SET_SUBSCRIPT_WITH_MATH:
-            chunk_add_byte(&new_chunk, opcode, source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
+        case OP_SET_LOCAL_WITH_MATH_CONST:
+            chunk_add_byte(new_chunk, OP_SET_LOCAL_WITH_MATH_CONST_POP, source);
             break;
 
-        case OP_POP_JUMP_IF_FALSE:
-        case OP_JUMP:
-        case OP_LOOP:
-        case OP_PUSH_CONST:
-        case OP_GET_GLOBAL:
-        case OP_SET_GLOBAL:
-        case OP_SET_LOCAL_WITH_MATH:
-        case OP_SET_UPVALUE_WITH_MATH: {
-            chunk_add_byte(&new_chunk, opcode, source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
+        default:
+            chunk_add_byte(new_chunk, OP_SET_LOCAL_POP, source);
             break;
         }
 
-        case OP_SET_GLOBAL_WITH_MATH: {
-            chunk_add_byte(&new_chunk, opcode, source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            break;
+        for (size_t i = at[0] + 1; i < at[1]; i++) {
+            chunk_add_byte(new_chunk, bytes[i], source);
         }
 
-        case OP_MAKE_ARRAY: {
-            chunk_add_byte(&new_chunk, OP_MAKE_ARRAY, source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            break;
+        return at[2] - ip;
+    }
+
+    if (n >= 3 && ops[0] == OP_PUSH_CONST && ops[1] == OP_GET_LOCAL &&
+        ops[2] == OP_GET_SUBSCRIPT) {
+        source = old_chunk->sources[at[2]];
+
+        chunk_add_byte(new_chunk, OP_GET_SUBSCRIPT_LOCAL_CONST, source);
+        chunk_add_byte(new_chunk, bytes[at[1] + 1], source);
+        chunk_add_byte(new_chunk, bytes[at[0] + 1], source);
+        chunk_add_byte(new_chunk, bytes[at[0] + 2], source);
+
+        return at[3] - ip;
+    }
+
+    if (n >= 2 && ops[1] == OP_CALL &&
+        (ops[0] == OP_GET_UPVALUE || ops[0] == OP_GET_GLOBAL)) {
+        // Errors about the name point at it and errors about the call point at
+        // the call, see OP_CALL_GLOBAL
+        source = old_chunk->sources[at[0]];
+
+        chunk_add_byte(new_chunk,
+                       ops[0] == OP_GET_UPVALUE ? OP_CALL_UPVALUE
+                                                : OP_CALL_GLOBAL,
+                       source);
+
+        for (size_t i = at[0] + 1; i < at[1]; i++) {
+            chunk_add_byte(new_chunk, bytes[i], source);
         }
 
-        case OP_MAKE_MAP: {
-            chunk_add_byte(&new_chunk, OP_MAKE_MAP, source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            break;
+        chunk_add_byte(new_chunk, bytes[at[1] + 1],
+                       old_chunk->sources[at[1]]);
+
+        return at[2] - ip;
+    }
+
+    return 0;
+}
+
+void chunk_optimize(Chunk *old_chunk) {
+    size_t count = old_chunk->count;
+
+    bool *targets = calloc(count + 1, sizeof(bool));
+    uint32_t *relocations = malloc((count + 1) * sizeof(uint32_t));
+
+    if (targets == NULL || relocations == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+
+        exit(1);
+    }
+
+    for (size_t ip = 0; ip < count;
+         ip += chunk_instruction_size(old_chunk, ip)) {
+        size_t target;
+
+        if (chunk_jump_target(old_chunk, ip, &target)) {
+            targets[target] = true;
         }
+    }
 
-        case OP_MAKE_CLOSURE: {
-            chunk_add_byte(&new_chunk, OP_MAKE_CLOSURE, source);
+    Chunk new_chunk = {.file_path = old_chunk->file_path,
+                       .file_content = old_chunk->file_content,
+                       .constants = old_chunk->constants,
+                       .caches = old_chunk->caches};
 
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
+    chunk_adjust_capacity(&new_chunk, old_chunk->capacity);
 
-            uint16_t index = ((uint16_t)old_chunk->bytes[ip - 2] << 8) |
-                             old_chunk->bytes[ip - 1];
+    JumpPatches jumps = {0};
 
-            ObjFunction *fn = AS_FUNCTION(old_chunk->constants.items[index]);
+    size_t ip = 0;
 
-            for (int i = 0; i < fn->upvalues_count; i++) {
-                chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-                chunk_add_byte(&new_chunk, old_chunk->bytes[ip++], source);
-            }
+    while (ip < count) {
+        relocations[ip] = new_chunk.count;
 
-            break;
+        new_chunk.stack_size++;
+
+        size_t fused = chunk_fuse(old_chunk, targets, ip, &new_chunk, &jumps);
+
+        if (fused != 0) {
+            ip += fused;
+            continue;
         }
 
-        default:
-            printf("UNHANDLED OPCODE: %d\n", (int)opcode);
-            assert(false && "UNREACHABLE");
-            break;
+        size_t size = chunk_instruction_size(old_chunk, ip);
+        uint32_t source = old_chunk->sources[ip];
+
+        size_t target;
+
+        if (chunk_jump_target(old_chunk, ip, &target)) {
+            for (size_t i = 0; i < size - 2; i++) {
+                chunk_add_byte(&new_chunk, old_chunk->bytes[ip + i], source);
+            }
+
+            chunk_add_jump(&new_chunk, &jumps, target,
+                           old_chunk->bytes[ip] == OP_LOOP, source);
+        } else {
+            for (size_t i = 0; i < size; i++) {
+                chunk_add_byte(&new_chunk, old_chunk->bytes[ip + i], source);
+            }
         }
+
+        ip += size;
+    }
+
+    relocations[count] = new_chunk.count;
+
+    for (size_t i = 0; i < jumps.count; i++) {
+        JumpPatch jump = jumps.items[i];
+
+        uint32_t next = jump.operand + 2;
+        uint32_t target = relocations[jump.target];
+
+        uint16_t offset = jump.backward ? next - target : target - next;
+
+        new_chunk.bytes[jump.operand] = offset >> 8;
+        new_chunk.bytes[jump.operand + 1] = offset;
     }
 
+    ARRAY_FREE(&jumps);
+
+    free(targets);
+    free(relocations);
+
     free(old_chunk->bytes);
     free(old_chunk->sources);
 
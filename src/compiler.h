@@ -32,6 +32,7 @@ typedef struct Compiler {
     const char *file_buffer;
     Ast ast;
     Vm *vm;
+    ObjFunction *script; // the top level function owning the globals
     Chunk *chunk;
     Loop loop;
     Local locals[UINT8_MAX];
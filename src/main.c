@@ -11,7 +11,29 @@
 #include "parser.h"
 #include "vm.h"
 
-static void disassemble_op(Chunk chunk, size_t *ip) {
+static void disassemble_global(const ObjFunction *fn, uint16_t slot) {
+    ObjString *name = vm_global_name(fn, slot);
+
+    printf("%d (%.*s)", (int)slot, (int)name->count, name->items);
+}
+
+// Prints the key and the inline cache of a member access
+static void disassemble_member(const ObjFunction *fn, size_t *ip) {
+    Chunk chunk = fn->chunk;
+
+    uint16_t index = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                    chunk.bytes[*ip - 1]);
+    uint16_t cache = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                    chunk.bytes[*ip - 1]);
+
+    value_display(chunk.constants.items[index]);
+
+    printf(" [%d]", (int)cache);
+}
+
+static void disassemble_op(const ObjFunction *fn, size_t *ip) {
+    Chunk chunk = fn->chunk;
+
     OpCode opcode = chunk.bytes[(*ip)++];
 
     switch (opcode) {
@@ -81,10 +103,30 @@ static void disassemble_op(Chunk chunk, size_t *ip) {
 
     case OP_SET_LOCAL_WITH_MATH:
         printf("SET_LOCAL_WITH_MATH (");
-        disassemble_op(chunk, ip);
+        disassemble_op(fn, ip);
+        printf(") %d", (int)chunk.bytes[(*ip)++]);
+        break;
+
+    case OP_SET_LOCAL_WITH_MATH_LOCAL:
+        printf("SET_LOCAL_WITH_MATH_LOCAL (");
+        disassemble_op(fn, ip);
         printf(") %d", (int)chunk.bytes[(*ip)++]);
+        printf(" %d", (int)chunk.bytes[(*ip)++]);
         break;
 
+    case OP_SET_LOCAL_WITH_MATH_CONST: {
+        printf("SET_LOCAL_WITH_MATH_CONST (");
+        disassemble_op(fn, ip);
+        printf(") %d ", (int)chunk.bytes[(*ip)++]);
+
+        uint16_t index = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                        chunk.bytes[*ip - 1]);
+
+        value_display(chunk.constants.items[index]);
+
+        break;
+    }
+
     case OP_GET_UPVALUE:
         printf("GET_UPVALUE %d", (int)chunk.bytes[(*ip)++]);
         break;
@@ -95,7 +137,7 @@ static void disassemble_op(Chunk chunk, size_t *ip) {
 
     case OP_SET_UPVALUE_WITH_MATH:
         printf("SET_UPVALUE_WITH_MATH (");
-        disassemble_op(chunk, ip);
+        disassemble_op(fn, ip);
         printf(") %d", (int)chunk.bytes[(*ip)++]);
         break;
 
@@ -109,7 +151,7 @@ static void disassemble_op(Chunk chunk, size_t *ip) {
 
         printf("GET_GLOBAL ");
 
-        value_display(chunk.constants.items[index]);
+        disassemble_global(fn, index);
 
         break;
     }
@@ -120,7 +162,7 @@ static void disassemble_op(Chunk chunk, size_t *ip) {
 
         printf("SET_GLOBAL ");
 
-        value_display(chunk.constants.items[index]);
+        disassemble_global(fn, index);
 
         break;
     }
@@ -128,14 +170,14 @@ static void disassemble_op(Chunk chunk, size_t *ip) {
     case OP_SET_GLOBAL_WITH_MATH: {
         printf("SET_GLOBAL_WITH_MATH (");
 
-        disassemble_op(chunk, ip);
+        disassemble_op(fn, ip);
 
         printf(") ");
 
         uint16_t index = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
                                         chunk.bytes[*ip - 1]);
 
-        value_display(chunk.constants.items[index]);
+        disassemble_global(fn, index);
 
         break;
     }
@@ -150,10 +192,27 @@ static void disassemble_op(Chunk chunk, size_t *ip) {
 
     case OP_SET_SUBSCRIPT_WITH_MATH:
         printf("SET_SUBSCRIPT_WITH_MATH (");
-        disassemble_op(chunk, ip);
+        disassemble_op(fn, ip);
         printf(")");
         break;
 
+    case OP_GET_MEMBER:
+        printf("GET_MEMBER ");
+        disassemble_member(fn, ip);
+        break;
+
+    case OP_SET_MEMBER:
+        printf("SET_MEMBER ");
+        disassemble_member(fn, ip);
+        break;
+
+    case OP_SET_MEMBER_WITH_MATH:
+        printf("SET_MEMBER_WITH_MATH (");
+        disassemble_op(fn, ip);
+        printf(") ");
+        disassemble_member(fn, ip);
+        break;
+
     case OP_EQL:
         printf("EQL");
         break;
@@ -211,6 +270,26 @@ static void disassemble_op(Chunk chunk, size_t *ip) {
         printf("GTE");
         break;
 
+    case OP_MATH_LOCAL_LOCAL:
+        printf("MATH_LOCAL_LOCAL (");
+        disassemble_op(fn, ip);
+        printf(") %d", (int)chunk.bytes[(*ip)++]);
+        printf(" %d", (int)chunk.bytes[(*ip)++]);
+        break;
+
+    case OP_MATH_LOCAL_CONST: {
+        printf("MATH_LOCAL_CONST (");
+        disassemble_op(fn, ip);
+        printf(") %d ", (int)chunk.bytes[(*ip)++]);
+
+        uint16_t index = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                        chunk.bytes[*ip - 1]);
+
+        value_display(chunk.constants.items[index]);
+
+        break;
+    }
+
     case OP_COPY_BY_SLICING:
         printf("COPY_BY_SLICING");
         break;
@@ -249,10 +328,27 @@ static void disassemble_op(Chunk chunk, size_t *ip) {
         break;
     }
 
+    case OP_MAKE_SHAPED_MAP: {
+        uint32_t count = (*ip += 4, ((uint16_t)chunk.bytes[*ip - 4] << 24) |
+                                        ((uint16_t)chunk.bytes[*ip - 3] << 16) |
+                                        ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                        chunk.bytes[*ip - 1]);
+        uint16_t cache = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                        chunk.bytes[*ip - 1]);
+
+        printf("MAKE_SHAPED_MAP %d [%d]", (int)count, (int)cache);
+
+        break;
+    }
+
     case OP_CALL:
         printf("CALL %d", (int)chunk.bytes[(*ip)++]);
         break;
 
+    case OP_TAIL_CALL:
+        printf("TAIL_CALL %d", (int)chunk.bytes[(*ip)++]);
+        break;
+
     case OP_POP_JUMP_IF_FALSE: {
         uint16_t offset = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
                                          chunk.bytes[*ip - 1]);
@@ -292,15 +388,126 @@ static void disassemble_op(Chunk chunk, size_t *ip) {
     case OP_RETURN:
         printf("RETURN");
         break;
+
+    case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE: {
+        printf("MATH_LOCAL_LOCAL_JUMP_IF_FALSE (");
+        disassemble_op(fn, ip);
+        printf(") %d", (int)chunk.bytes[(*ip)++]);
+        printf(" %d", (int)chunk.bytes[(*ip)++]);
+
+        uint16_t offset = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                         chunk.bytes[*ip - 1]);
+
+        printf(" TO %zu", *ip + offset);
+
+        break;
+    }
+
+    case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE: {
+        printf("MATH_LOCAL_CONST_JUMP_IF_FALSE (");
+        disassemble_op(fn, ip);
+        printf(") %d ", (int)chunk.bytes[(*ip)++]);
+
+        uint16_t index = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                        chunk.bytes[*ip - 1]);
+
+        value_display(chunk.constants.items[index]);
+
+        uint16_t offset = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                         chunk.bytes[*ip - 1]);
+
+        printf(" TO %zu", *ip + offset);
+
+        break;
+    }
+
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_POP:
+        printf("SET_LOCAL_WITH_MATH_LOCAL_POP (");
+        disassemble_op(fn, ip);
+        printf(") %d", (int)chunk.bytes[(*ip)++]);
+        printf(" %d", (int)chunk.bytes[(*ip)++]);
+        break;
+
+    case OP_SET_LOCAL_WITH_MATH_CONST_POP: {
+        printf("SET_LOCAL_WITH_MATH_CONST_POP (");
+        disassemble_op(fn, ip);
+        printf(") %d ", (int)chunk.bytes[(*ip)++]);
+
+        uint16_t index = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                        chunk.bytes[*ip - 1]);
+
+        value_display(chunk.constants.items[index]);
+
+        break;
+    }
+
+    case OP_SET_LOCAL_POP:
+        printf("SET_LOCAL_POP %d", (int)chunk.bytes[(*ip)++]);
+        break;
+
+    case OP_GET_SUBSCRIPT_LOCAL_CONST: {
+        printf("GET_SUBSCRIPT_LOCAL_CONST %d ", (int)chunk.bytes[(*ip)++]);
+
+        uint16_t index = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                        chunk.bytes[*ip - 1]);
+
+        value_display(chunk.constants.items[index]);
+
+        break;
+    }
+
+    case OP_CALL_UPVALUE:
+        printf("CALL_UPVALUE %d", (int)chunk.bytes[(*ip)++]);
+        printf(" %d", (int)chunk.bytes[(*ip)++]);
+        break;
+
+    case OP_CALL_GLOBAL: {
+        uint16_t index = (*ip += 2, ((uint16_t)chunk.bytes[*ip - 2] << 8) |
+                                        chunk.bytes[*ip - 1]);
+
+        printf("CALL_GLOBAL ");
+
+        disassemble_global(fn, index);
+
+        printf(" %d", (int)chunk.bytes[(*ip)++]);
+
+        break;
+    }
+
+    // Quickened opcodes only appear in chunks that were already running
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_LT_NUM:
+    case OP_GT_NUM:
+    case OP_LTE_NUM:
+    case OP_GTE_NUM:
+    case OP_SET_LOCAL_WITH_MATH_NUM:
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_NUM:
+    case OP_SET_LOCAL_WITH_MATH_CONST_NUM:
+    case OP_SET_UPVALUE_WITH_MATH_NUM:
+    case OP_SET_GLOBAL_WITH_MATH_NUM:
+    case OP_SET_SUBSCRIPT_WITH_MATH_NUM:
+    case OP_MATH_LOCAL_LOCAL_NUM:
+    case OP_MATH_LOCAL_CONST_NUM:
+    case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM:
+    case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM:
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM:
+    case OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM:
+        *ip += chunk_instruction_size(&chunk, *ip - 1) - 1;
+        printf("<quickened>");
+        break;
     }
 }
 
-static void disassemble(Chunk chunk) {
+static void disassemble(const ObjFunction *fn) {
+    Chunk chunk = fn->chunk;
+
     size_t ip = 0;
 
     for (; ip < chunk.count; printf("\n")) {
         printf("%04zu\t", ip);
-        disassemble_op(chunk, &ip);
+        disassemble_op(fn, &ip);
     }
 
     for (size_t i = 0; i < chunk.constants.count; i++) {
@@ -308,7 +515,7 @@ static void disassemble(Chunk chunk) {
 
         if (IS_FUNCTION(constant)) {
             printf("FUNCTION (%zu):\n", i);
-            disassemble(AS_FUNCTION(constant)->chunk);
+            disassemble(AS_FUNCTION(constant));
         }
     }
 }
@@ -378,7 +585,7 @@ int main(int argc, const char **argv) {
             return 1;
         }
 
-        disassemble(vm.frames[0].closure->fn->chunk);
+        disassemble(vm.frames[0].closure->fn);
 
         free(input_file_content);
     } else if (file_exists(command)) {
@@ -9,8 +9,20 @@
 #include "source_location.h"
 #include "vm.h"
 
+// Deep recursion only shows the innermost and the outermost frames
+#define VM_STACK_TRACE_MAX 32
+
 void vm_stack_trace(Vm *vm) {
     for (ssize_t i = vm->frame_count - 1; i >= 0; i--) {
+        if (vm->frame_count > 2 * VM_STACK_TRACE_MAX &&
+            i == (ssize_t)(vm->frame_count - VM_STACK_TRACE_MAX - 1)) {
+            fprintf(stderr, "\t... %zu more\n",
+                    vm->frame_count - 2 * VM_STACK_TRACE_MAX);
+
+            i = VM_STACK_TRACE_MAX;
+            continue;
+        }
+
         CallFrame *frame = &vm->frames[i];
 
         size_t instruction = frame->ip - frame->closure->fn->chunk.bytes - 1;
@@ -44,6 +56,18 @@ void vm_stack_reset(Vm *vm) {
 }
 
 void vm_init(Vm *vm) {
+    vm->frames = calloc(VM_FRAMES_INIT, sizeof(CallFrame));
+    vm->frames_capacity = VM_FRAMES_INIT;
+
+    vm->stack = malloc(VM_STACK_INIT * sizeof(Value));
+    vm->stack_end = vm->stack + VM_STACK_INIT;
+
+    if (vm->frames == NULL || vm->stack == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+
+        exit(1);
+    }
+
     vm_stack_reset(vm);
 
     vm->objects = NULL;
@@ -53,6 +77,70 @@ void vm_init(Vm *vm) {
     vm->strings = vm_new_map(vm);
 }
 
+void vm_free_stack(Vm *vm) {
+    free(vm->frames);
+    free(vm->stack);
+}
+
+// Frames that were never used are zeroed, the compiler pushes frames whose
+// closure is only set after allocating it
+CallFrame *vm_push_frame(Vm *vm) {
+    if (vm->frame_count == vm->frames_capacity) {
+        size_t capacity = vm->frames_capacity * 2;
+
+        vm->frames = realloc(vm->frames, capacity * sizeof(CallFrame));
+
+        if (vm->frames == NULL) {
+            fprintf(stderr, "error: out of memory\n");
+
+            exit(1);
+        }
+
+        memset(vm->frames + vm->frames_capacity, 0,
+               (capacity - vm->frames_capacity) * sizeof(CallFrame));
+
+        vm->frames_capacity = capacity;
+    }
+
+    return &vm->frames[vm->frame_count++];
+}
+
+// Moves the stack into a bigger allocation, relocating every pointer into it:
+// sp, the slots of the frames and the locations of the open upvalues
+void vm_grow_stack(Vm *vm, size_t count) {
+    size_t used = vm->sp - vm->stack;
+    size_t capacity = vm->stack_end - vm->stack;
+
+    while (capacity - used < count) {
+        capacity *= 2;
+    }
+
+    Value *stack = malloc(capacity * sizeof(Value));
+
+    if (stack == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+
+        exit(1);
+    }
+
+    memcpy(stack, vm->stack, used * sizeof(Value));
+
+    for (size_t i = 0; i < vm->frame_count; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+
+    for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+
+    free(vm->stack);
+
+    vm->stack = stack;
+    vm->sp = stack + used;
+    vm->stack_end = stack + capacity;
+}
+
 bool vm_load_file(Vm *vm, const char *file_path, const char *file_buffer) {
     Parser parser = {.file_path = file_path, .lexer = {.buffer = file_buffer}};
 
@@ -64,9 +152,17 @@ bool vm_load_file(Vm *vm, const char *file_path, const char *file_buffer) {
 
     AstNode block = parser.ast.nodes.items[program];
 
-    CallFrame *frame = &vm->frames[vm->frame_count++];
+    // Defining the builtins and compiling keep a few values on the stack
+    vm_reserve_stack(vm, VM_STACK_SLACK);
+
+    // Nothing being compiled is reachable from the roots yet, so collecting
+    // garbage waits until it runs
+    size_t next_gc = vm->next_gc;
+    vm->next_gc = SIZE_MAX;
 
-    ObjFunction *fn = vm_new_function(vm, vm_new_map(vm),
+    CallFrame *frame = vm_push_frame(vm);
+
+    ObjFunction *fn = vm_new_function(vm, NULL, NULL,
                                       (Chunk){
                                           .file_path = file_path,
                                           .file_content = file_buffer,
@@ -75,7 +171,10 @@ bool vm_load_file(Vm *vm, const char *file_path, const char *file_buffer) {
 
     frame->closure = vm_new_closure(vm, fn);
 
-    vm_map_insert_builtins(vm, frame->closure->fn->globals);
+    fn->globals = vm_new_map(vm);
+    fn->global_values = vm_new_array(vm);
+
+    vm_define_builtins(vm, fn);
 
     frame->slots = vm->stack;
 
@@ -84,10 +183,15 @@ bool vm_load_file(Vm *vm, const char *file_path, const char *file_buffer) {
         .file_buffer = file_buffer,
         .ast = parser.ast,
         .vm = vm,
+        .script = fn,
         .chunk = &frame->closure->fn->chunk,
     };
 
-    if (!compile_block(&compiler, block)) {
+    bool compiled = compile_block(&compiler, block);
+
+    vm->next_gc = next_gc;
+
+    if (!compiled) {
         return false;
     }
 
@@ -101,16 +205,75 @@ bool vm_load_file(Vm *vm, const char *file_path, const char *file_buffer) {
     chunk_add_byte(compiler.chunk, OP_PUSH_NULL, 0);
     chunk_add_byte(compiler.chunk, OP_RETURN, 0);
 
-    frame->ip = frame->closure->fn->chunk.bytes;
+    // Compiling functions pushes frames, which may have moved this one
+    frame = &vm->frames[vm->frame_count - 1];
+    frame->ip = fn->chunk.bytes;
+    frame->pc = fn->chunk.code;
+
+    vm_reserve_stack(vm, fn->chunk.stack_size + VM_STACK_SLACK);
 
     return true;
 }
 
+// Globals are resolved by the compiler into indices of a dense array shared by
+// every function of a file, the map from their names is only needed while
+// compiling and for reporting errors
+uint32_t vm_global_slot(Vm *vm, ObjFunction *fn, ObjString *name) {
+    Value slot;
+
+    if (vm_map_lookup(fn->globals, name, &slot)) {
+        return AS_NUM(slot);
+    }
+
+    ObjArray *values = fn->global_values;
+
+    uint32_t old_capacity = values->capacity;
+
+    ARRAY_PUSH(values, UNDEFINED_VAL);
+
+    vm->bytes_allocated += (values->capacity - old_capacity) * sizeof(Value);
+
+    // Inserting may trigger the garbage collector before the name is reachable
+    vm_push(vm, OBJ_VAL(name));
+
+    vm_map_insert(vm, fn->globals, name, NUM_VAL(values->count - 1));
+
+    vm_pop(vm);
+
+    return values->count - 1;
+}
+
+ObjString *vm_global_name(const ObjFunction *fn, uint32_t slot) {
+    for (uint32_t i = 0; i < fn->globals->capacity; i++) {
+        ObjMapEntry entry = fn->globals->entries[i];
+
+        if (entry.key != NULL && AS_NUM(entry.value) == slot) {
+            return entry.key;
+        }
+    }
+
+    return NULL;
+}
+
+static void vm_undefined_global_error(Vm *vm, const ObjFunction *fn,
+                                      uint32_t slot) {
+    ObjString *name = vm_global_name(fn, slot);
+
+    vm_error(vm, "'%.*s' is not defined", (int)name->count, name->items);
+}
+
 static bool vm_neg(Vm *vm) {
     Value rhs = vm_peek(vm, 0);
 
+    // Negating zero gives -0 which only a double can hold
+    if (IS_INT(rhs) && AS_INT(rhs) != 0 && AS_INT(rhs) != INT32_MIN) {
+        vm_poke(vm, 0, INT_VAL(-AS_INT(rhs)));
+
+        return true;
+    }
+
     if (IS_NUM(rhs)) {
-        vm_poke(vm, 0, NUM_VAL(-AS_NUM(rhs)));
+        vm_poke(vm, 0, NUMBER_VAL(-AS_NUM(rhs)));
 
         return true;
     }
@@ -126,8 +289,8 @@ ObjString *vm_value_to_string(Vm *vm, Value value) {
     }
 
     if (IS_NUM(value)) {
-        char buffer[1024];
-        int len = snprintf(buffer, sizeof(buffer), "%.14g", AS_NUM(value));
+        char buffer[NUMBER_FORMAT_MAX];
+        size_t len = number_format(AS_NUM(value), buffer);
         return vm_copy_string(vm, buffer, len);
     }
 
@@ -147,22 +310,19 @@ ObjString *vm_value_to_string(Vm *vm, Value value) {
     exit(1);
 }
 
-static bool vm_add(Vm *vm) {
-    Value rhs = vm_peek(vm, 0);
-    Value lhs = vm_peek(vm, 1);
-
+static bool vm_add(Vm *vm, Value lhs, Value rhs, Value *result) {
     if (IS_NUM(lhs) && IS_NUM(rhs)) {
-        vm_pop(vm);
-        vm_poke(vm, 0, NUM_VAL(AS_NUM(lhs) + AS_NUM(rhs)));
+        *result = NUMBER_VAL(AS_NUM(lhs) + AS_NUM(rhs));
         return true;
     }
 
+    // The converted operand is kept on the stack while concatenating
     if (IS_STRING(lhs)) {
         ObjString *slhs = AS_STRING(lhs);
         ObjString *srhs = vm_value_to_string(vm, rhs);
-        ObjString *result = vm_concat_strings(vm, slhs, srhs);
+        vm_push(vm, OBJ_VAL(srhs));
+        *result = OBJ_VAL(vm_concat_strings(vm, slhs, srhs));
         vm_pop(vm);
-        vm_poke(vm, 0, OBJ_VAL(result));
 
         return true;
     }
@@ -170,9 +330,9 @@ static bool vm_add(Vm *vm) {
     if (IS_STRING(rhs)) {
         ObjString *slhs = vm_value_to_string(vm, lhs);
         ObjString *srhs = AS_STRING(rhs);
-        ObjString *result = vm_concat_strings(vm, slhs, srhs);
+        vm_push(vm, OBJ_VAL(slhs));
+        *result = OBJ_VAL(vm_concat_strings(vm, slhs, srhs));
         vm_pop(vm);
-        vm_poke(vm, 0, OBJ_VAL(result));
 
         return true;
     }
@@ -189,9 +349,7 @@ static bool vm_add(Vm *vm) {
 
         ObjArray *slhs = AS_ARRAY(lhs);
         ObjArray *srhs = AS_ARRAY(rhs);
-        ObjArray *result = vm_concat_arrays(vm, slhs, srhs);
-        vm_pop(vm);
-        vm_poke(vm, 0, OBJ_VAL(result));
+        *result = OBJ_VAL(vm_concat_arrays(vm, slhs, srhs));
 
         return true;
     }
@@ -211,13 +369,9 @@ static bool vm_add(Vm *vm) {
     return false;
 }
 
-static inline bool vm_sub(Vm *vm) {
-    Value rhs = vm_peek(vm, 0);
-    Value lhs = vm_peek(vm, 1);
-
+static inline bool vm_sub(Vm *vm, Value lhs, Value rhs, Value *result) {
     if (IS_NUM(lhs) && IS_NUM(rhs)) {
-        vm_pop(vm);
-        vm_poke(vm, 0, NUM_VAL(AS_NUM(lhs) - AS_NUM(rhs)));
+        *result = NUMBER_VAL(AS_NUM(lhs) - AS_NUM(rhs));
         return true;
     }
 
@@ -227,13 +381,9 @@ static inline bool vm_sub(Vm *vm) {
     return false;
 }
 
-static inline bool vm_mul(Vm *vm) {
-    Value rhs = vm_peek(vm, 0);
-    Value lhs = vm_peek(vm, 1);
-
+static inline bool vm_mul(Vm *vm, Value lhs, Value rhs, Value *result) {
     if (IS_NUM(lhs) && IS_NUM(rhs)) {
-        vm_pop(vm);
-        vm_poke(vm, 0, NUM_VAL(AS_NUM(lhs) * AS_NUM(rhs)));
+        *result = NUMBER_VAL(AS_NUM(lhs) * AS_NUM(rhs));
         return true;
     }
 
@@ -248,13 +398,9 @@ static inline double rem_euclid(double a, double b) {
     return r < 0 ? r + (b < 0 ? -b : b) : r;
 }
 
-static inline bool vm_div(Vm *vm) {
-    Value rhs = vm_peek(vm, 0);
-    Value lhs = vm_peek(vm, 1);
-
+static inline bool vm_div(Vm *vm, Value lhs, Value rhs, Value *result) {
     if (IS_NUM(lhs) && IS_NUM(rhs)) {
-        vm_pop(vm);
-        vm_poke(vm, 0, NUM_VAL(AS_NUM(lhs) / AS_NUM(rhs)));
+        *result = NUMBER_VAL(AS_NUM(lhs) / AS_NUM(rhs));
         return true;
     }
 
@@ -264,13 +410,9 @@ static inline bool vm_div(Vm *vm) {
     return false;
 }
 
-static inline bool vm_mod(Vm *vm) {
-    Value rhs = vm_peek(vm, 0);
-    Value lhs = vm_peek(vm, 1);
-
+static inline bool vm_mod(Vm *vm, Value lhs, Value rhs, Value *result) {
     if (IS_NUM(lhs) && IS_NUM(rhs)) {
-        vm_pop(vm);
-        vm_poke(vm, 0, NUM_VAL(rem_euclid(AS_NUM(lhs), AS_NUM(rhs))));
+        *result = NUMBER_VAL(rem_euclid(AS_NUM(lhs), AS_NUM(rhs)));
         return true;
     }
 
@@ -280,13 +422,9 @@ static inline bool vm_mod(Vm *vm) {
     return false;
 }
 
-static inline bool vm_pow(Vm *vm) {
-    Value rhs = vm_peek(vm, 0);
-    Value lhs = vm_peek(vm, 1);
-
+static inline bool vm_pow(Vm *vm, Value lhs, Value rhs, Value *result) {
     if (IS_NUM(lhs) && IS_NUM(rhs)) {
-        vm_pop(vm);
-        vm_poke(vm, 0, NUM_VAL(pow(AS_NUM(lhs), AS_NUM(rhs))));
+        *result = NUMBER_VAL(pow(AS_NUM(lhs), AS_NUM(rhs)));
         return true;
     }
 
@@ -310,10 +448,13 @@ static bool vm_call_closure(Vm *vm, ObjClosure *closure, uint8_t argc) {
         return false;
     }
 
-    CallFrame *frame = &vm->frames[vm->frame_count++];
+    vm_reserve_stack(vm, closure->fn->chunk.stack_size + VM_STACK_SLACK);
+
+    CallFrame *frame = vm_push_frame(vm);
 
     frame->closure = closure;
     frame->ip = closure->fn->chunk.bytes;
+    frame->pc = closure->fn->chunk.code;
     frame->slots = vm->sp - argc;
 
     return true;
@@ -333,7 +474,7 @@ static bool vm_call_native(Vm *vm, NativeFn fn, uint8_t argc) {
     return true;
 }
 
-static bool vm_call_value(Vm *vm, Value callee, uint8_t argc) {
+bool vm_call_value(Vm *vm, Value callee, uint8_t argc) {
     if (IS_OBJ(callee)) {
         switch (AS_OBJ(callee)->tag) {
         case OBJ_CLOSURE:
@@ -356,13 +497,9 @@ static bool vm_call_value(Vm *vm, Value callee, uint8_t argc) {
 }
 
 #define VM_CMP_FN(name, op)                                                    \
-    static bool name(Vm *vm) {                                                 \
-        Value rhs = vm_peek(vm, 0);                                            \
-        Value lhs = vm_peek(vm, 1);                                            \
-                                                                               \
+    static inline bool name(Vm *vm, Value lhs, Value rhs, Value *result) {    \
         if (IS_NUM(lhs) && IS_NUM(rhs)) {                                      \
-            vm_pop(vm);                                                        \
-            vm_poke(vm, 0, BOOL_VAL(AS_NUM(lhs) op AS_NUM(rhs)));              \
+            *result = BOOL_VAL(AS_NUM(lhs) op AS_NUM(rhs));                    \
             return true;                                                       \
         }                                                                      \
                                                                                \
@@ -377,33 +514,115 @@ VM_CMP_FN(vm_gt, >);
 VM_CMP_FN(vm_lte, <=);
 VM_CMP_FN(vm_gte, >=);
 
-static bool vm_get_subscript(Vm *vm, Value target, Value index) {
-    if (IS_ARRAY(target)) {
-        if (!IS_NUM(index)) {
-            vm_error(vm, "cannot access an array with %s value",
-                     value_description(index));
+// Resolves an integer `index` into `count` elements, counting from the end when
+// it is negative, returns -1 for anything else and leaves reporting it to the
+// checks on doubles
+static inline int64_t vm_int_index(Value index, uint32_t count) {
+    if (!IS_INT(index)) {
+        return -1;
+    }
 
-            return false;
-        }
+    int64_t i = AS_INT(index);
+
+    if (i < 0) {
+        i += count;
+    }
+
+    return i >= 0 && i < count ? i : -1;
+}
+
+// Pushes the bytes from `start` to `end` of the string sharing its items, the
+// string is kept on the stack since slicing can collect garbage
+static void vm_push_string_slice(Vm *vm, ObjString *string,
+                                 const char *start, const char *end) {
+    vm_push(vm, OBJ_VAL(string));
+
+    ObjString *slice = vm_slice_string(vm, string, start - string->items,
+                                       end - string->items);
+
+    vm_pop(vm);
+    vm_push(vm, OBJ_VAL(slice));
+}
 
+// Pushes the elements from `start` to `end` of an array sharing its items, or
+// of a typed array, see vm_push_string_slice
+static void vm_push_array_slice(Vm *vm, Value target, uint32_t start,
+                                uint32_t end) {
+    vm_push(vm, target);
+
+    Obj *slice =
+        IS_ARRAY(target)
+            ? &vm_slice_array(vm, AS_ARRAY(target), start, end)->obj
+            : &vm_slice_typed_array(vm, AS_TYPED_ARRAY(target), start, end)
+                   ->obj;
+
+    vm_pop(vm);
+    vm_push(vm, OBJ_VAL(slice));
+}
+
+// Arrays and typed arrays are sliced the same way
+static inline uint32_t vm_elements_count(Value target) {
+    return IS_ARRAY(target) ? AS_ARRAY(target)->count
+                            : AS_TYPED_ARRAY(target)->count;
+}
+
+// Returns the index of an element, or -1 once the error has been reported
+static inline int64_t vm_element_index(Vm *vm, Value index, uint32_t count) {
+    int64_t j = vm_int_index(index, count);
+
+    if (j >= 0) {
+        return j;
+    }
+
+    if (!IS_NUM(index)) {
+        vm_error(vm, "cannot access an array with %s value",
+                 value_description(index));
+
+        return -1;
+    }
+
+    double i = AS_NUM(index);
+
+    if (i < 0) {
+        i += count;
+    }
+
+    if (i < 0 || i >= count || (i - floor(i)) != 0) {
+        char buffer[NUMBER_FORMAT_MAX];
+        number_format(i, buffer);
+
+        vm_error(vm,
+                 "access out of bounds, array has %d elements "
+                 "while the index is %s",
+                 count, buffer);
+
+        return -1;
+    }
+
+    return i;
+}
+
+bool vm_get_subscript(Vm *vm, Value target, Value index) {
+    if (IS_ARRAY(target)) {
         ObjArray *array = AS_ARRAY(target);
 
-        double i = AS_NUM(index);
+        int64_t i = vm_element_index(vm, index, array->count);
 
         if (i < 0) {
-            i += array->count;
+            return false;
         }
 
-        if (i >= array->count || (i - floor(i)) != 0) {
-            vm_error(vm,
-                     "access out of bounds, array has %d elements "
-                     "while the index is %g",
-                     array->count, i);
+        vm_push(vm, array->items[i]);
+    } else if (IS_TYPED_ARRAY(target)) {
+        ObjTypedArray *array = AS_TYPED_ARRAY(target);
+
+        int64_t i = vm_element_index(vm, index, array->count);
 
+        if (i < 0) {
             return false;
         }
 
-        vm_push(vm, array->items[(size_t)i]);
+        vm_push(vm, NUMBER_VAL(vm_typed_get(array, i)));
     } else if (IS_STRING(target)) {
         if (!IS_NUM(index)) {
             vm_error(vm, "cannot access a string with %s value",
@@ -414,37 +633,34 @@ static bool vm_get_subscript(Vm *vm, Value target, Value index) {
 
         ObjString *string = AS_STRING(target);
 
-        uint32_t characters_count = string_utf8_characters_count(
-            string->items, string->items + string->count);
+        uint32_t characters_count = vm_string_length(string);
 
-        double i = AS_NUM(index);
+        int64_t i = vm_int_index(index, characters_count);
 
         if (i < 0) {
-            i += characters_count;
-        }
+            double d = AS_NUM(index);
 
-        if (i >= characters_count || (i - floor(i)) != 0) {
-            vm_error(vm,
-                     "access out of bounds, string has %d characters "
-                     "while the index is %g",
-                     characters_count, i);
+            if (d < 0) {
+                d += characters_count;
+            }
 
-            return false;
-        }
+            if (d < 0 || d >= characters_count || (d - floor(d)) != 0) {
+                char buffer[NUMBER_FORMAT_MAX];
+                number_format(d, buffer);
 
-        const char *start = string->items;
-        const char *end = string_utf8_skip_character(start);
+                vm_error(vm,
+                         "access out of bounds, string has %d characters "
+                         "while the index is %s",
+                         characters_count, buffer);
 
-        for (uint32_t j = 0; j < i; j++) {
-            start = string_utf8_skip_character(start);
-            end = string_utf8_skip_character(start);
-        }
-
-        uint32_t len = end - start;
+                return false;
+            }
 
-        ObjString *indexed = vm_copy_string(vm, start, len);
+            i = d;
+        }
 
-        vm_push(vm, OBJ_VAL(indexed));
+        vm_push_string_slice(vm, string, vm_string_character(string, i),
+                      vm_string_character(string, i + 1));
     } else if (IS_MAP(target)) {
         if (!IS_STRING(index)) {
             vm_error(vm, "cannot access a map with %s value",
@@ -455,7 +671,7 @@ static bool vm_get_subscript(Vm *vm, Value target, Value index) {
 
         ObjMap *map = AS_MAP(target);
 
-        ObjString *key = AS_STRING(index);
+        ObjString *key = vm_intern_string(vm, AS_STRING(index));
 
         Value value;
 
@@ -477,33 +693,38 @@ static bool vm_get_subscript(Vm *vm, Value target, Value index) {
     return true;
 }
 
-static bool vm_set_subscript(Vm *vm, Value target, Value index) {
+bool vm_set_subscript(Vm *vm, Value target, Value index) {
     if (IS_ARRAY(target)) {
-        if (!IS_NUM(index)) {
-            vm_error(vm, "cannot access an array with %s value",
-                     value_description(index));
+        ObjArray *array = AS_ARRAY(target);
+
+        int64_t i = vm_element_index(vm, index, array->count);
 
+        if (i < 0) {
             return false;
         }
 
-        ObjArray *array = AS_ARRAY(target);
+        vm_unshare_array(vm, array);
+
+        array->items[i] = vm_peek(vm, 0);
+    } else if (IS_TYPED_ARRAY(target)) {
+        ObjTypedArray *array = AS_TYPED_ARRAY(target);
 
-        double i = AS_NUM(index);
+        int64_t i = vm_element_index(vm, index, array->count);
 
         if (i < 0) {
-            i += array->count;
+            return false;
         }
 
-        if (i >= array->count || (i - floor(i)) != 0) {
-            vm_error(vm,
-                     "access out of bounds, array has %d elements "
-                     "while the index is %g",
-                     array->count, i);
+        Value value = vm_peek(vm, 0);
+
+        if (!IS_NUM(value)) {
+            vm_error(vm, "typed arrays only hold numbers, got %s",
+                     value_description(value));
 
             return false;
         }
 
-        array->items[(size_t)i] = vm_peek(vm, 0);
+        vm_typed_set(array, i, AS_NUM(value));
     } else if (IS_STRING(target)) {
         vm_error(vm, "strings are immutable");
 
@@ -518,11 +739,15 @@ static bool vm_set_subscript(Vm *vm, Value target, Value index) {
 
         ObjMap *map = AS_MAP(target);
 
-        ObjString *key = AS_STRING(index);
+        ObjString *key = vm_intern_string(vm, AS_STRING(index));
 
         Value value = vm_peek(vm, 0);
 
+        // Inserting can collect garbage, the callers have already popped both
+        vm_push(vm, target);
+        vm_push(vm, OBJ_VAL(key));
         vm_map_insert(vm, map, key, value);
+        vm->sp -= 2;
     } else {
         vm_error(vm, "expected an array or a map but got %s",
                  value_description(target));
@@ -568,6 +793,40 @@ static void vm_close_upvalues(Vm *vm, Value *last) {
     }
 }
 
+// Calls a closure in place of the function on top of the call stack, its
+// arguments are moved down to the slots of the frame so recursing in tail
+// position does not grow either stack, anything else is called as usual
+bool vm_tail_call_value(Vm *vm, Value callee, uint8_t argc) {
+    if (!IS_CLOSURE(callee)) {
+        return vm_call_value(vm, callee, argc);
+    }
+
+    ObjClosure *closure = AS_CLOSURE(callee);
+
+    if (argc != closure->fn->arity) {
+        vm_error(vm, "expected %d arguments but got %d instead",
+                 closure->fn->arity, argc);
+
+        return false;
+    }
+
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+
+    vm_close_upvalues(vm, frame->slots);
+
+    memmove(frame->slots, vm->sp - argc, argc * sizeof(Value));
+
+    vm->sp = frame->slots + argc;
+
+    vm_reserve_stack(vm, closure->fn->chunk.stack_size + VM_STACK_SLACK);
+
+    frame->closure = closure;
+    frame->ip = closure->fn->chunk.bytes;
+    frame->pc = closure->fn->chunk.code;
+
+    return true;
+}
+
 static bool vm_make_slice(Vm *vm) {
     Value target = vm_pop(vm);
 
@@ -592,53 +851,62 @@ static bool vm_make_slice(Vm *vm) {
     double fstart = AS_NUM(start);
     double fend = AS_NUM(end);
 
-    if (IS_ARRAY(target)) {
-        ObjArray *array = AS_ARRAY(target);
+    if (IS_ARRAY(target) || IS_TYPED_ARRAY(target)) {
+        uint32_t count = vm_elements_count(target);
 
         if (fstart < 0) {
-            fstart += array->count;
+            fstart += count;
         }
 
         if (fend < 0) {
-            fend += array->count;
+            fend += count;
         }
 
-        if (fstart < 0 || fstart >= array->count ||
-            (fstart - floor(fstart)) != 0) {
+        if (fstart < 0 || fstart >= count || (fstart - floor(fstart)) != 0) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(fstart, buffer);
+
             vm_error(vm,
                      "sliced array has %d elements, the slice start must be an "
-                     "integer less than that and greater than zero, but got %g",
-                     array->count, fstart);
+                     "integer less than that and greater than zero, but got %s",
+                     count, buffer);
 
             return false;
         }
 
-        if (fend < 0 || fend > array->count || (fend - floor(fend)) != 0) {
+        if (fend < 0 || fend > count || (fend - floor(fend)) != 0) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(fend, buffer);
+
             vm_error(vm,
                      "sliced array has %d elements, the slice end must be an "
-                     "integer less than that and greater than zero, but got %g",
-                     array->count, fend);
+                     "integer less than that and greater than zero, but got %s",
+                     count, buffer);
 
             return false;
         }
 
         if (fstart > fend) {
+            char start_buffer[NUMBER_FORMAT_MAX];
+            number_format(fstart, start_buffer);
+
+            char end_buffer[NUMBER_FORMAT_MAX];
+            number_format(fend, end_buffer);
+
             vm_error(
                 vm,
                 "slicing start must be less than or equal to slicing end, got "
-                "%g as a start and %g as an end",
-                fstart, fend);
+                "%s as a start and %s as an end",
+                start_buffer, end_buffer);
 
             return false;
         }
 
-        vm_push(vm, OBJ_VAL(vm_copy_array(vm, array->items + (size_t)fstart,
-                                          fend - fstart)));
+        vm_push_array_slice(vm, target, fstart, fend);
     } else if (IS_STRING(target)) {
         ObjString *string = AS_STRING(target);
 
-        int64_t characters_count = string_utf8_characters_count(
-            string->items, string->items + string->count);
+        int64_t characters_count = vm_string_length(string);
 
         if (fstart < 0) {
             fstart += characters_count;
@@ -650,53 +918,49 @@ static bool vm_make_slice(Vm *vm) {
 
         if (fstart < 0 || fstart >= characters_count ||
             (fstart - floor(fstart)) != 0) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(fstart, buffer);
+
             vm_error(
                 vm,
                 "sliced string has %ld characters, the slice start must be "
-                "an integer less than that and greater than zero, but got %g",
-                characters_count, fstart);
+                "an integer less than that and greater than zero, but got %s",
+                characters_count, buffer);
 
             return false;
         }
 
         if (fend < 0 || fend > characters_count || (fend - floor(fend)) != 0) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(fend, buffer);
+
             vm_error(
                 vm,
                 "sliced string has %ld characters, the slice end must be "
-                "an integer less than that and greater than zero, but got %g",
-                characters_count, fend);
+                "an integer less than that and greater than zero, but got %s",
+                characters_count, buffer);
 
             return false;
         }
 
         if (fstart > fend) {
+            char start_buffer[NUMBER_FORMAT_MAX];
+            number_format(fstart, start_buffer);
+
+            char end_buffer[NUMBER_FORMAT_MAX];
+            number_format(fend, end_buffer);
+
             vm_error(
                 vm,
                 "slicing start must be less than or equal to slicing end, got "
-                "%g as a start and %g as an end",
-                fstart, fend);
+                "%s as a start and %s as an end",
+                start_buffer, end_buffer);
 
             return false;
         }
 
-        const char *b = string->items;
-
-        int64_t c = 0;
-
-        while (c++ < fstart) {
-            b = string_utf8_skip_character(b);
-        }
-
-        int64_t astart = b - string->items;
-
-        while (c++ <= fend) {
-            b = string_utf8_skip_character(b);
-        }
-
-        int64_t aend = b - string->items;
-
-        vm_push(vm, OBJ_VAL(vm_copy_string(vm, string->items + astart,
-                                           aend - astart)));
+        vm_push_string_slice(vm, string, vm_string_character(string, fstart),
+                      vm_string_character(string, fend));
     } else {
         vm_error(vm, "expected an array or a string, got %s",
                  value_description(target));
@@ -721,53 +985,50 @@ static bool vm_make_slice_under(Vm *vm) {
 
     double fend = AS_NUM(end);
 
-    if (IS_ARRAY(target)) {
-        ObjArray *array = AS_ARRAY(target);
+    if (IS_ARRAY(target) || IS_TYPED_ARRAY(target)) {
+        uint32_t count = vm_elements_count(target);
 
         if (fend < 0) {
-            fend += array->count;
+            fend += count;
         }
 
-        if (fend < 0 || fend > array->count || (fend - floor(fend)) != 0) {
+        if (fend < 0 || fend > count || (fend - floor(fend)) != 0) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(fend, buffer);
+
             vm_error(vm,
                      "sliced array has %d elements, the slice end must be an "
-                     "integer less than that and greater than zero, but got %g",
-                     array->count, fend);
+                     "integer less than that and greater than zero, but got %s",
+                     count, buffer);
 
             return false;
         }
 
-        vm_push(vm, OBJ_VAL(vm_copy_array(vm, array->items, fend)));
+        vm_push_array_slice(vm, target, 0, fend);
     } else if (IS_STRING(target)) {
         ObjString *string = AS_STRING(target);
 
-        int64_t characters_count = string_utf8_characters_count(
-            string->items, string->items + string->count);
+        int64_t characters_count = vm_string_length(string);
 
         if (fend < 0) {
             fend += characters_count;
         }
 
         if (fend < 0 || fend > characters_count || (fend - floor(fend)) != 0) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(fend, buffer);
+
             vm_error(
                 vm,
                 "sliced string has %ld characters, the slice end must be "
-                "an integer less than that and greater than zero, but got %g",
-                characters_count, fend);
+                "an integer less than that and greater than zero, but got %s",
+                characters_count, buffer);
 
             return false;
         }
 
-        const char *b = string->items;
-
-        int64_t c = 0;
-
-        while (++c <= fend) {
-            b = string_utf8_skip_character(b);
-        }
-
-        vm_push(vm,
-                OBJ_VAL(vm_copy_string(vm, string->items, b - string->items)));
+        vm_push_string_slice(vm, string, string->items,
+                      vm_string_character(string, fend));
     } else {
         vm_error(vm, "expected an array or a string, got %s",
                  value_description(target));
@@ -792,30 +1053,30 @@ static bool vm_make_slice_above(Vm *vm) {
 
     double fstart = AS_NUM(start);
 
-    if (IS_ARRAY(target)) {
-        ObjArray *array = AS_ARRAY(target);
+    if (IS_ARRAY(target) || IS_TYPED_ARRAY(target)) {
+        uint32_t count = vm_elements_count(target);
 
         if (fstart < 0) {
-            fstart += array->count;
+            fstart += count;
         }
 
-        if (fstart < 0 || fstart >= array->count ||
-            (fstart - floor(fstart)) != 0) {
+        if (fstart < 0 || fstart >= count || (fstart - floor(fstart)) != 0) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(fstart, buffer);
+
             vm_error(vm,
                      "sliced array has %d elements, the slice start must be an "
-                     "integer less than that and greater than zero, but got %g",
-                     array->count, fstart);
+                     "integer less than that and greater than zero, but got %s",
+                     count, buffer);
 
             return false;
         }
 
-        vm_push(vm, OBJ_VAL(vm_copy_array(vm, array->items + (size_t)fstart,
-                                          array->count - fstart)));
+        vm_push_array_slice(vm, target, fstart, count);
     } else if (IS_STRING(target)) {
         ObjString *string = AS_STRING(target);
 
-        int64_t characters_count = string_utf8_characters_count(
-            string->items, string->items + string->count);
+        int64_t characters_count = vm_string_length(string);
 
         if (fstart < 0) {
             fstart += characters_count;
@@ -823,26 +1084,20 @@ static bool vm_make_slice_above(Vm *vm) {
 
         if (fstart < 0 || fstart >= characters_count ||
             (fstart - floor(fstart)) != 0) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(fstart, buffer);
+
             vm_error(
                 vm,
                 "sliced string has %ld characters, the slice start must be "
-                "an integer less than that and greater than zero, but got %g",
-                characters_count, fstart);
+                "an integer less than that and greater than zero, but got %s",
+                characters_count, buffer);
 
             return false;
         }
 
-        const char *b = string->items;
-
-        int64_t c = 0;
-
-        while (c++ < fstart) {
-            b = string_utf8_skip_character(b);
-        }
-
-        vm_push(vm,
-                OBJ_VAL(vm_copy_string(
-                    vm, b, string->count - (uintptr_t)(b - string->items))));
+        vm_push_string_slice(vm, string, vm_string_character(string, fstart),
+                      string->items + string->count);
     } else {
         vm_error(vm, "expected an array or a string, got %s",
                  value_description(target));
@@ -853,558 +1108,643 @@ static bool vm_make_slice_above(Vm *vm) {
     return true;
 }
 
-static inline bool vm_execute_math(Vm *vm, OpCode op) {
-    switch (op) {
-    case OP_ADD: {
-        if (!vm_add(vm)) {
-            return false;
-        }
+// Operands are passed by value so that register-style opcodes can feed frame
+// slots and constants directly, callers must keep them reachable (on the stack
+// or in a slot) since string concatenation may trigger the garbage collector
+static bool vm_make_map(Vm *vm, uint32_t count) {
+    ObjMap *map = vm_new_map(vm);
 
-        break;
-    }
+    Value *start = vm->sp - count * 2;
 
-    case OP_SUB: {
-        if (!vm_sub(vm)) {
-            return false;
-        }
+    // Inserting can collect garbage
+    vm_push(vm, OBJ_VAL(map));
 
-        break;
-    }
+    for (uint32_t i = 0; i < count * 2; i += 2) {
+        if (!IS_STRING(start[i])) {
+            vm_error(vm, "expected a string got %s",
+                     value_description(start[i]));
 
-    case OP_MUL: {
-        if (!vm_mul(vm)) {
             return false;
         }
 
-        break;
-    }
-
-    case OP_DIV: {
-        if (!vm_div(vm)) {
-            return false;
-        }
+        ObjString *key = vm_intern_string(vm, AS_STRING(start[i]));
+        start[i] = OBJ_VAL(key);
+        Value value = start[i + 1];
 
-        break;
+        vm_map_insert(vm, map, key, value);
     }
 
-    case OP_MOD: {
-        if (!vm_mod(vm)) {
-            return false;
-        }
+    vm->sp = start;
 
-        break;
-    }
+    vm_push(vm, OBJ_VAL(map));
 
-    case OP_POW: {
-        if (!vm_pow(vm)) {
-            return false;
-        }
+    return true;
+}
 
-        break;
+static inline bool vm_cache_lookup(const InlineCache *cache, const ObjMap *map,
+                                   uint32_t *index) {
+    if (map->shape == 0) {
+        return false;
     }
 
-    default:
-        assert(false && "UNREACHABLE");
+    for (size_t i = 0; i < INLINE_CACHE_WAYS; i++) {
+        if (cache->shapes[i] == map->shape) {
+            *index = cache->indexes[i];
+            return true;
+        }
     }
 
-    return true;
+    return false;
 }
 
-bool vm_run(Vm *vm, Value *result) {
-    CallFrame *frame = &vm->frames[vm->frame_count - 1];
-
-#include "vm_readers.h"
-
-#define vmfetch() op = READ_BYTE();
-
-#ifdef NUR_NO_JUMPTABLE
-#define vmdispatch() switch (op)
-#define vmcase(op) case op:
-#define vmbreak() break
-#else
-#include "vm_jumptable.h"
-#endif
-
-    OpCode op;
-
-    for (;;) {
-        vmfetch();
-
-        vmdispatch() {
-            vmcase(OP_POP) {
-                vm_pop(vm);
-                vmbreak();
-            }
-
-            vmcase(OP_DUP) {
-                vm_push(vm, vm_peek(vm, 0));
-                vmbreak();
-            }
-
-            vmcase(OP_SWP) {
-                Value a = vm_peek(vm, 0);
-                Value b = vm_peek(vm, 1);
-                vm_poke(vm, 0, b);
-                vm_poke(vm, 1, a);
-                vmbreak();
-            }
-
-            vmcase(OP_PUSH_NULL) {
-                vm_push(vm, NULL_VAL);
-                vmbreak();
-            }
-
-            vmcase(OP_PUSH_TRUE) {
-                vm_push(vm, BOOL_VAL(true));
-                vmbreak();
-            }
-
-            vmcase(OP_PUSH_FALSE) {
-                vm_push(vm, BOOL_VAL(false));
-                vmbreak();
-            }
-
-            vmcase(OP_PUSH_CONST) {
-                vm_push(vm, READ_CONSTANT());
-                vmbreak();
-            }
-
-            vmcase(OP_GET_LOCAL) {
-                vm_push(vm, frame->slots[READ_BYTE()]);
-                vmbreak();
-            }
-
-            vmcase(OP_SET_LOCAL) {
-                frame->slots[READ_BYTE()] = vm_peek(vm, 0);
-                vmbreak();
-            }
-
-            vmcase(OP_SET_LOCAL_WITH_MATH) {
-                OpCode op = READ_BYTE();
-                uint8_t index = READ_BYTE();
-
-                Value rhs = vm_pop(vm);
-                Value lhs = frame->slots[index];
-
-                vm_push(vm, lhs);
-                vm_push(vm, rhs);
-
-                vm_execute_math(vm, op);
-
-                frame->slots[index] = vm_peek(vm, 0);
-                vmbreak();
-            }
-
-            vmcase(OP_GET_UPVALUE) {
-                vm_push(vm, *frame->closure->upvalues[READ_BYTE()]->location);
-                vmbreak();
-            }
-
-            vmcase(OP_SET_UPVALUE) {
-                *frame->closure->upvalues[READ_BYTE()]->location =
-                    vm_peek(vm, 0);
-                vmbreak();
-            }
-
-            vmcase(OP_SET_UPVALUE_WITH_MATH) {
-                OpCode op = READ_BYTE();
-                uint8_t index = READ_BYTE();
-
-                Value rhs = vm_pop(vm);
-                Value lhs = *frame->closure->upvalues[index]->location;
-
-                vm_push(vm, lhs);
-                vm_push(vm, rhs);
-
-                vm_execute_math(vm, op);
-
-                *frame->closure->upvalues[index]->location = vm_peek(vm, 0);
-
-                vmbreak();
-            }
-
-            vmcase(OP_CLOSE_UPVALUE) {
-                vm_close_upvalues(vm, vm->sp - 1);
-                vm_pop(vm);
-                vmbreak();
-            }
-
-            vmcase(OP_GET_GLOBAL) {
-                ObjString *key = READ_STRING();
-
-                Value value;
-
-                if (!vm_map_lookup(frame->closure->fn->globals, key, &value)) {
-                    vm_error(vm, "'%.*s' is not defined", (int)key->count,
-                             key->items);
-
-                    return false;
-                }
+// Called after a lookup missed the cache, the most recently seen shape goes
+// first and the least recently seen one is evicted
+static void vm_cache_update(InlineCache *cache, ObjMap *map, ObjString *key) {
+    uint32_t index;
 
-                vm_push(vm, value);
-
-                vmbreak();
-            }
-
-            vmcase(OP_SET_GLOBAL) {
-                vm_map_insert(vm, frame->closure->fn->globals, READ_STRING(),
-                              vm_peek(vm, 0));
-
-                vmbreak();
-            }
-
-            vmcase(OP_SET_GLOBAL_WITH_MATH) {
-                OpCode op = READ_BYTE();
-                ObjString *key = READ_STRING();
-
-                Value rhs = vm_pop(vm);
-                Value lhs;
-
-                if (!vm_map_lookup(frame->closure->fn->globals, key, &lhs)) {
-                    vm_error(vm,
-                             "'%.*s' is not "
-                             "defined",
-                             (int)key->count, key->items);
-
-                    return false;
-                }
-
-                vm_push(vm, lhs);
-                vm_push(vm, rhs);
-
-                vm_execute_math(vm, op);
-
-                vm_map_insert(vm, frame->closure->fn->globals, key,
-                              vm_peek(vm, 0));
+    if (!vm_map_lookup_index(map, key, &index)) {
+        return;
+    }
 
-                vmbreak();
-            }
+    uint32_t shape = vm_map_shape(map);
 
-            vmcase(OP_GET_SUBSCRIPT) {
-                Value target = vm_pop(vm);
-                Value index = vm_pop(vm);
+    if (shape == 0) {
+        return;
+    }
 
-                if (!vm_get_subscript(vm, target, index)) {
-                    return false;
-                }
+    for (size_t i = INLINE_CACHE_WAYS - 1; i > 0; i--) {
+        cache->shapes[i] = cache->shapes[i - 1];
+        cache->indexes[i] = cache->indexes[i - 1];
+    }
 
-                vmbreak();
-            }
+    cache->shapes[0] = shape;
+    cache->indexes[0] = index;
+}
 
-            vmcase(OP_SET_SUBSCRIPT) {
-                Value target = vm_pop(vm);
-                Value index = vm_pop(vm);
+// The numeric-only counterpart of vm_execute_math used by quickened opcodes,
+// returns false without reporting an error when one of the operands is not a
+// number so that the caller can deoptimize the instruction. Two integers stay
+// integers unless the result does not fit or is a -0 which only doubles have.
+// It is forced inline so that the checks fold into the handlers
+[[gnu::always_inline]] static inline bool
+vm_execute_num(OpCode op, Value lhs, Value rhs, Value *result) {
+    double a;
+    double b;
+
+    // Not short-circuited so that integers take a single branch
+    if (IS_INT(lhs) & IS_INT(rhs)) {
+        int64_t i = AS_INT(lhs);
+        int64_t j = AS_INT(rhs);
+        int64_t r;
+
+        // The most common operations are tested before the jump table
+        if (op == OP_ADD) {
+            r = i + j;
+        } else if (op == OP_SUB) {
+            r = i - j;
+        } else if (op == OP_LT) {
+            *result = BOOL_VAL(i < j);
+            return true;
+        } else {
+            switch (op) {
+            case OP_MUL:
+                r = i * j;
 
-                if (!vm_set_subscript(vm, target, index)) {
-                    return false;
+                if (r == 0 && (i < 0 || j < 0)) {
+                    r = INT64_MAX;
                 }
 
-                vmbreak();
-            }
+                break;
 
-            vmcase(OP_SET_SUBSCRIPT_WITH_MATH) {
-                OpCode op = READ_BYTE();
+            case OP_MOD:
+                // rem_euclid gives -0 for negative multiples
+                r = i >= 0 && j > 0 ? i % j : INT64_MAX;
+                break;
 
-                Value target = vm_pop(vm);
-                Value index = vm_pop(vm);
-                Value rhs = vm_pop(vm);
+            case OP_GT:
+                *result = BOOL_VAL(i > j);
+                return true;
 
-                if (!vm_get_subscript(vm, target, index)) {
-                    return false;
-                }
+            case OP_LTE:
+                *result = BOOL_VAL(i <= j);
+                return true;
 
-                vm_push(vm, rhs);
+            case OP_GTE:
+                *result = BOOL_VAL(i >= j);
+                return true;
 
-                if (!vm_execute_math(vm, op)) {
-                    return false;
-                }
+            case OP_EQL:
+                *result = BOOL_VAL(i == j);
+                return true;
 
-                if (!vm_set_subscript(vm, target, index)) {
-                    return false;
-                }
+            case OP_NEQ:
+                *result = BOOL_VAL(i != j);
+                return true;
 
-                vmbreak();
+            default:
+                r = INT64_MAX;
+                break;
             }
+        }
 
-            vmcase(OP_MAKE_ARRAY) {
-                uint32_t count = READ_WORD();
+        if (r >= INT32_MIN && r <= INT32_MAX) {
+            *result = INT_VAL((int32_t)r);
+            return true;
+        }
 
-                ObjArray *array = vm_copy_array(vm, vm->sp - count, count);
+        a = i;
+        b = j;
+    } else if (IS_DOUBLE(lhs) && IS_DOUBLE(rhs)) {
+        a = AS_DOUBLE(lhs);
+        b = AS_DOUBLE(rhs);
+    } else if (IS_NUM(lhs) && IS_NUM(rhs)) {
+        a = AS_NUM(lhs);
+        b = AS_NUM(rhs);
+    } else {
+        return false;
+    }
 
-                vm->sp -= count;
+    switch (op) {
+    case OP_ADD:
+        *result = NUMBER_VAL(a + b);
+        return true;
 
-                vm_push(vm, OBJ_VAL(array));
+    case OP_SUB:
+        *result = NUMBER_VAL(a - b);
+        return true;
 
-                vmbreak();
-            }
+    case OP_MUL:
+        *result = NUMBER_VAL(a * b);
+        return true;
 
-            vmcase(OP_COPY_BY_SLICING) {
-                Value target = vm_pop(vm);
+    case OP_DIV:
+        *result = NUMBER_VAL(a / b);
+        return true;
 
-                if (IS_ARRAY(target)) {
-                    ObjArray *array = AS_ARRAY(target);
+    case OP_MOD:
+        *result = NUMBER_VAL(rem_euclid(a, b));
+        return true;
 
-                    vm_push(vm, OBJ_VAL(vm_copy_array(vm, array->items,
-                                                      array->count)));
-                } else if (IS_STRING(target)) {
-                    ObjString *string = AS_STRING(target);
+    case OP_POW:
+        *result = NUMBER_VAL(pow(a, b));
+        return true;
 
-                    vm_push(vm, OBJ_VAL(vm_copy_string(vm, string->items,
-                                                       string->count)));
-                } else {
-                    vm_error(vm, "%s is not an array value",
-                             value_description(target));
+    case OP_LT:
+        *result = BOOL_VAL(a < b);
+        return true;
 
-                    return false;
-                }
+    case OP_GT:
+        *result = BOOL_VAL(a > b);
+        return true;
 
-                vmbreak();
-            }
+    case OP_LTE:
+        *result = BOOL_VAL(a <= b);
+        return true;
 
-            vmcase(OP_MAKE_SLICE) {
-                if (!vm_make_slice(vm)) {
-                    return false;
-                }
+    case OP_GTE:
+        *result = BOOL_VAL(a >= b);
+        return true;
 
-                vmbreak();
-            }
+    case OP_EQL:
+        *result = BOOL_VAL(a == b);
+        return true;
 
-            vmcase(OP_MAKE_SLICE_UNDER) {
-                if (!vm_make_slice_under(vm)) {
-                    return false;
-                }
+    case OP_NEQ:
+        *result = BOOL_VAL(a != b);
+        return true;
 
-                vmbreak();
-            }
+    default:
+        assert(false && "UNREACHABLE");
+        return false;
+    }
+}
 
-            vmcase(OP_MAKE_SLICE_ABOVE) {
-                if (!vm_make_slice_above(vm)) {
-                    return false;
-                }
+bool vm_execute_math(Vm *vm, OpCode op, Value lhs, Value rhs,
+                     Value *result) {
+    if (vm_execute_num(op, lhs, rhs, result)) {
+        return true;
+    }
 
-                vmbreak();
-            }
+    switch (op) {
+    case OP_ADD:
+        return vm_add(vm, lhs, rhs, result);
 
-            vmcase(OP_MAKE_MAP) {
-                uint32_t count = READ_WORD();
+    case OP_SUB:
+        return vm_sub(vm, lhs, rhs, result);
 
-                ObjMap *map = vm_new_map(vm);
+    case OP_MUL:
+        return vm_mul(vm, lhs, rhs, result);
 
-                Value *start = vm->sp - count * 2;
+    case OP_DIV:
+        return vm_div(vm, lhs, rhs, result);
 
-                for (uint32_t i = 0; i < count * 2; i += 2) {
-                    if (!IS_STRING(start[i])) {
-                        vm_error(vm, "expected a string got %s",
-                                 value_description(start[i]));
+    case OP_MOD:
+        return vm_mod(vm, lhs, rhs, result);
 
-                        return false;
-                    }
+    case OP_POW:
+        return vm_pow(vm, lhs, rhs, result);
 
-                    ObjString *key = AS_STRING(start[i]);
-                    Value value = start[i + 1];
+    case OP_LT:
+        return vm_lt(vm, lhs, rhs, result);
 
-                    vm_map_insert(vm, map, key, value);
-                }
+    case OP_GT:
+        return vm_gt(vm, lhs, rhs, result);
 
-                vm->sp = start;
+    case OP_LTE:
+        return vm_lte(vm, lhs, rhs, result);
 
-                vm_push(vm, OBJ_VAL(map));
+    case OP_GTE:
+        return vm_gte(vm, lhs, rhs, result);
 
-                vmbreak();
-            }
+    case OP_EQL:
+        *result = BOOL_VAL(values_equal(lhs, rhs));
+        return true;
 
-            vmcase(OP_MAKE_CLOSURE) {
-                ObjFunction *fn = AS_FUNCTION(READ_CONSTANT());
+    case OP_NEQ:
+        *result = BOOL_VAL(!values_equal(lhs, rhs));
+        return true;
 
-                fn->globals = frame->closure->fn->globals;
+    default:
+        assert(false && "UNREACHABLE");
+        return false;
+    }
+}
 
-                ObjClosure *closure = vm_new_closure(vm, fn);
+bool vm_get_member(Vm *vm, ObjString *key, InlineCache *cache) {
+    Value target = vm_pop(vm);
 
-                for (uint8_t i = 0; i < fn->upvalues_count; i++) {
-                    uint8_t is_local = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+    uint32_t index;
 
-                    if (is_local) {
-                        closure->upvalues[i] =
-                            vm_capture_upvalue(vm, frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
+    if (IS_MAP(target) && vm_cache_lookup(cache, AS_MAP(target), &index)) {
+        vm_push(vm, AS_MAP(target)->entries[index].value);
+        return true;
+    }
 
-                vm_push(vm, OBJ_VAL(closure));
+    if (!vm_get_subscript(vm, target, OBJ_VAL(key))) {
+        return false;
+    }
 
-                vmbreak();
-            }
+    if (IS_MAP(target)) {
+        vm_cache_update(cache, AS_MAP(target), key);
+    }
 
-            vmcase(OP_EQL) {
-                vm_push(vm, BOOL_VAL(values_equal(vm_pop(vm), vm_pop(vm))));
-                vmbreak();
-            }
+    return true;
+}
 
-            vmcase(OP_NEQ) {
-                vm_push(vm, BOOL_VAL(!values_equal(vm_pop(vm), vm_pop(vm))));
-                vmbreak();
-            }
+bool vm_set_member(Vm *vm, ObjString *key, InlineCache *cache) {
+    Value target = vm_pop(vm);
 
-            vmcase(OP_NOT) {
-                vm_poke(vm, 0, BOOL_VAL(value_is_falsey(vm_peek(vm, 0))));
-                vmbreak();
-            }
+    uint32_t index;
 
-            vmcase(OP_NEG) {
-                if (!vm_neg(vm)) {
-                    return false;
-                }
+    if (IS_MAP(target) && vm_cache_lookup(cache, AS_MAP(target), &index)) {
+        AS_MAP(target)->entries[index].value = vm_peek(vm, 0);
+        return true;
+    }
 
-                vmbreak();
-            }
+    if (!vm_set_subscript(vm, target, OBJ_VAL(key))) {
+        return false;
+    }
 
-            vmcase(OP_ADD) {
-                if (!vm_add(vm)) {
-                    return false;
-                }
+    if (IS_MAP(target)) {
+        vm_cache_update(cache, AS_MAP(target), key);
+    }
 
-                vmbreak();
-            }
+    return true;
+}
 
-            vmcase(OP_SUB) {
-                if (!vm_sub(vm)) {
-                    return false;
-                }
+bool vm_set_member_with_math(Vm *vm, OpCode op, ObjString *key,
+                             InlineCache *cache) {
+    // Both stay on the stack until the end since concatenating may trigger the
+    // garbage collector
+    Value target = vm_peek(vm, 0);
+    Value rhs = vm_peek(vm, 1);
 
-                vmbreak();
-            }
+    Value result;
 
-            vmcase(OP_MUL) {
-                if (!vm_mul(vm)) {
-                    return false;
-                }
+    uint32_t index;
 
-                vmbreak();
-            }
+    if (IS_MAP(target) && vm_cache_lookup(cache, AS_MAP(target), &index)) {
+        Value lhs = AS_MAP(target)->entries[index].value;
 
-            vmcase(OP_DIV) {
-                if (!vm_div(vm)) {
-                    return false;
-                }
+        if (!vm_execute_math(vm, op, lhs, rhs, &result)) {
+            return false;
+        }
 
-                vmbreak();
-            }
+        AS_MAP(target)->entries[index].value = result;
+    } else {
+        if (!vm_get_subscript(vm, target, OBJ_VAL(key))) {
+            return false;
+        }
 
-            vmcase(OP_MOD) {
-                if (!vm_mod(vm)) {
-                    return false;
-                }
+        if (!vm_execute_math(vm, op, vm_peek(vm, 0), rhs, &result)) {
+            return false;
+        }
 
-                vmbreak();
-            }
+        vm_poke(vm, 0, result);
 
-            vmcase(OP_POW) {
-                if (!vm_pow(vm)) {
-                    return false;
-                }
+        if (!vm_set_subscript(vm, target, OBJ_VAL(key))) {
+            return false;
+        }
 
-                vmbreak();
-            }
+        vm_pop(vm);
 
-            vmcase(OP_LT) {
-                if (!vm_lt(vm)) {
-                    return false;
-                }
+        if (IS_MAP(target)) {
+            vm_cache_update(cache, AS_MAP(target), key);
+        }
+    }
 
-                vmbreak();
-            }
+    vm_pop(vm);
+    vm_poke(vm, 0, result);
 
-            vmcase(OP_GT) {
-                if (!vm_gt(vm)) {
-                    return false;
-                }
+    return true;
+}
 
-                vmbreak();
-            }
+// Replaces the operand below `sp` with the result of applying `op` to the two
+// values on top of the stack, leaving the caller to drop the top one
+static inline bool vm_execute_math_on_stack(Vm *vm, Value *sp, OpCode op) {
+    return vm_execute_math(vm, op, sp[-2], sp[-1], &sp[-2]);
+}
 
-            vmcase(OP_LTE) {
-                if (!vm_lte(vm)) {
-                    return false;
-                }
+static inline bool vm_execute_num_on_stack(Value *sp, OpCode op) {
+    return vm_execute_num(op, sp[-2], sp[-1], &sp[-2]);
+}
 
-                vmbreak();
+#ifdef NUR_PROFILE_OPCODES
+static const char *opcode_names[UINT8_MAX + 1] = {
+    [OP_POP] = "POP",
+    [OP_DUP] = "DUP",
+    [OP_SWP] = "SWP",
+    [OP_PUSH_NULL] = "PUSH_NULL",
+    [OP_PUSH_TRUE] = "PUSH_TRUE",
+    [OP_PUSH_FALSE] = "PUSH_FALSE",
+    [OP_PUSH_CONST] = "PUSH_CONST",
+    [OP_GET_LOCAL] = "GET_LOCAL",
+    [OP_SET_LOCAL] = "SET_LOCAL",
+    [OP_SET_LOCAL_WITH_MATH] = "SET_LOCAL_WITH_MATH",
+    [OP_SET_LOCAL_WITH_MATH_LOCAL] = "SET_LOCAL_WITH_MATH_LOCAL",
+    [OP_SET_LOCAL_WITH_MATH_CONST] = "SET_LOCAL_WITH_MATH_CONST",
+    [OP_GET_UPVALUE] = "GET_UPVALUE",
+    [OP_SET_UPVALUE] = "SET_UPVALUE",
+    [OP_SET_UPVALUE_WITH_MATH] = "SET_UPVALUE_WITH_MATH",
+    [OP_CLOSE_UPVALUE] = "CLOSE_UPVALUE",
+    [OP_GET_GLOBAL] = "GET_GLOBAL",
+    [OP_SET_GLOBAL] = "SET_GLOBAL",
+    [OP_SET_GLOBAL_WITH_MATH] = "SET_GLOBAL_WITH_MATH",
+    [OP_GET_SUBSCRIPT] = "GET_SUBSCRIPT",
+    [OP_SET_SUBSCRIPT] = "SET_SUBSCRIPT",
+    [OP_SET_SUBSCRIPT_WITH_MATH] = "SET_SUBSCRIPT_WITH_MATH",
+    [OP_GET_MEMBER] = "GET_MEMBER",
+    [OP_SET_MEMBER] = "SET_MEMBER",
+    [OP_SET_MEMBER_WITH_MATH] = "SET_MEMBER_WITH_MATH",
+    [OP_MAKE_ARRAY] = "MAKE_ARRAY",
+    [OP_MAKE_MAP] = "MAKE_MAP",
+    [OP_MAKE_SHAPED_MAP] = "MAKE_SHAPED_MAP",
+    [OP_MAKE_CLOSURE] = "MAKE_CLOSURE",
+    [OP_MAKE_SLICE] = "MAKE_SLICE",
+    [OP_MAKE_SLICE_ABOVE] = "MAKE_SLICE_ABOVE",
+    [OP_MAKE_SLICE_UNDER] = "MAKE_SLICE_UNDER",
+    [OP_COPY_BY_SLICING] = "COPY_BY_SLICING",
+    [OP_NEG] = "NEG",
+    [OP_NOT] = "NOT",
+    [OP_ADD] = "ADD",
+    [OP_SUB] = "SUB",
+    [OP_MUL] = "MUL",
+    [OP_DIV] = "DIV",
+    [OP_POW] = "POW",
+    [OP_MOD] = "MOD",
+    [OP_EQL] = "EQL",
+    [OP_NEQ] = "NEQ",
+    [OP_LT] = "LT",
+    [OP_GT] = "GT",
+    [OP_LTE] = "LTE",
+    [OP_GTE] = "GTE",
+    [OP_MATH_LOCAL_LOCAL] = "MATH_LOCAL_LOCAL",
+    [OP_MATH_LOCAL_CONST] = "MATH_LOCAL_CONST",
+    [OP_CALL] = "CALL",
+    [OP_TAIL_CALL] = "TAIL_CALL",
+    [OP_POP_JUMP_IF_FALSE] = "POP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+    [OP_JUMP] = "JUMP",
+    [OP_LOOP] = "LOOP",
+    [OP_RETURN] = "RETURN",
+    [OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE] = "MATH_LOCAL_LOCAL_JUMP_IF_FALSE",
+    [OP_MATH_LOCAL_CONST_JUMP_IF_FALSE] = "MATH_LOCAL_CONST_JUMP_IF_FALSE",
+    [OP_SET_LOCAL_WITH_MATH_LOCAL_POP] = "SET_LOCAL_WITH_MATH_LOCAL_POP",
+    [OP_SET_LOCAL_WITH_MATH_CONST_POP] = "SET_LOCAL_WITH_MATH_CONST_POP",
+    [OP_SET_LOCAL_POP] = "SET_LOCAL_POP",
+    [OP_GET_SUBSCRIPT_LOCAL_CONST] = "GET_SUBSCRIPT_LOCAL_CONST",
+    [OP_CALL_UPVALUE] = "CALL_UPVALUE",
+    [OP_CALL_GLOBAL] = "CALL_GLOBAL",
+    [OP_ADD_NUM] = "ADD_NUM",
+    [OP_SUB_NUM] = "SUB_NUM",
+    [OP_MUL_NUM] = "MUL_NUM",
+    [OP_LT_NUM] = "LT_NUM",
+    [OP_GT_NUM] = "GT_NUM",
+    [OP_LTE_NUM] = "LTE_NUM",
+    [OP_GTE_NUM] = "GTE_NUM",
+    [OP_SET_LOCAL_WITH_MATH_NUM] = "SET_LOCAL_WITH_MATH_NUM",
+    [OP_SET_LOCAL_WITH_MATH_LOCAL_NUM] = "SET_LOCAL_WITH_MATH_LOCAL_NUM",
+    [OP_SET_LOCAL_WITH_MATH_CONST_NUM] = "SET_LOCAL_WITH_MATH_CONST_NUM",
+    [OP_SET_UPVALUE_WITH_MATH_NUM] = "SET_UPVALUE_WITH_MATH_NUM",
+    [OP_SET_GLOBAL_WITH_MATH_NUM] = "SET_GLOBAL_WITH_MATH_NUM",
+    [OP_SET_SUBSCRIPT_WITH_MATH_NUM] = "SET_SUBSCRIPT_WITH_MATH_NUM",
+    [OP_MATH_LOCAL_LOCAL_NUM] = "MATH_LOCAL_LOCAL_NUM",
+    [OP_MATH_LOCAL_CONST_NUM] = "MATH_LOCAL_CONST_NUM",
+    [OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM] =
+        "MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM",
+    [OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM] =
+        "MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM",
+    [OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM] =
+        "SET_LOCAL_WITH_MATH_LOCAL_POP_NUM",
+    [OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM] =
+        "SET_LOCAL_WITH_MATH_CONST_POP_NUM",
+};
+
+static uint64_t opcode_pairs[UINT8_MAX + 1][UINT8_MAX + 1];
+static uint8_t previous_opcode;
+
+static void vm_profile_report(void) {
+    enum { TOP = 32 };
+
+    uint64_t counts[TOP] = {0};
+    uint16_t pairs[TOP][2] = {0};
+
+    for (size_t a = 0; a <= UINT8_MAX; a++) {
+        for (size_t b = 0; b <= UINT8_MAX; b++) {
+            uint64_t count = opcode_pairs[a][b];
+
+            if (count <= counts[TOP - 1]) {
+                continue;
             }
 
-            vmcase(OP_GTE) {
-                if (!vm_gte(vm)) {
-                    return false;
-                }
+            size_t i = TOP - 1;
 
-                vmbreak();
+            for (; i > 0 && counts[i - 1] < count; i--) {
+                counts[i] = counts[i - 1];
+                pairs[i][0] = pairs[i - 1][0];
+                pairs[i][1] = pairs[i - 1][1];
             }
 
-            vmcase(OP_CALL) {
-                if (!vm_call_value(vm, vm_pop(vm), READ_BYTE())) {
-                    return false;
-                }
-
-                frame = &vm->frames[vm->frame_count - 1];
+            counts[i] = count;
+            pairs[i][0] = a;
+            pairs[i][1] = b;
+        }
+    }
 
-                vmbreak();
-            }
+    fprintf(stderr, "opcode pairs:\n");
 
-            vmcase(OP_POP_JUMP_IF_FALSE) {
-                uint16_t offset = READ_SHORT();
+    for (size_t i = 0; i < TOP && counts[i] != 0; i++) {
+        const char *first = opcode_names[pairs[i][0]];
+        const char *second = opcode_names[pairs[i][1]];
 
-                if (value_is_falsey(vm_pop(vm)))
-                    frame->ip += offset;
+        fprintf(stderr, "\t%-28s %-28s %lu\n", first ? first : "?",
+                second ? second : "?", counts[i]);
+    }
+}
+#endif
 
-                vmbreak();
-            }
 
-            vmcase(OP_JUMP_IF_FALSE) {
-                uint16_t offset = READ_SHORT();
+// The state of the frame on top of the call stack is kept in locals, or in
+// the arguments of the handlers when they are separate functions, so that the
+// compiler can hold it in registers. It is written back to the frame and the
+// Vm before anything that can observe it: calls, allocations that may collect,
+// errors and the JIT. `pc` is the decoded instruction that runs next and `in`
+// the one running, frames keep pointing into the bytes so that everything
+// else can ignore the decoded form
 
-                if (value_is_falsey(vm_peek(vm, 0)))
-                    frame->ip += offset;
+#define vmsave() (frame->ip = bytes + pc->offset, frame->pc = pc, vm->sp = sp)
 
-                vmbreak();
-            }
+#define vmload()                                                               \
+    do {                                                                       \
+        frame = &vm->frames[vm->frame_count - 1];                              \
+                                                                               \
+        Chunk *chunk = &frame->closure->fn->chunk;                             \
+                                                                               \
+        if (chunk->code == NULL) {                                             \
+            chunk_decode(chunk, vmhandlers);                                   \
+        }                                                                      \
+                                                                               \
+        bytes = chunk->bytes;                                                  \
+        pc = frame->pc;                                                        \
+                                                                               \
+        if (pc == NULL || bytes + pc->offset != frame->ip) {                   \
+            pc = &chunk->code[chunk->code_index[frame->ip - bytes]];           \
+        }                                                                      \
+                                                                               \
+        slots = frame->slots;                                                  \
+        sp = vm->sp;                                                           \
+    } while (false)
+
+#define vmpush(value)                                                          \
+    do {                                                                       \
+        Value pushed = (value);                                                \
+        *sp++ = pushed;                                                        \
+    } while (false)
+#define vmpop() (*--sp)
+#define vmpeek(distance) (sp[-1 - (distance)])
+#define vmpoke(distance, value) (sp[-1 - (distance)] = (value))
+
+#ifdef NUR_PROFILE_OPCODES
+#define vmprofile(op)                                                          \
+    opcode_pairs[previous_opcode][op]++;                                       \
+    previous_opcode = op;
+#else
+#define vmprofile(op)
+#endif
 
-            vmcase(OP_JUMP) {
-                uint16_t offset = READ_SHORT();
+#define vmfetch()                                                              \
+    in = pc++;                                                                 \
+    vmprofile(in->op)
+
+// Rewrites the running instruction into `opcode`, in the bytes as well so that
+// the JIT and the disassembler see it
+#define vmrewrite(opcode)                                                      \
+    (in->op = (opcode), in->handler = vmhandlers[in->op],                      \
+     bytes[in->offset] = in->op)
+
+// Rewrites the running instruction into its numeric variant if both operands
+// are numbers
+#define vmquicken(quickened, lhs, rhs)                                         \
+    do {                                                                       \
+        if (IS_NUM(lhs) && IS_NUM(rhs))                                        \
+            vmrewrite(quickened);                                              \
+    } while (false)
+
+// Rewrites the running numeric instruction back into its generic variant and
+// rewinds so it gets executed by the next fetch
+#define vmdeopt(generic) (vmrewrite(generic), pc = in)
+
+// Gives the JIT a chance to run the function on top of the call stack, called
+// whenever the interpreter enters a frame, resumes one or jumps back in a loop
+#ifdef NUR_JIT
+#define vmjit()                                                                \
+    do {                                                                       \
+        vmsave();                                                              \
+                                                                               \
+        if (!vm_jit_execute(vm)) {                                             \
+            return false;                                                      \
+        }                                                                      \
+                                                                               \
+        vmload();                                                              \
+    } while (false)
+#else
+#define vmjit()
+#endif
 
-                frame->ip += offset;
+#ifdef NUR_TAIL_CALLS
+#include "vm_tailcalls.h"
+#endif
 
-                vmbreak();
-            }
+bool vm_run(Vm *vm, Value *out) {
+    CallFrame *frame;
+    uint8_t *bytes;
+    Instruction *pc;
+    Value *slots;
+    Value *sp;
 
-            vmcase(OP_LOOP) {
-                uint16_t offset = READ_SHORT();
+#ifdef NUR_PROFILE_OPCODES
+    static bool profile_reported = false;
 
-                frame->ip -= offset;
+    if (!profile_reported) {
+        profile_reported = true;
+        atexit(vm_profile_report);
+    }
+#endif
 
-                vmbreak();
-            }
+#ifdef NUR_TAIL_CALLS
+    vmload();
 
-            vmcase(OP_RETURN) {
-                Value returned = vm_pop(vm);
+    vmprofile(pc->op);
 
-                vm_close_upvalues(vm, frame->slots);
+    if (!((VmHandler)pc->handler)(vm, pc + 1, sp, slots, frame, bytes)) {
+        return false;
+    }
 
-                vm->frame_count--;
+    *out = *vm->sp;
 
-                if (vm->frame_count == 0) {
-                    *result = returned;
+    return true;
+#else
+    Instruction *in;
 
-                    return true;
-                }
+#ifdef NUR_NO_JUMPTABLE
+    // The switch dispatches on the opcode, so the instructions need no handler
+    static void *const vmhandlers[UINT8_MAX + 1] = {0};
 
-                vm->sp = frame->slots;
+#define vmdispatch() switch (in->op)
+#define vmcase(op) case op:
+#define vmbreak() break
+#else
+#include "vm_jumptable.h"
+#endif
 
-                vm_push(vm, returned);
+    vmload();
 
-                frame = &vm->frames[vm->frame_count - 1];
+    for (;;) {
+        vmfetch();
 
-                vmbreak();
-            }
+        vmdispatch() {
+#include "vm_handlers.h"
         }
     }
+#endif
 }
@@ -1,10 +1,18 @@
 #pragma once
 
+#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
+// The baseline JIT is opt-in and only generates x86-64 code for Linux, it also
+// relies on values being NaN boxed, every other build keeps the interpreter
+#if defined(NUR_JIT) && (!defined(__x86_64__) || !defined(__linux__) ||        \
+                         defined(NUR_NO_NAN_BOXING))
+#undef NUR_JIT
+#endif
+
 typedef enum {
     OBJ_CLOSURE,
     OBJ_UPVALUE,
@@ -13,6 +21,7 @@ typedef enum {
     OBJ_ARRAY,
     OBJ_MAP,
     OBJ_STRING,
+    OBJ_TYPED_ARRAY,
 } ObjTag;
 
 typedef struct Obj {
@@ -27,12 +36,14 @@ typedef enum : uint8_t {
     VAL_NULL,
     VAL_BOOL,
     VAL_NUM,
+    VAL_INT,
     VAL_OBJ,
 } ValueTag;
 
 typedef union {
     bool _bool;
     double _num;
+    int32_t _int;
     Obj *_obj;
 } ValuePayload;
 
@@ -43,18 +54,31 @@ typedef struct {
 
 #define IS_NULL(v) ((v).tag == VAL_NULL)
 #define IS_BOOL(v) ((v).tag == VAL_BOOL)
-#define IS_NUM(v) ((v).tag == VAL_NUM)
+#define IS_DOUBLE(v) ((v).tag == VAL_NUM)
+#define IS_INT(v) ((v).tag == VAL_INT)
+#define IS_NUM(v) (IS_DOUBLE(v) || IS_INT(v))
 #define IS_OBJ(v) ((v).tag == VAL_OBJ)
 
 #define AS_BOOL(v) ((v).payload._bool)
-#define AS_NUM(v) ((v).payload._num)
+#define AS_DOUBLE(v) ((v).payload._num)
+#define AS_INT(v) ((v).payload._int)
 #define AS_OBJ(v) ((v).payload._obj)
 
+static inline double AS_NUM(Value v) {
+    return IS_INT(v) ? AS_INT(v) : AS_DOUBLE(v);
+}
+
 #define NULL_VAL ((Value){.tag = VAL_NULL})
 #define BOOL_VAL(v) ((Value){.tag = VAL_BOOL, .payload = {._bool = (v)}})
 #define NUM_VAL(v) ((Value){.tag = VAL_NUM, .payload = {._num = (v)}})
+#define INT_VAL(v) ((Value){.tag = VAL_INT, .payload = {._int = (v)}})
 #define OBJ_VAL(v) ((Value){.tag = VAL_OBJ, .payload = {._obj = (Obj *)(v)}})
 
+// Marks global slots that were reserved by the compiler but not assigned yet,
+// it is never visible to scripts
+#define UNDEFINED_VAL ((Value){.tag = VAL_NULL, .payload = {._bool = true}})
+#define IS_UNDEFINED(v) ((v).tag == VAL_NULL && (v).payload._bool)
+
 #else
 
 typedef uint64_t Value;
@@ -66,7 +90,15 @@ typedef uint64_t Value;
 #define TAG_BOOL 2
 #define TAG_OBJ 3
 
-#define IS_NUM(v) (((v) & QNAN) != QNAN)
+// Integers that fit in 32 bits are boxed on their own, as the NaN with the
+// sign bit and no tag and the integer in the low bits, so that counting and
+// indexing do not go through doubles. Scripts can not tell the two apart,
+// IS_NUM accepts both and AS_NUM converts
+#define INT_TAG (SIGN_BIT | QNAN)
+
+#define IS_DOUBLE(v) (((v) & QNAN) != QNAN)
+#define IS_INT(v) ((v) >> 48 == INT_TAG >> 48)
+#define IS_NUM(v) (IS_DOUBLE(v) || IS_INT(v))
 #define IS_NULL(v) ((v) == (QNAN | (uint64_t)TAG_NULL << 48))
 #define IS_BOOL(v)                                                             \
     (((v) & (QNAN | (uint64_t)7 << 48)) == (QNAN | (uint64_t)TAG_BOOL << 48))
@@ -79,23 +111,61 @@ static inline Value NUM_VAL(double num) {
     return v;
 }
 
-static inline double AS_NUM(Value v) {
+#define INT_VAL(i) (INT_TAG | (uint32_t)(int32_t)(i))
+#define AS_INT(v) ((int32_t)(uint32_t)(v))
+
+static inline double AS_DOUBLE(Value v) {
     double num;
     memcpy(&num, &v, sizeof(double));
     return num;
 }
 
+static inline double AS_NUM(Value v) {
+    return IS_INT(v) ? AS_INT(v) : AS_DOUBLE(v);
+}
+
+// Objects also carry their tag in the low bits of the pointer, which are
+// always zero as allocations are aligned to 8 bytes, so that checking what kind
+// of object a value holds does not have to load its header
+#define OBJ_TAG_MASK 7ull
+
+static_assert(OBJ_TYPED_ARRAY <= OBJ_TAG_MASK);
+static_assert(alignof(max_align_t) > OBJ_TAG_MASK);
+
 #define AS_BOOL(v) (bool)((v) & 1)
-#define AS_OBJ(v) ((Obj *)(uintptr_t)((v) & 0x0000ffffffffffffull))
+#define AS_OBJ(v) ((Obj *)(uintptr_t)((v) & 0x0000fffffffffff8ull))
 
 #define BOOL_VAL(b) (QNAN | ((uint64_t)TAG_BOOL << 48) | (uint64_t)(b))
-#define OBJ_VAL(obj)                                                           \
-    (QNAN | ((uint64_t)TAG_OBJ << 48) | (uint64_t)(uintptr_t)(obj))
+#define OBJ_VAL(obj) obj_val((Obj *)(obj))
 #define NULL_VAL (QNAN | (uint64_t)TAG_NULL << 48)
+
+static inline Value obj_val(Obj *obj) {
+    return QNAN | ((uint64_t)TAG_OBJ << 48) | (uint64_t)(uintptr_t)obj |
+           obj->tag;
+}
+
+// A null with a payload, see the definition above
+#define UNDEFINED_VAL (NULL_VAL | 1)
+#define IS_UNDEFINED(v) ((v) == UNDEFINED_VAL)
 #endif
 
+// Boxes `num` as an integer when it is one that fits, and as a double otherwise
+static inline Value NUMBER_VAL(double num) {
+    if (num >= INT32_MIN && num <= INT32_MAX && num == (int32_t)num &&
+        (num != 0 || !signbit(num))) {
+        return INT_VAL((int32_t)num);
+    }
+
+    return NUM_VAL(num);
+}
+
 static inline bool is_obj_tag(Value v, ObjTag tag) {
+#ifdef NUR_NO_NAN_BOXING
     return IS_OBJ(v) && AS_OBJ(v)->tag == tag;
+#else
+    return (v & (QNAN | (uint64_t)7 << 48 | OBJ_TAG_MASK)) ==
+           (QNAN | (uint64_t)TAG_OBJ << 48 | tag);
+#endif
 }
 
 #define IS_CLOSURE(v) is_obj_tag(v, OBJ_CLOSURE)
@@ -104,6 +174,7 @@ static inline bool is_obj_tag(Value v, ObjTag tag) {
 #define IS_ARRAY(v) is_obj_tag(v, OBJ_ARRAY)
 #define IS_MAP(v) is_obj_tag(v, OBJ_MAP)
 #define IS_STRING(v) is_obj_tag(v, OBJ_STRING)
+#define IS_TYPED_ARRAY(v) is_obj_tag(v, OBJ_TYPED_ARRAY)
 
 typedef enum : uint8_t {
     OP_POP,
@@ -116,6 +187,8 @@ typedef enum : uint8_t {
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_SET_LOCAL_WITH_MATH,
+    OP_SET_LOCAL_WITH_MATH_LOCAL, // a op= b, where b is a local
+    OP_SET_LOCAL_WITH_MATH_CONST, // a op= k, where k is a constant
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
     OP_SET_UPVALUE_WITH_MATH,
@@ -126,8 +199,12 @@ typedef enum : uint8_t {
     OP_GET_SUBSCRIPT,
     OP_SET_SUBSCRIPT,
     OP_SET_SUBSCRIPT_WITH_MATH,
+    OP_GET_MEMBER,           // a.k, cached by the shape of a
+    OP_SET_MEMBER,           // a.k = v, cached by the shape of a
+    OP_SET_MEMBER_WITH_MATH, // a.k op= v, cached by the shape of a
     OP_MAKE_ARRAY,
     OP_MAKE_MAP,
+    OP_MAKE_SHAPED_MAP, // a map literal whose keys are constant strings
     OP_MAKE_CLOSURE,
     OP_MAKE_SLICE,       // a[s:e]
     OP_MAKE_SLICE_ABOVE, // a[s:]
@@ -147,12 +224,50 @@ typedef enum : uint8_t {
     OP_GT,
     OP_LTE,
     OP_GTE,
+    OP_MATH_LOCAL_LOCAL, // a op b, where both are locals
+    OP_MATH_LOCAL_CONST, // a op k, where a is a local and k is a constant
     OP_CALL,
+    OP_TAIL_CALL, // CALL reusing the frame of the caller, followed by RETURN
     OP_POP_JUMP_IF_FALSE,
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
     OP_RETURN,
+
+    // Superinstructions, only emitted by chunk_optimize after fusing the
+    // sequences that were the most frequent when profiling the benchmarks
+    // with NUR_PROFILE_OPCODES
+    OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE, // MATH_LOCAL_LOCAL; POP_JUMP_IF_FALSE
+    OP_MATH_LOCAL_CONST_JUMP_IF_FALSE, // MATH_LOCAL_CONST; POP_JUMP_IF_FALSE
+    OP_SET_LOCAL_WITH_MATH_LOCAL_POP,  // SET_LOCAL_WITH_MATH_LOCAL; POP
+    OP_SET_LOCAL_WITH_MATH_CONST_POP,  // SET_LOCAL_WITH_MATH_CONST; POP
+    OP_SET_LOCAL_POP,                  // SET_LOCAL; POP
+    OP_GET_SUBSCRIPT_LOCAL_CONST,      // PUSH_CONST; GET_LOCAL; GET_SUBSCRIPT
+    OP_CALL_UPVALUE,                   // GET_UPVALUE; CALL
+    OP_CALL_GLOBAL,                    // GET_GLOBAL; CALL
+
+    // Quickened variants, never emitted by the compiler, vm_run rewrites an
+    // instruction in place into its numeric variant after observing number
+    // operands and back into the generic one when the operands are not numbers
+    OP_ADD_NUM,
+    OP_SUB_NUM,
+    OP_MUL_NUM,
+    OP_LT_NUM,
+    OP_GT_NUM,
+    OP_LTE_NUM,
+    OP_GTE_NUM,
+    OP_SET_LOCAL_WITH_MATH_NUM,
+    OP_SET_LOCAL_WITH_MATH_LOCAL_NUM,
+    OP_SET_LOCAL_WITH_MATH_CONST_NUM,
+    OP_SET_UPVALUE_WITH_MATH_NUM,
+    OP_SET_GLOBAL_WITH_MATH_NUM,
+    OP_SET_SUBSCRIPT_WITH_MATH_NUM,
+    OP_MATH_LOCAL_LOCAL_NUM,
+    OP_MATH_LOCAL_CONST_NUM,
+    OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM,
+    OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM,
+    OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM,
+    OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM,
 } OpCode;
 
 typedef struct {
@@ -161,52 +276,177 @@ typedef struct {
     size_t capacity;
 } Constants;
 
+// Remembers which entry a key was found at for the last few map shapes seen by
+// an instruction, maps with the same non-zero shape have the same layout
+#define INLINE_CACHE_WAYS 4
+
+typedef struct {
+    uint32_t shapes[INLINE_CACHE_WAYS];
+    uint32_t indexes[INLINE_CACHE_WAYS];
+} InlineCache;
+
+typedef struct {
+    InlineCache *items;
+    size_t count;
+    size_t capacity;
+} InlineCaches;
+
+// An instruction decoded from the bytes of a chunk for the interpreter, which
+// runs these instead so that it does not have to look up handlers or
+// reassemble operands, see chunk_decode for which fields each opcode uses
+typedef struct Instruction {
+    void *handler; // The label that runs it when the dispatch is threaded
+    OpCode op;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint32_t offset; // Where it starts in the bytes
+
+    union {
+        Value constant;
+        uint32_t index;
+    };
+
+    union {
+        struct Instruction *target;
+        InlineCache *cache;
+        const uint8_t *upvalues;
+    };
+} Instruction;
+
 typedef struct {
     const char *file_path;
     const char *file_content;
     Constants constants;
+    InlineCaches caches;
     uint8_t *bytes;
     uint32_t *sources;
     size_t count;
     size_t capacity;
+
+    // Every instruction pushes at most one more value than it pops, so running
+    // the chunk never needs more values above its arguments than it has
+    // instructions, counted by chunk_optimize
+    size_t stack_size;
+
+    // Decoded when the chunk is first run, followed by an instruction starting
+    // at the end of the bytes, `code_index` maps each offset an instruction
+    // starts at in the bytes to its position in `code`
+    Instruction *code;
+    uint32_t *code_index;
 } Chunk;
 
 size_t chunk_add_constant(Chunk *, Value);
+size_t chunk_add_cache(Chunk *);
 void chunk_adjust_capacity(Chunk *chunk, size_t new_cap);
 size_t chunk_add_byte(Chunk *, uint8_t byte, uint32_t source);
-
-typedef struct {
+size_t chunk_instruction_size(const Chunk *, size_t offset);
+bool chunk_jump_target(const Chunk *, size_t offset, size_t *target);
+void chunk_decode(Chunk *, void *const handlers[]);
+
+// Concatenating strings builds a rope, a string that only points to its two
+// halves, and copies their items into place the first time they are read, see
+// vm_flatten_string. Flat strings keep both halves NULL
+//
+// Slicing a string shares its items instead of copying them, the slice keeps
+// the string that owns them as its parent, see vm_slice_string
+//
+// Strings coming from the source and the builtins are interned, so that equal
+// interned strings are the same object, every other string is only interned
+// once it is used as a key, see vm_intern_string. Hashes are computed on first
+// use as well, see vm_string_hash
+//
+// Flat strings are allocated along with their characters, only flattened ropes
+// and interned slices get items of their own
+typedef struct ObjString {
     Obj obj;
-    char *items;
+    char *items; // NULL while the string is a rope
     uint32_t count;
-    uint32_t hash;
+    uint32_t hash; // 0 until it is computed
+    struct ObjString *left;
+    struct ObjString *right;
+    struct ObjString *parent; // NULL unless the items belong to another string
+    uint32_t length;   // characters, counted on first use, see vm_index_string
+    uint32_t *offsets; // NULL if every byte is a character
+    bool indexed;
+    bool interned;
+    bool inlined; // items point to chars
+    char chars[];
 } ObjString;
 
-typedef struct {
+// Slicing an array shares its items too. They move to a parent that nothing
+// writes to, and both the array and the slice read them from there until
+// their first write copies them, see vm_slice_array and vm_unshare_array
+//
+// Short arrays are allocated along with room for VM_ARRAY_INLINE_CAPACITY
+// items, their items only move to a buffer of their own once they outgrow it
+typedef struct ObjArray {
     Obj obj;
     Value *items;
     uint32_t count;
-    uint32_t capacity;
+    uint32_t capacity; // 0 while the items belong to the parent
+    struct ObjArray *parent;
+    uint32_t inlined; // room in values, 0 for longer arrays
+    Value values[];
 } ObjArray;
 
+typedef enum : uint8_t {
+    TYPED_FLOAT64,
+    TYPED_INT32,
+    TYPED_UINT8,
+} TypedKind;
+
+// Numbers of a single kind stored unboxed along with the array, which cannot
+// grow, see the typed module
+typedef struct {
+    Obj obj;
+    uint32_t count;
+    TypedKind kind;
+    alignas(double) uint8_t items[];
+} ObjTypedArray;
+
+// Empty and deleted entries have a NULL key, whether probing goes past them is
+// told by their control byte
 typedef struct {
     ObjString *key;
     Value value;
 } ObjMapEntry;
 
+// Control bytes are probed a group at a time, tables smaller than a group still
+// get a whole group of them
+#define VM_MAP_GROUP 16
+
 typedef struct {
     Obj obj;
-    ObjMapEntry *entries;
+    ObjMapEntry *entries; // followed by the control bytes in the same block
+    uint8_t *controls;    // one per entry, see vm_map.c
     uint32_t count;
     uint32_t capacity;
+    uint32_t tombstones; // deleted entries, they are only dropped on rehashing
+    uint32_t shape; // 0 until an inline cache asks for it, see vm_map_shape
 } ObjMap;
 
+static inline size_t vm_map_table_size(uint32_t capacity) {
+    if (capacity == 0) {
+        return 0;
+    }
+
+    return capacity * sizeof(ObjMapEntry) +
+           (capacity < VM_MAP_GROUP ? VM_MAP_GROUP : capacity);
+}
+
 typedef struct {
     Obj obj;
-    ObjMap *globals;
+    ObjMap *globals;         // name -> index into global_values
+    ObjArray *global_values; // shared by every function of the same file
     Chunk chunk;
     uint8_t arity;
     uint8_t upvalues_count;
+#ifdef NUR_JIT
+    struct JitCode *jit; // NULL until the function gets hot, see vm_jit.c
+    uint32_t hotness;
+    struct JitLoop *loops; // loops of the compiled code, with their traces
+#endif
 } ObjFunction;
 
 typedef struct ObjUpvalue {
@@ -219,8 +459,8 @@ typedef struct ObjUpvalue {
 typedef struct {
     Obj obj;
     ObjFunction *fn;
-    ObjUpvalue **upvalues;
     uint8_t upvalues_count;
+    ObjUpvalue *upvalues[];
 } ObjClosure;
 
 #define AS_STRING(v) ((ObjString *)AS_OBJ(v))
@@ -228,23 +468,47 @@ typedef struct {
 #define AS_FUNCTION(v) ((ObjFunction *)AS_OBJ(v))
 #define AS_ARRAY(v) ((ObjArray *)AS_OBJ(v))
 #define AS_MAP(v) ((ObjMap *)AS_OBJ(v))
+#define AS_TYPED_ARRAY(v) ((ObjTypedArray *)AS_OBJ(v))
+
+// The stack of values and the frames start small and grow on demand, the
+// frames only up to VM_FRAMES_MAX which is the limit on recursion
+#define VM_FRAMES_INIT 8
+#define VM_FRAMES_MAX (1 << 16)
+#define VM_STACK_INIT 256
+
+// Values that runtime helpers and the instructions appended after
+// chunk_optimize may push beyond the stack_size of a chunk
+#define VM_STACK_SLACK 8
 
-#define VM_FRAMES_MAX 64
-#define VM_STACK_MAX (VM_FRAMES_MAX * 255)
 #define VM_GC_GROW_FACTOR 2
 
+// Concatenations up to this many bytes are copied instead of building a rope
+#define VM_ROPE_MIN_COUNT 64
+
+// Arrays created with up to this many items keep them inline, see ObjArray
+#define VM_ARRAY_INLINE_CAPACITY 4
+
+// Strings that are not ASCII keep the byte offset of every this many characters
+#define VM_STRING_INDEX_STRIDE 32
+
 typedef struct {
     ObjClosure *closure;
     uint8_t *ip;
     Value *slots;
+
+    // The decoded instruction at ip when the interpreter last left the frame,
+    // the JIT moves ip without updating it, so it is only used while they agree
+    Instruction *pc;
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[VM_FRAMES_MAX];
+    CallFrame *frames;
     size_t frame_count;
+    size_t frames_capacity;
 
-    Value stack[VM_STACK_MAX];
+    Value *stack;
     Value *sp;
+    Value *stack_end;
 
     ObjUpvalue *open_upvalues;
 
@@ -272,13 +536,36 @@ ObjString *vm_value_to_string(Vm *vm, Value value);
 const char *value_description(Value value);
 void value_display(Value);
 bool value_is_falsey(Value);
+
+// Enough for any number written by number_format, including the terminator
+#define NUMBER_FORMAT_MAX 32
+
+// Writes the shortest digits that read back as `num`, terminated, and returns
+// their length
+size_t number_format(double num, char *buffer);
+
 uint32_t string_hash(const char *key, uint32_t count);
 uint32_t string_utf8_characters_count(const char *start, const char *end);
+bool string_utf8_validate(const char *start, const char *end);
+uint32_t string_utf8_decode(const char *start, const char *end,
+                            uint32_t *runes);
+uint32_t string_utf8_encode(const uint32_t *runes, uint32_t count,
+                            char *result);
 uint32_t string_utf8_encode_character(
     uint32_t rune, char *result); // result should be at least 4 bytes long
 const char *string_utf8_skip_character(const char *start);
 const char *string_utf8_decode_character(const char *start, uint32_t *rune);
 
+void typed_add(const ObjTypedArray *lhs, const ObjTypedArray *rhs,
+               ObjTypedArray *result);
+void typed_mul(const ObjTypedArray *lhs, const ObjTypedArray *rhs,
+               ObjTypedArray *result);
+void typed_scale(const ObjTypedArray *array, double factor,
+                 ObjTypedArray *result);
+double typed_sum(const ObjTypedArray *array);
+double typed_min(const ObjTypedArray *array);
+double typed_max(const ObjTypedArray *array);
+
 ObjString *vm_find_string(Vm *vm, const char *key, uint32_t count,
                           uint32_t hash);
 
@@ -286,10 +573,46 @@ void vm_stack_reset(Vm *);
 void vm_stack_trace(Vm *);
 
 void vm_init(Vm *);
+void vm_free_stack(Vm *);
+
+CallFrame *vm_push_frame(Vm *vm);
+void vm_grow_stack(Vm *vm, size_t count);
 
 bool vm_load_file(Vm *vm, const char *file_path, const char *file_buffer);
 
-bool vm_run(Vm *, Value *result);
+uint32_t vm_global_slot(Vm *vm, ObjFunction *fn, ObjString *name);
+ObjString *vm_global_name(const ObjFunction *fn, uint32_t slot);
+
+bool vm_run(Vm *, Value *out);
+
+// Runtime helpers shared by vm_run and the code generated by the JIT, the ones
+// that produce a value push it on the stack and all of them report their errors
+bool vm_call_value(Vm *vm, Value callee, uint8_t argc);
+bool vm_tail_call_value(Vm *vm, Value callee, uint8_t argc);
+bool vm_get_subscript(Vm *vm, Value target, Value index);
+bool vm_set_subscript(Vm *vm, Value target, Value index);
+bool vm_get_member(Vm *vm, ObjString *key, InlineCache *cache);
+bool vm_set_member(Vm *vm, ObjString *key, InlineCache *cache);
+bool vm_set_member_with_math(Vm *vm, OpCode op, ObjString *key,
+                             InlineCache *cache);
+bool vm_execute_math(Vm *vm, OpCode op, Value lhs, Value rhs, Value *result);
+
+#ifdef NUR_JIT
+// How many times a function has to be entered, resumed after a call or jump
+// back to the start of a loop before it gets compiled
+#ifndef VM_JIT_THRESHOLD
+#define VM_JIT_THRESHOLD 1000
+#endif
+
+// How many more times a loop of compiled code has to jump back before it gets
+// traced
+#ifndef VM_JIT_TRACE_THRESHOLD
+#define VM_JIT_TRACE_THRESHOLD 64
+#endif
+
+bool vm_jit_execute(Vm *vm);
+void vm_jit_free(ObjFunction *fn);
+#endif
 
 [[gnu::format(printf, 2, 3)]]
 void vm_error(Vm *vm, const char *format, ...);
@@ -299,9 +622,20 @@ bool vm_map_insert(Vm *vm, ObjMap *map, ObjString *key, Value value);
 bool vm_map_insert_by_cstr(Vm *vm, ObjMap *map, const char *key, Value value);
 bool vm_map_insert_native_by_cstr(Vm *vm, ObjMap *map, const char *key,
                                   NativeFn call);
-void vm_map_insert_builtins(Vm *vm, ObjMap *globals);
+void vm_define_builtins(Vm *vm, ObjFunction *script);
 bool vm_map_lookup(const ObjMap *map, ObjString *key, Value *value);
+bool vm_map_lookup_index(const ObjMap *map, ObjString *key, uint32_t *index);
+uint32_t vm_map_shape(ObjMap *map);
 bool vm_map_delete(ObjMap *map, ObjString *key);
+void vm_map_shrink(Vm *vm, ObjMap *map);
+
+// Makes sure `count` more values can be pushed, growing the stack moves it so
+// pointers into it are only valid until the next call
+static inline void vm_reserve_stack(Vm *vm, size_t count) {
+    if ((size_t)(vm->stack_end - vm->sp) < count) {
+        vm_grow_stack(vm, count);
+    }
+}
 
 static inline void vm_push(Vm *vm, Value value) {
     *vm->sp = value;
@@ -326,14 +660,135 @@ static inline void vm_poke(Vm *vm, size_t distance, Value value) {
 Obj *vm_alloc(Vm *, ObjTag, size_t);
 void vm_free_object(Vm *vm, Obj *obj);
 void vm_free_map(Vm *vm, ObjMap *map);
-void vm_free_value(Vm *vm, Value);
-ObjString *vm_new_string(Vm *vm, char *items, uint32_t count, uint32_t hash);
+ObjString *vm_new_string(Vm *vm, char *items, uint32_t count);
 ObjString *vm_copy_string(Vm *vm, const char *items, uint32_t count);
+ObjString *vm_copy_interned_string(Vm *vm, const char *items, uint32_t count);
 ObjString *vm_concat_strings(Vm *vm, ObjString *lhs, ObjString *rhs);
+ObjString *vm_slice_string(Vm *vm, ObjString *string, uint32_t start,
+                           uint32_t end);
+ObjString *vm_intern_string(Vm *vm, ObjString *string);
+void vm_flatten_rope(ObjString *rope);
+void vm_index_string(ObjString *string);
+
+static inline ObjString *vm_flatten_string(ObjString *string) {
+    if (string->left != NULL) {
+        vm_flatten_rope(string);
+    }
+
+    return string;
+}
+
+static inline uint32_t vm_string_length(ObjString *string) {
+    if (!string->indexed) {
+        vm_index_string(string);
+    }
+
+    return string->length;
+}
+
+// Returns where the character at `index` starts, the string must be indexed
+// and `index` may be its length to get where it ends
+static inline const char *vm_string_character(const ObjString *string,
+                                              uint32_t index) {
+    if (string->offsets == NULL) {
+        return string->items + index;
+    }
+
+    const char *character =
+        string->items + string->offsets[index / VM_STRING_INDEX_STRIDE];
+
+    for (uint32_t i = index % VM_STRING_INDEX_STRIDE; i > 0; i--) {
+        character = string_utf8_skip_character(character);
+    }
+
+    return character;
+}
+
+// A string that hashes to 0 is hashed again on every use, which is rare enough
+static inline uint32_t vm_string_hash(ObjString *string) {
+    if (string->hash == 0) {
+        vm_flatten_string(string);
+
+        string->hash = string_hash(string->items, string->count);
+    }
+
+    return string->hash;
+}
+
+ObjArray *vm_new_array(Vm *vm);
 ObjArray *vm_copy_array(Vm *vm, const Value *items, uint32_t count);
 ObjArray *vm_concat_arrays(Vm *vm, ObjArray *lhs, ObjArray *rhs);
-ObjFunction *vm_new_function(Vm *vm, ObjMap *globals, Chunk chunk,
-                             uint8_t arity, uint8_t upvalues_count);
+ObjArray *vm_slice_array(Vm *vm, ObjArray *array, uint32_t start,
+                         uint32_t end);
+void vm_unshare_array(Vm *vm, ObjArray *array);
+void vm_array_push(Vm *vm, ObjArray *array, Value value);
+ObjTypedArray *vm_new_typed_array(Vm *vm, TypedKind kind, uint32_t count);
+ObjTypedArray *vm_slice_typed_array(Vm *vm, ObjTypedArray *array,
+                                    uint32_t start, uint32_t end);
+
+static inline size_t typed_element_size(TypedKind kind) {
+    switch (kind) {
+    case TYPED_FLOAT64:
+        return sizeof(double);
+
+    case TYPED_INT32:
+        return sizeof(int32_t);
+
+    default:
+        return sizeof(uint8_t);
+    }
+}
+
+// Integer arrays store numbers truncated and wrapped around, as JavaScript
+// does, NaN and the infinities become 0
+static inline uint32_t typed_wrap(double num) {
+    if (num > INT32_MIN - 1.0 && num < INT32_MAX + 1.0) {
+        return (uint32_t)(int32_t)num;
+    }
+
+    if (!isfinite(num)) {
+        return 0;
+    }
+
+    return (uint32_t)(int64_t)fmod(trunc(num), 4294967296.0);
+}
+
+static inline double vm_typed_get(const ObjTypedArray *array, uint32_t index) {
+    switch (array->kind) {
+    case TYPED_FLOAT64:
+        return ((const double *)array->items)[index];
+
+    case TYPED_INT32:
+        return ((const int32_t *)array->items)[index];
+
+    default:
+        return array->items[index];
+    }
+}
+
+static inline void vm_typed_set(ObjTypedArray *array, uint32_t index,
+                                double num) {
+    switch (array->kind) {
+    case TYPED_FLOAT64:
+        ((double *)array->items)[index] = num;
+
+        break;
+
+    case TYPED_INT32:
+        ((int32_t *)array->items)[index] = (int32_t)typed_wrap(num);
+
+        break;
+
+    default:
+        array->items[index] = (uint8_t)typed_wrap(num);
+
+        break;
+    }
+}
+
+ObjFunction *vm_new_function(Vm *vm, ObjMap *globals, ObjArray *global_values,
+                             Chunk chunk, uint8_t arity,
+                             uint8_t upvalues_count);
 ObjClosure *vm_new_closure(Vm *vm, ObjFunction *);
 ObjUpvalue *vm_new_upvalue(Vm *vm, Value *);
 void vm_mark_object(Vm *vm, Obj *);
@@ -19,7 +19,7 @@
 
 bool vm_map_insert_by_cstr(Vm *vm, ObjMap *map, const char *key_cstr,
                            Value value) {
-    ObjString *key = vm_copy_string(vm, key_cstr, strlen(key_cstr));
+    ObjString *key = vm_copy_interned_string(vm, key_cstr, strlen(key_cstr));
     return vm_map_insert(vm, map, key, value);
 }
 
@@ -30,6 +30,26 @@ bool vm_map_insert_native_by_cstr(Vm *vm, ObjMap *map, const char *key,
     return vm_map_insert_by_cstr(vm, map, key, OBJ_VAL(native));
 }
 
+static void vm_define_global_by_cstr(Vm *vm, ObjFunction *script,
+                                     const char *name_cstr, Value value) {
+    vm_push(vm, value);
+
+    ObjString *name = vm_copy_interned_string(vm, name_cstr, strlen(name_cstr));
+
+    uint32_t slot = vm_global_slot(vm, script, name);
+
+    script->global_values->items[slot] = value;
+
+    vm_pop(vm);
+}
+
+static void vm_define_native_by_cstr(Vm *vm, ObjFunction *script,
+                                     const char *name, NativeFn fn) {
+    ObjNative *native = OBJ_ALLOC(vm, OBJ_NATIVE, ObjNative);
+    native->fn = fn;
+    vm_define_global_by_cstr(vm, script, name, OBJ_VAL(native));
+}
+
 bool vm_builtin_print(Vm *vm, Value *argv, uint8_t argc, Value *result) {
     (void)vm;
 
@@ -41,7 +61,8 @@ bool vm_builtin_print(Vm *vm, Value *argv, uint8_t argc, Value *result) {
         }
 
         if (IS_STRING(arg)) {
-            printf("%.*s", AS_STRING(arg)->count, AS_STRING(arg)->items);
+            ObjString *string = vm_flatten_string(AS_STRING(arg));
+            printf("%.*s", string->count, string->items);
         } else {
             value_display(arg);
         }
@@ -78,19 +99,23 @@ bool vm_builtin_len(Vm *vm, Value *argv, uint8_t argc, Value *result) {
 
     switch (AS_OBJ(arg)->tag) {
     case OBJ_ARRAY:
-        *result = NUM_VAL(AS_ARRAY(arg)->count);
+        *result = NUMBER_VAL(AS_ARRAY(arg)->count);
 
         return true;
 
-    case OBJ_STRING:
-        *result = NUM_VAL(string_utf8_characters_count(
-            AS_STRING(arg)->items,
-            AS_STRING(arg)->items + AS_STRING(arg)->count));
+    case OBJ_TYPED_ARRAY:
+        *result = NUMBER_VAL(AS_TYPED_ARRAY(arg)->count);
 
         return true;
 
+    case OBJ_STRING: {
+        *result = NUMBER_VAL(vm_string_length(AS_STRING(arg)));
+
+        return true;
+    }
+
     case OBJ_MAP:
-        *result = NUM_VAL(AS_MAP(arg)->count);
+        *result = NUMBER_VAL(AS_MAP(arg)->count);
 
         return true;
 
@@ -166,11 +191,7 @@ bool vm_builtin_array_push(Vm *vm, Value *argv, uint8_t argc, Value *result) {
 
     Value value = argv[1];
 
-    uint32_t old_capacity = array->capacity;
-
-    ARRAY_PUSH(array, value);
-
-    vm->bytes_allocated += (array->capacity - old_capacity) * sizeof(Value);
+    vm_array_push(vm, array, value);
 
     if (vm->bytes_allocated > vm->next_gc) {
         vm_gc(vm);
@@ -221,7 +242,7 @@ bool vm_builtin_floor(Vm *vm, Value *argv, uint8_t argc, Value *result) {
         return false;
     }
 
-    *result = NUM_VAL(floor(AS_NUM(value)));
+    *result = NUMBER_VAL(floor(AS_NUM(value)));
 
     return true;
 }
@@ -239,23 +260,43 @@ bool vm_builtin_to_number(Vm *vm, Value *argv, uint8_t argc, Value *result) {
     if (IS_NUM(value)) {
         *result = value;
     } else if (IS_BOOL(value)) {
-        *result = NUM_VAL(AS_BOOL(value));
+        *result = INT_VAL(AS_BOOL(value));
     } else if (IS_STRING(value)) {
-        ObjString *string = AS_STRING(value);
+        ObjString *string = vm_flatten_string(AS_STRING(value));
+
+        // Items are not null terminated, and slices are followed by the rest
+        // of their parent, so strtod gets a terminated copy
+        char buffer[64];
+
+        char *items = buffer;
+
+        if (string->count >= sizeof(buffer)) {
+            items = malloc(string->count + 1);
+
+            if (items == NULL) {
+                fprintf(stderr, "error: out of memory\n");
+
+                exit(1);
+            }
+        }
+
+        memcpy(items, string->items, string->count);
+
+        items[string->count] = '\0';
 
         char *endptr;
 
         errno = 0;
 
-        double v = strtod(string->items, &endptr);
+        double v = strtod(items, &endptr);
 
-        if (errno == ERANGE || endptr != string->items + string->count) {
-            *result = NULL_VAL;
+        bool parsed = errno != ERANGE && endptr == items + string->count;
 
-            return true;
+        if (items != buffer) {
+            free(items);
         }
 
-        *result = NUM_VAL(v);
+        *result = parsed ? NUMBER_VAL(v) : NULL_VAL;
     } else {
         *result = NULL_VAL;
     }
@@ -315,7 +356,7 @@ bool vm_builtin_contains(Vm *vm, Value *argv, uint8_t argc, Value *result) {
             return false;
         }
 
-        ObjString *key = AS_STRING(second);
+        ObjString *key = vm_intern_string(vm, AS_STRING(second));
 
         Value value;
 
@@ -356,7 +397,7 @@ bool vm_builtin_import(Vm *vm, Value *argv, uint8_t argc, Value *result) {
         return false;
     }
 
-    ObjString *original_name = AS_STRING(argv[0]);
+    ObjString *original_name = vm_intern_string(vm, AS_STRING(argv[0]));
 
     if (vm_map_lookup(modules, original_name, result)) {
         return true;
@@ -381,19 +422,29 @@ bool vm_builtin_import(Vm *vm, Value *argv, uint8_t argc, Value *result) {
         parent_directory = vm_copy_string(vm, "./", 2);
     }
 
-    ObjString *new_name =
-        vm_concat_strings(vm, parent_directory, original_name);
+    vm_flatten_string(original_name);
 
-    new_name->items =
-        realloc(new_name->items, (new_name->count + 1) * sizeof(char));
+    uint32_t count = parent_directory->count + original_name->count;
 
-    if (new_name->items == NULL) {
+    // The name is kept null terminated for the system, so it gets items of its
+    // own instead of being concatenated
+    char *path = malloc((count + 1) * sizeof(char));
+
+    if (path == NULL) {
         fprintf(stderr, "error: out of memory\n");
 
         exit(1);
     }
 
-    new_name->items[new_name->count] = '\0'; // Adding null termination
+    memcpy(path, parent_directory->items, parent_directory->count);
+    memcpy(path + parent_directory->count, original_name->items,
+           original_name->count);
+
+    path[count] = '\0'; // Adding null termination
+
+    vm->bytes_allocated += count * sizeof(char);
+
+    ObjString *new_name = vm_new_string(vm, path, count);
 
     if (file_exists(new_name->items)) {
         char *file_content = read_entire_file(new_name->items);
@@ -402,19 +453,42 @@ bool vm_builtin_import(Vm *vm, Value *argv, uint8_t argc, Value *result) {
 
         vm_init(&mvm);
 
-        vm_free_map(&mvm, mvm.strings);
-
+        // The module shares our strings but only knows its own roots, so it
+        // must not collect garbage, its objects are handed over to us instead
         mvm.strings = vm->strings;
+        mvm.next_gc = SIZE_MAX;
 
-        if (!vm_load_file(&mvm, new_name->items, file_content)) {
-            return false;
+        bool ok =
+            vm_load_file(&mvm, new_name->items, file_content) &&
+            vm_run(&mvm, result);
+
+        vm_free_stack(&mvm);
+
+        if (mvm.objects != NULL) {
+            Obj *last = mvm.objects;
+
+            while (last->next != NULL) {
+                last = last->next;
+            }
+
+            last->next = vm->objects;
+            vm->objects = mvm.objects;
+            vm->bytes_allocated += mvm.bytes_allocated;
         }
 
-        if (!vm_run(&mvm, result)) {
+        if (!ok) {
             return false;
         }
 
-        vm_map_insert(vm, modules, new_name, *result);
+        // Interning and inserting can collect garbage
+        vm_push(vm, *result);
+
+        ObjString *key = vm_intern_string(vm, new_name);
+
+        vm_push(vm, OBJ_VAL(key));
+        vm_map_insert(vm, modules, key, *result);
+        vm_pop(vm);
+        vm_pop(vm);
 
         return true;
     }
@@ -557,7 +631,445 @@ ObjMap *vm_get_time_module(Vm *vm) {
     return time_mod;
 }
 
-void vm_map_insert_builtins(Vm *vm, ObjMap *globals) {
+bool vm_builtin_unicode_utf8_encode(Vm *vm, Value *argv, uint8_t argc,
+                                    Value *result) {
+    if (argc != 1) {
+        vm_error(vm,
+                 "unicode.utf8_encode() takes exactly one argument, but got %d",
+                 argc);
+
+        return false;
+    }
+
+    const Value *items;
+    uint32_t count;
+
+    if (IS_NUM(argv[0])) {
+        items = argv;
+        count = 1;
+    } else if (IS_ARRAY(argv[0])) {
+        items = AS_ARRAY(argv[0])->items;
+        count = AS_ARRAY(argv[0])->count;
+    } else {
+        vm_error(vm, "can not encode %s value", value_description(argv[0]));
+
+        return false;
+    }
+
+    uint32_t *runes = malloc(count * sizeof(uint32_t) + 1);
+    char *bytes = malloc(count * 4 + 1);
+
+    if (runes == NULL || bytes == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!IS_NUM(items[i])) {
+            vm_error(vm, "can not encode %s value",
+                     value_description(items[i]));
+
+            free(runes);
+            free(bytes);
+
+            return false;
+        }
+
+        double rune = AS_NUM(items[i]);
+
+        if (rune < 0 || rune > 0x10ffff || rune != floor(rune) ||
+            (rune >= 0xd800 && rune <= 0xdfff)) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(rune, buffer);
+
+            vm_error(vm, "can not encode %s, it is not a unicode code point",
+                     buffer);
+
+            free(runes);
+            free(bytes);
+
+            return false;
+        }
+
+        runes[i] = rune;
+    }
+
+    uint32_t size = string_utf8_encode(runes, count, bytes);
+
+    *result = OBJ_VAL(vm_copy_string(vm, bytes, size));
+
+    free(runes);
+    free(bytes);
+
+    return true;
+}
+
+// Validates and decodes `string` into a malloc'd array of its code points
+static uint32_t *vm_utf8_decode(Vm *vm, ObjString *string, uint32_t *length) {
+    string = vm_flatten_string(string);
+
+    if (!string_utf8_validate(string->items, string->items + string->count)) {
+        vm_error(vm, "can not decode a string that is not valid UTF-8");
+
+        return NULL;
+    }
+
+    *length = vm_string_length(string);
+
+    uint32_t *runes = malloc(*length * sizeof(uint32_t) + 1);
+
+    if (runes == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+
+        exit(1);
+    }
+
+    string_utf8_decode(string->items, string->items + string->count, runes);
+
+    return runes;
+}
+
+bool vm_builtin_unicode_utf8_decode(Vm *vm, Value *argv, uint8_t argc,
+                                    Value *result) {
+    if (argc != 1) {
+        vm_error(vm,
+                 "unicode.utf8_decode() takes exactly one argument, but got %d",
+                 argc);
+
+        return false;
+    }
+
+    if (!IS_STRING(argv[0])) {
+        vm_error(vm, "can not decode %s value", value_description(argv[0]));
+
+        return false;
+    }
+
+    uint32_t length;
+
+    uint32_t *runes = vm_utf8_decode(vm, AS_STRING(argv[0]), &length);
+
+    if (runes == NULL) {
+        return false;
+    }
+
+    if (length != 1) {
+        vm_error(vm,
+                 "unicode.utf8_decode() takes a single character, but got %u "
+                 "characters, use unicode.utf8_decode_all() instead",
+                 length);
+
+        free(runes);
+
+        return false;
+    }
+
+    *result = NUMBER_VAL(runes[0]);
+
+    free(runes);
+
+    return true;
+}
+
+bool vm_builtin_unicode_utf8_decode_all(Vm *vm, Value *argv, uint8_t argc,
+                                        Value *result) {
+    if (argc != 1) {
+        vm_error(
+            vm,
+            "unicode.utf8_decode_all() takes exactly one argument, but got %d",
+            argc);
+
+        return false;
+    }
+
+    if (!IS_STRING(argv[0])) {
+        vm_error(vm, "can not decode %s value", value_description(argv[0]));
+
+        return false;
+    }
+
+    uint32_t length;
+
+    uint32_t *runes = vm_utf8_decode(vm, AS_STRING(argv[0]), &length);
+
+    if (runes == NULL) {
+        return false;
+    }
+
+    Value *values = malloc(length * sizeof(Value) + 1);
+
+    if (values == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < length; i++) {
+        values[i] = NUMBER_VAL(runes[i]);
+    }
+
+    *result = OBJ_VAL(vm_copy_array(vm, values, length));
+
+    free(runes);
+    free(values);
+
+    return true;
+}
+
+ObjMap *vm_get_unicode_module(Vm *vm) {
+    ObjMap *unicode_mod = vm_new_map(vm);
+
+    vm_map_insert_native_by_cstr(vm, unicode_mod, "utf8_encode",
+                                 vm_builtin_unicode_utf8_encode);
+    vm_map_insert_native_by_cstr(vm, unicode_mod, "utf8_decode",
+                                 vm_builtin_unicode_utf8_decode);
+    vm_map_insert_native_by_cstr(vm, unicode_mod, "utf8_decode_all",
+                                 vm_builtin_unicode_utf8_decode_all);
+
+    return unicode_mod;
+}
+
+// Creates a typed array of `kind` from a length, an array of numbers or another
+// typed array
+static bool vm_builtin_typed_new(Vm *vm, TypedKind kind, const char *name,
+                                 Value *argv, uint8_t argc, Value *result) {
+    if (argc != 1) {
+        vm_error(vm, "typed.%s() takes exactly one argument, but got %d", name,
+                 argc);
+
+        return false;
+    }
+
+    Value source = argv[0];
+
+    if (IS_NUM(source)) {
+        double count = AS_NUM(source);
+
+        if (count < 0 || count > UINT32_MAX || count != floor(count)) {
+            char buffer[NUMBER_FORMAT_MAX];
+            number_format(count, buffer);
+
+            vm_error(vm, "can not create a typed array of %s elements", buffer);
+
+            return false;
+        }
+
+        *result = OBJ_VAL(vm_new_typed_array(vm, kind, count));
+    } else if (IS_ARRAY(source)) {
+        ObjArray *array = AS_ARRAY(source);
+
+        for (uint32_t i = 0; i < array->count; i++) {
+            if (!IS_NUM(array->items[i])) {
+                vm_error(vm, "typed arrays only hold numbers, got %s",
+                         value_description(array->items[i]));
+
+                return false;
+            }
+        }
+
+        ObjTypedArray *typed = vm_new_typed_array(vm, kind, array->count);
+
+        for (uint32_t i = 0; i < array->count; i++) {
+            vm_typed_set(typed, i, AS_NUM(array->items[i]));
+        }
+
+        *result = OBJ_VAL(typed);
+    } else if (IS_TYPED_ARRAY(source)) {
+        ObjTypedArray *array = AS_TYPED_ARRAY(source);
+
+        ObjTypedArray *typed = vm_new_typed_array(vm, kind, array->count);
+
+        for (uint32_t i = 0; i < array->count; i++) {
+            vm_typed_set(typed, i, vm_typed_get(array, i));
+        }
+
+        *result = OBJ_VAL(typed);
+    } else {
+        vm_error(vm, "can not create a typed array from %s value",
+                 value_description(source));
+
+        return false;
+    }
+
+    return true;
+}
+
+bool vm_builtin_typed_float64(Vm *vm, Value *argv, uint8_t argc,
+                              Value *result) {
+    return vm_builtin_typed_new(vm, TYPED_FLOAT64, "float64", argv, argc,
+                                result);
+}
+
+bool vm_builtin_typed_int32(Vm *vm, Value *argv, uint8_t argc, Value *result) {
+    return vm_builtin_typed_new(vm, TYPED_INT32, "int32", argv, argc, result);
+}
+
+bool vm_builtin_typed_uint8(Vm *vm, Value *argv, uint8_t argc, Value *result) {
+    return vm_builtin_typed_new(vm, TYPED_UINT8, "uint8", argv, argc, result);
+}
+
+// Checks that the arguments are `argc` typed arrays of the same kind and
+// length, the second one may be a number instead if `factor` is set
+static bool vm_builtin_typed_check(Vm *vm, const char *name, Value *argv,
+                                   uint8_t argc, uint8_t expected,
+                                   bool factor) {
+    if (argc != expected) {
+        vm_error(vm, "typed.%s() takes exactly %s, but got %d", name,
+                 expected == 1 ? "one argument" : "two arguments", argc);
+
+        return false;
+    }
+
+    if (!IS_TYPED_ARRAY(argv[0])) {
+        vm_error(vm, "typed.%s() requires a typed array, but got %s", name,
+                 value_description(argv[0]));
+
+        return false;
+    }
+
+    if (expected == 1) {
+        return true;
+    }
+
+    if (factor) {
+        if (!IS_NUM(argv[1])) {
+            vm_error(vm, "typed.%s() requires a number factor, but got %s",
+                     name, value_description(argv[1]));
+
+            return false;
+        }
+
+        return true;
+    }
+
+    if (!IS_TYPED_ARRAY(argv[1])) {
+        vm_error(vm, "typed.%s() requires a typed array, but got %s", name,
+                 value_description(argv[1]));
+
+        return false;
+    }
+
+    ObjTypedArray *lhs = AS_TYPED_ARRAY(argv[0]);
+    ObjTypedArray *rhs = AS_TYPED_ARRAY(argv[1]);
+
+    if (lhs->kind != rhs->kind || lhs->count != rhs->count) {
+        vm_error(vm,
+                 "typed.%s() requires typed arrays of the same kind and "
+                 "length",
+                 name);
+
+        return false;
+    }
+
+    return true;
+}
+
+bool vm_builtin_typed_add(Vm *vm, Value *argv, uint8_t argc, Value *result) {
+    if (!vm_builtin_typed_check(vm, "add", argv, argc, 2, false)) {
+        return false;
+    }
+
+    ObjTypedArray *lhs = AS_TYPED_ARRAY(argv[0]);
+    ObjTypedArray *rhs = AS_TYPED_ARRAY(argv[1]);
+
+    ObjTypedArray *sum = vm_new_typed_array(vm, lhs->kind, lhs->count);
+
+    typed_add(lhs, rhs, sum);
+
+    *result = OBJ_VAL(sum);
+
+    return true;
+}
+
+bool vm_builtin_typed_mul(Vm *vm, Value *argv, uint8_t argc, Value *result) {
+    if (!vm_builtin_typed_check(vm, "mul", argv, argc, 2, false)) {
+        return false;
+    }
+
+    ObjTypedArray *lhs = AS_TYPED_ARRAY(argv[0]);
+    ObjTypedArray *rhs = AS_TYPED_ARRAY(argv[1]);
+
+    ObjTypedArray *product = vm_new_typed_array(vm, lhs->kind, lhs->count);
+
+    typed_mul(lhs, rhs, product);
+
+    *result = OBJ_VAL(product);
+
+    return true;
+}
+
+bool vm_builtin_typed_scale(Vm *vm, Value *argv, uint8_t argc, Value *result) {
+    if (!vm_builtin_typed_check(vm, "scale", argv, argc, 2, true)) {
+        return false;
+    }
+
+    ObjTypedArray *array = AS_TYPED_ARRAY(argv[0]);
+
+    ObjTypedArray *scaled = vm_new_typed_array(vm, array->kind, array->count);
+
+    typed_scale(array, AS_NUM(argv[1]), scaled);
+
+    *result = OBJ_VAL(scaled);
+
+    return true;
+}
+
+bool vm_builtin_typed_sum(Vm *vm, Value *argv, uint8_t argc, Value *result) {
+    if (!vm_builtin_typed_check(vm, "sum", argv, argc, 1, false)) {
+        return false;
+    }
+
+    *result = NUMBER_VAL(typed_sum(AS_TYPED_ARRAY(argv[0])));
+
+    return true;
+}
+
+bool vm_builtin_typed_min(Vm *vm, Value *argv, uint8_t argc, Value *result) {
+    if (!vm_builtin_typed_check(vm, "min", argv, argc, 1, false)) {
+        return false;
+    }
+
+    ObjTypedArray *array = AS_TYPED_ARRAY(argv[0]);
+
+    *result = array->count > 0 ? NUMBER_VAL(typed_min(array)) : NULL_VAL;
+
+    return true;
+}
+
+bool vm_builtin_typed_max(Vm *vm, Value *argv, uint8_t argc, Value *result) {
+    if (!vm_builtin_typed_check(vm, "max", argv, argc, 1, false)) {
+        return false;
+    }
+
+    ObjTypedArray *array = AS_TYPED_ARRAY(argv[0]);
+
+    *result = array->count > 0 ? NUMBER_VAL(typed_max(array)) : NULL_VAL;
+
+    return true;
+}
+
+ObjMap *vm_get_typed_module(Vm *vm) {
+    ObjMap *typed_mod = vm_new_map(vm);
+
+    vm_map_insert_native_by_cstr(vm, typed_mod, "float64",
+                                 vm_builtin_typed_float64);
+    vm_map_insert_native_by_cstr(vm, typed_mod, "int32",
+                                 vm_builtin_typed_int32);
+    vm_map_insert_native_by_cstr(vm, typed_mod, "uint8",
+                                 vm_builtin_typed_uint8);
+    vm_map_insert_native_by_cstr(vm, typed_mod, "add", vm_builtin_typed_add);
+    vm_map_insert_native_by_cstr(vm, typed_mod, "mul", vm_builtin_typed_mul);
+    vm_map_insert_native_by_cstr(vm, typed_mod, "scale",
+                                 vm_builtin_typed_scale);
+    vm_map_insert_native_by_cstr(vm, typed_mod, "sum", vm_builtin_typed_sum);
+    vm_map_insert_native_by_cstr(vm, typed_mod, "min", vm_builtin_typed_min);
+    vm_map_insert_native_by_cstr(vm, typed_mod, "max", vm_builtin_typed_max);
+
+    return typed_mod;
+}
+
+void vm_define_builtins(Vm *vm, ObjFunction *script) {
     srand(time(NULL));
 
     if (modules == NULL) {
@@ -567,24 +1079,24 @@ void vm_map_insert_builtins(Vm *vm, ObjMap *globals) {
         vm_map_insert_by_cstr(vm, modules, "io", OBJ_VAL(vm_get_io_module(vm)));
         vm_map_insert_by_cstr(vm, modules, "time",
                               OBJ_VAL(vm_get_time_module(vm)));
+        vm_map_insert_by_cstr(vm, modules, "unicode",
+                              OBJ_VAL(vm_get_unicode_module(vm)));
+        vm_map_insert_by_cstr(vm, modules, "typed",
+                              OBJ_VAL(vm_get_typed_module(vm)));
     }
 
-    vm_map_insert_by_cstr(vm, globals, "__modules__", OBJ_VAL(modules));
-
-    vm_map_insert_native_by_cstr(vm, globals, "print", vm_builtin_print);
-    vm_map_insert_native_by_cstr(vm, globals, "println", vm_builtin_println);
-    vm_map_insert_native_by_cstr(vm, globals, "len", vm_builtin_len);
-    vm_map_insert_native_by_cstr(vm, globals, "random", vm_builtin_random);
-    vm_map_insert_native_by_cstr(vm, globals, "array_push",
-                                 vm_builtin_array_push);
-    vm_map_insert_native_by_cstr(vm, globals, "array_pop",
-                                 vm_builtin_array_pop);
-    vm_map_insert_native_by_cstr(vm, globals, "to_number",
-                                 vm_builtin_to_number);
-    vm_map_insert_native_by_cstr(vm, globals, "to_string",
-                                 vm_builtin_to_string);
-    vm_map_insert_native_by_cstr(vm, globals, "floor", vm_builtin_floor);
-    vm_map_insert_native_by_cstr(vm, globals, "import", vm_builtin_import);
-    vm_map_insert_native_by_cstr(vm, globals, "error", vm_builtin_error);
-    vm_map_insert_native_by_cstr(vm, globals, "contains", vm_builtin_contains);
+    vm_define_global_by_cstr(vm, script, "__modules__", OBJ_VAL(modules));
+
+    vm_define_native_by_cstr(vm, script, "print", vm_builtin_print);
+    vm_define_native_by_cstr(vm, script, "println", vm_builtin_println);
+    vm_define_native_by_cstr(vm, script, "len", vm_builtin_len);
+    vm_define_native_by_cstr(vm, script, "random", vm_builtin_random);
+    vm_define_native_by_cstr(vm, script, "array_push", vm_builtin_array_push);
+    vm_define_native_by_cstr(vm, script, "array_pop", vm_builtin_array_pop);
+    vm_define_native_by_cstr(vm, script, "to_number", vm_builtin_to_number);
+    vm_define_native_by_cstr(vm, script, "to_string", vm_builtin_to_string);
+    vm_define_native_by_cstr(vm, script, "floor", vm_builtin_floor);
+    vm_define_native_by_cstr(vm, script, "import", vm_builtin_import);
+    vm_define_native_by_cstr(vm, script, "error", vm_builtin_error);
+    vm_define_native_by_cstr(vm, script, "contains", vm_builtin_contains);
 }
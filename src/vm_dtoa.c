@@ -0,0 +1,315 @@
+#include <math.h>
+#include <string.h>
+
+#include "vm.h"
+
+// Numbers are printed with the Grisu2 algorithm by Florian Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers". It produces
+// the shortest digits that read back as the same double in nearly every case
+// and digits that still read back the same in the rest, using only 64-bit
+// integer arithmetic
+
+// A floating point number with a 64-bit significand, f * 2^e
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define DOUBLE_HIDDEN_BIT 0x0010000000000000ull
+#define DOUBLE_SIGNIFICAND_MASK 0x000fffffffffffffull
+
+// Normalized powers of ten from 10^-348 to 10^340 in steps of 8
+static const DiyFp cached_powers[] = {
+    {0xfa8fd5a0081c0288ull, -1220}, {0xbaaee17fa23ebf76ull, -1193},
+    {0x8b16fb203055ac76ull, -1166}, {0xcf42894a5dce35eaull, -1140},
+    {0x9a6bb0aa55653b2dull, -1113}, {0xe61acf033d1a45dfull, -1087},
+    {0xab70fe17c79ac6caull, -1060}, {0xff77b1fcbebcdc4full, -1034},
+    {0xbe5691ef416bd60cull, -1007}, {0x8dd01fad907ffc3cull, -980},
+    {0xd3515c2831559a83ull, -954}, {0x9d71ac8fada6c9b5ull, -927},
+    {0xea9c227723ee8bcbull, -901}, {0xaecc49914078536dull, -874},
+    {0x823c12795db6ce57ull, -847}, {0xc21094364dfb5637ull, -821},
+    {0x9096ea6f3848984full, -794}, {0xd77485cb25823ac7ull, -768},
+    {0xa086cfcd97bf97f4ull, -741}, {0xef340a98172aace5ull, -715},
+    {0xb23867fb2a35b28eull, -688}, {0x84c8d4dfd2c63f3bull, -661},
+    {0xc5dd44271ad3cdbaull, -635}, {0x936b9fcebb25c996ull, -608},
+    {0xdbac6c247d62a584ull, -582}, {0xa3ab66580d5fdaf6ull, -555},
+    {0xf3e2f893dec3f126ull, -529}, {0xb5b5ada8aaff80b8ull, -502},
+    {0x87625f056c7c4a8bull, -475}, {0xc9bcff6034c13053ull, -449},
+    {0x964e858c91ba2655ull, -422}, {0xdff9772470297ebdull, -396},
+    {0xa6dfbd9fb8e5b88full, -369}, {0xf8a95fcf88747d94ull, -343},
+    {0xb94470938fa89bcfull, -316}, {0x8a08f0f8bf0f156bull, -289},
+    {0xcdb02555653131b6ull, -263}, {0x993fe2c6d07b7facull, -236},
+    {0xe45c10c42a2b3b06ull, -210}, {0xaa242499697392d3ull, -183},
+    {0xfd87b5f28300ca0eull, -157}, {0xbce5086492111aebull, -130},
+    {0x8cbccc096f5088ccull, -103}, {0xd1b71758e219652cull, -77},
+    {0x9c40000000000000ull, -50}, {0xe8d4a51000000000ull, -24},
+    {0xad78ebc5ac620000ull, 3}, {0x813f3978f8940984ull, 30},
+    {0xc097ce7bc90715b3ull, 56}, {0x8f7e32ce7bea5c70ull, 83},
+    {0xd5d238a4abe98068ull, 109}, {0x9f4f2726179a2245ull, 136},
+    {0xed63a231d4c4fb27ull, 162}, {0xb0de65388cc8ada8ull, 189},
+    {0x83c7088e1aab65dbull, 216}, {0xc45d1df942711d9aull, 242},
+    {0x924d692ca61be758ull, 269}, {0xda01ee641a708deaull, 295},
+    {0xa26da3999aef774aull, 322}, {0xf209787bb47d6b85ull, 348},
+    {0xb454e4a179dd1877ull, 375}, {0x865b86925b9bc5c2ull, 402},
+    {0xc83553c5c8965d3dull, 428}, {0x952ab45cfa97a0b3ull, 455},
+    {0xde469fbd99a05fe3ull, 481}, {0xa59bc234db398c25ull, 508},
+    {0xf6c69a72a3989f5cull, 534}, {0xb7dcbf5354e9beceull, 561},
+    {0x88fcf317f22241e2ull, 588}, {0xcc20ce9bd35c78a5ull, 614},
+    {0x98165af37b2153dfull, 641}, {0xe2a0b5dc971f303aull, 667},
+    {0xa8d9d1535ce3b396ull, 694}, {0xfb9b7cd9a4a7443cull, 720},
+    {0xbb764c4ca7a44410ull, 747}, {0x8bab8eefb6409c1aull, 774},
+    {0xd01fef10a657842cull, 800}, {0x9b10a4e5e9913129ull, 827},
+    {0xe7109bfba19c0c9dull, 853}, {0xac2820d9623bf429ull, 880},
+    {0x80444b5e7aa7cf85ull, 907}, {0xbf21e44003acdd2dull, 933},
+    {0x8e679c2f5e44ff8full, 960}, {0xd433179d9c8cb841ull, 986},
+    {0x9e19db92b4e31ba9ull, 1013}, {0xeb96bf6ebadf77d9ull, 1039},
+    {0xaf87023b9bf0ee6bull, 1066},
+};
+
+static const uint64_t powers_of_ten[] = {
+    1ull,
+    10ull,
+    100ull,
+    1000ull,
+    10000ull,
+    100000ull,
+    1000000ull,
+    10000000ull,
+    100000000ull,
+    1000000000ull,
+    10000000000ull,
+    100000000000ull,
+    1000000000000ull,
+    10000000000000ull,
+    100000000000000ull,
+    1000000000000000ull,
+    10000000000000000ull,
+    100000000000000000ull,
+    1000000000000000000ull,
+    10000000000000000000ull,
+};
+
+static DiyFp diy_fp_multiply(DiyFp a, DiyFp b) {
+    unsigned __int128 p = (unsigned __int128)a.f * b.f;
+    uint64_t h = p >> 64;
+
+    // Rounds the low half away
+    if ((uint64_t)p & (1ull << 63)) {
+        h++;
+    }
+
+    return (DiyFp){h, a.e + b.e + 64};
+}
+
+static DiyFp diy_fp_normalize(DiyFp x) {
+    int shift = __builtin_clzll(x.f);
+
+    return (DiyFp){x.f << shift, x.e - shift};
+}
+
+// Finds the cached power c such that multiplying by it brings the exponent `e`
+// into [-60, -32], where the integral part of the product fits in 32 bits, and
+// stores the negated decimal exponent of c in `k`
+static DiyFp diy_fp_cached_power(int e, int *k) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+
+    if (dk - ik > 0.0) {
+        ik++;
+    }
+
+    uint32_t index = (ik >> 3) + 1;
+    *k = -(-348 + (int)index * 8);
+
+    return cached_powers[index];
+}
+
+// Moves the last digit towards the exact value w while it stays in the range
+static void grisu_round(char *digits, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w ||
+            wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+// Generates the fewest digits of mp that stay above mp - delta
+static int grisu_digits(DiyFp w, DiyFp mp, uint64_t delta, char *digits,
+                        int *k) {
+    DiyFp one = {1ull << -mp.e, mp.e};
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = mp.f >> -one.e;
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = 1;
+    int len = 0;
+
+    while (kappa < 10 && p1 >= powers_of_ten[kappa]) {
+        kappa++;
+    }
+
+    while (kappa > 0) {
+        uint32_t d = p1 / powers_of_ten[kappa - 1];
+        p1 %= powers_of_ten[kappa - 1];
+
+        if (d != 0 || len != 0) {
+            digits[len++] = '0' + d;
+        }
+
+        kappa--;
+
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+
+        if (rest <= delta) {
+            *k += kappa;
+            grisu_round(digits, len, delta, rest, powers_of_ten[kappa] << -one.e,
+                        wp_w);
+
+            return len;
+        }
+    }
+
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+
+        char d = p2 >> -one.e;
+
+        if (d != 0 || len != 0) {
+            digits[len++] = '0' + d;
+        }
+
+        p2 &= one.f - 1;
+        kappa--;
+
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(digits, len, delta, p2, one.f,
+                        -kappa < 20 ? wp_w * powers_of_ten[-kappa] : 0);
+
+            return len;
+        }
+    }
+}
+
+// Writes the digits of a positive finite `num` and stores its decimal exponent
+// in `k`, so that num is about digits * 10^k
+static int grisu2(double num, char *digits, int *k) {
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(double));
+
+    int biased = (bits >> 52) & 0x7ff;
+    DiyFp v = {bits & DOUBLE_SIGNIFICAND_MASK, -1074};
+
+    if (biased != 0) {
+        v.f += DOUBLE_HIDDEN_BIT;
+        v.e = biased - 1075;
+    }
+
+    // The boundaries halfway to the neighbouring doubles, the lower one is
+    // closer when v is a power of two
+    DiyFp plus = diy_fp_normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+    DiyFp minus = v.f == DOUBLE_HIDDEN_BIT
+                      ? (DiyFp){(v.f << 2) - 1, v.e - 2}
+                      : (DiyFp){(v.f << 1) - 1, v.e - 1};
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    DiyFp c = diy_fp_cached_power(plus.e, k);
+    DiyFp w = diy_fp_multiply(diy_fp_normalize(v), c);
+    DiyFp wp = diy_fp_multiply(plus, c);
+    DiyFp wm = diy_fp_multiply(minus, c);
+
+    // Stays inside the boundaries despite the rounding of the products
+    wm.f++;
+    wp.f--;
+
+    return grisu_digits(w, wp, wp.f - wm.f, digits, k);
+}
+
+static size_t format_integer(uint64_t n, char *buffer) {
+    char digits[20];
+    size_t len = 0;
+
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+
+    for (size_t i = 0; i < len; i++) {
+        buffer[i] = digits[len - 1 - i];
+    }
+
+    return len;
+}
+
+size_t number_format(double num, char *buffer) {
+    char *start = buffer;
+
+    if (isnan(num)) {
+        memcpy(buffer, "nan", 4);
+
+        return 3;
+    }
+
+    if (signbit(num)) {
+        *buffer++ = '-';
+        num = -num;
+    }
+
+    if (isinf(num)) {
+        memcpy(buffer, "inf", 4);
+
+        return buffer + 3 - start;
+    }
+
+    // Integers are exact below 2^53, so their digits are already the shortest
+    if (num < 9007199254740992.0 && num == (uint64_t)num) {
+        buffer += format_integer(num, buffer);
+        *buffer = '\0';
+
+        return buffer - start;
+    }
+
+    char digits[32];
+    int k;
+    int len = grisu2(num, digits, &k);
+
+    // The position of the decimal point relative to the first digit
+    int point = len + k;
+
+    if (len <= point && point <= 21) {
+        memcpy(buffer, digits, len);
+        memset(buffer + len, '0', point - len);
+        buffer += point;
+    } else if (0 < point && point <= 21) {
+        memcpy(buffer, digits, point);
+        buffer[point] = '.';
+        memcpy(buffer + point + 1, digits + point, len - point);
+        buffer += len + 1;
+    } else if (-6 < point && point <= 0) {
+        memcpy(buffer, "0.", 2);
+        memset(buffer + 2, '0', -point);
+        memcpy(buffer + 2 - point, digits, len);
+        buffer += 2 - point + len;
+    } else {
+        *buffer++ = digits[0];
+
+        if (len > 1) {
+            *buffer++ = '.';
+            memcpy(buffer, digits + 1, len - 1);
+            buffer += len - 1;
+        }
+
+        int exponent = point - 1;
+
+        *buffer++ = 'e';
+        *buffer++ = exponent < 0 ? '-' : '+';
+        buffer += format_integer(exponent < 0 ? -exponent : exponent, buffer);
+    }
+
+    *buffer = '\0';
+
+    return buffer - start;
+}
@@ -4,22 +4,15 @@
 
 #include "vm.h"
 
-void vm_free_map(Vm *vm, ObjMap *map) {
-    for (size_t i = 0; i < map->capacity; i++) {
-        ObjMapEntry entry = map->entries[i];
-
-        if (entry.key != NULL) {
-            free(entry.key->items);
-
-            vm->bytes_allocated -= entry.key->count;
-
-            vm_free_value(vm, entry.value);
-        }
-    }
+// Whether the items are the ones allocated with the array
+static bool vm_array_inline(const ObjArray *array) {
+    return array->inlined > 0 && array->items == array->values;
+}
 
+void vm_free_map(Vm *vm, ObjMap *map) {
     free(map->entries);
 
-    vm->bytes_allocated -= map->capacity * sizeof(ObjMapEntry) + sizeof(ObjMap);
+    vm->bytes_allocated -= vm_map_table_size(map->capacity) + sizeof(ObjMap);
 }
 
 void vm_mark_object(Vm *vm, Obj *obj) {
@@ -32,6 +25,13 @@ void vm_mark_object(Vm *vm, Obj *obj) {
     case OBJ_ARRAY: {
         ObjArray *arr = (ObjArray *)obj;
 
+        // The parent marks every item it shares
+        if (arr->parent != NULL) {
+            vm_mark_object(vm, &arr->parent->obj);
+
+            break;
+        }
+
         for (size_t i = 0; i < arr->count; i++) {
             vm_mark_value(vm, arr->items[i]);
         }
@@ -66,6 +66,10 @@ void vm_mark_object(Vm *vm, Obj *obj) {
             vm_mark_object(vm, &fn->globals->obj);
         }
 
+        if (fn->global_values != NULL) {
+            vm_mark_object(vm, &fn->global_values->obj);
+        }
+
         break;
     }
 
@@ -74,8 +78,11 @@ void vm_mark_object(Vm *vm, Obj *obj) {
 
         vm_mark_object(vm, &closure->fn->obj);
 
+        // Upvalues are NULL until the closure captures them
         for (size_t j = 0; j < closure->upvalues_count; j++) {
-            vm_mark_object(vm, &closure->upvalues[j]->obj);
+            if (closure->upvalues[j] != NULL) {
+                vm_mark_object(vm, &closure->upvalues[j]->obj);
+            }
         }
 
         break;
@@ -94,8 +101,39 @@ void vm_mark_object(Vm *vm, Obj *obj) {
         break;
     }
 
-    case OBJ_STRING:
+    case OBJ_STRING: {
+        ObjString *string = (ObjString *)obj;
+
+        // Appending in a loop builds ropes that lean to the left, so the
+        // spine is followed without recursing
+        while (string->left != NULL) {
+            ObjString *next = string->left;
+            ObjString *other = string->right;
+
+            if (next->left == NULL) {
+                next = string->right;
+                other = string->left;
+            }
+
+            vm_mark_object(vm, &other->obj);
+
+            if (next->obj.marked) {
+                break;
+            }
+
+            next->obj.marked = true;
+            string = next;
+        }
+
+        if (string->parent != NULL) {
+            vm_mark_object(vm, &string->parent->obj);
+        }
+
+        break;
+    }
+
     case OBJ_NATIVE:
+    case OBJ_TYPED_ARRAY:
         break;
     }
 }
@@ -114,7 +152,21 @@ void vm_mark_roots(Vm *vm) {
     for (size_t i = 0; i < vm->frame_count; i++) {
         CallFrame frame = vm->frames[i];
 
-        vm_mark_object(vm, &frame.closure->fn->obj);
+        // The compiler pushes frames before their closure is allocated
+        if (frame.closure != NULL) {
+            vm_mark_object(vm, &frame.closure->obj);
+        }
+    }
+
+    for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        vm_mark_object(vm, &upvalue->obj);
+    }
+
+    // Only the table of strings is kept, its keys are dropped when nothing
+    // else reaches them, see vm_delete_white_strings
+    if (vm->strings != NULL) {
+        vm->strings->obj.marked = true;
     }
 }
 
@@ -123,9 +175,17 @@ void vm_free_object(Vm *vm, Obj *obj) {
     case OBJ_STRING: {
         ObjString *str = (ObjString *)obj;
 
-        free(str->items);
+        free(str->offsets);
+
+        vm->bytes_allocated -= sizeof(ObjString);
+
+        if (str->parent == NULL) {
+            if (!str->inlined) {
+                free(str->items);
+            }
 
-        vm->bytes_allocated -= str->count * sizeof(char) + sizeof(ObjString);
+            vm->bytes_allocated -= str->count * sizeof(char);
+        }
 
         break;
     }
@@ -133,13 +193,13 @@ void vm_free_object(Vm *vm, Obj *obj) {
     case OBJ_ARRAY: {
         ObjArray *arr = (ObjArray *)obj;
 
-        for (size_t i = 0; i < arr->count; i++) {
-            vm_free_value(vm, arr->items[i]);
-        }
+        if (arr->parent == NULL && !vm_array_inline(arr)) {
+            free(arr->items);
 
-        free(arr->items);
+            vm->bytes_allocated -= arr->capacity * sizeof(Value);
+        }
 
-        vm->bytes_allocated -= arr->capacity * sizeof(Value) + sizeof(ObjArray);
+        vm->bytes_allocated -= arr->inlined * sizeof(Value) + sizeof(ObjArray);
 
         break;
     }
@@ -153,14 +213,17 @@ void vm_free_object(Vm *vm, Obj *obj) {
     case OBJ_FUNCTION: {
         ObjFunction *fn = (ObjFunction *)obj;
 
-        for (size_t i = 0; i < fn->chunk.constants.count; i++) {
-            vm_free_value(vm, fn->chunk.constants.items[i]);
-        }
-
         free(fn->chunk.constants.items);
+        free(fn->chunk.caches.items);
 
         free(fn->chunk.bytes);
         free(fn->chunk.sources);
+        free(fn->chunk.code);
+        free(fn->chunk.code_index);
+
+#ifdef NUR_JIT
+        vm_jit_free(fn);
+#endif
 
         vm->bytes_allocated -=
             fn->chunk.constants.capacity * sizeof(Value) + sizeof(ObjFunction);
@@ -171,14 +234,6 @@ void vm_free_object(Vm *vm, Obj *obj) {
     case OBJ_CLOSURE: {
         ObjClosure *closure = (ObjClosure *)obj;
 
-        for (uint8_t i = 0; i < closure->upvalues_count; i++) {
-            vm_free_object(vm, &closure->upvalues[i]->obj);
-        }
-
-        free(closure->upvalues);
-
-        vm_free_object(vm, &closure->fn->obj);
-
         vm->bytes_allocated -=
             closure->upvalues_count * sizeof(ObjUpvalue *) + sizeof(ObjClosure);
 
@@ -195,18 +250,25 @@ void vm_free_object(Vm *vm, Obj *obj) {
         vm->bytes_allocated -= sizeof(ObjNative);
 
         break;
+
+    case OBJ_TYPED_ARRAY: {
+        ObjTypedArray *arr = (ObjTypedArray *)obj;
+
+        vm->bytes_allocated -= arr->count * typed_element_size(arr->kind) +
+                               sizeof(ObjTypedArray);
+
+        break;
+    }
     }
 
     free(obj);
 }
 
-void vm_free_value(Vm *vm, Value value) {
-    if (IS_OBJ(value)) {
-        vm_free_object(vm, AS_OBJ(value));
+static void vm_delete_white_strings(Vm *vm) {
+    if (vm->strings == NULL) {
+        return;
     }
-}
 
-static void vm_delete_white_strings(Vm *vm) {
     for (uint32_t i = 0; i < vm->strings->capacity; i++) {
         ObjMapEntry *entry = &vm->strings->entries[i];
 
@@ -214,6 +276,8 @@ static void vm_delete_white_strings(Vm *vm) {
             vm_map_delete(vm->strings, entry->key);
         }
     }
+
+    vm_map_shrink(vm, vm->strings);
 }
 
 static void vm_sweep_objects(Vm *vm) {
@@ -273,35 +337,35 @@ Obj *vm_alloc(Vm *vm, ObjTag tag, size_t size) {
     return object;
 }
 
-ObjFunction *vm_new_function(Vm *vm, ObjMap *globals, Chunk chunk,
-                             uint8_t arity, uint8_t upvalues_count) {
+ObjFunction *vm_new_function(Vm *vm, ObjMap *globals, ObjArray *global_values,
+                             Chunk chunk, uint8_t arity,
+                             uint8_t upvalues_count) {
     ObjFunction *function = OBJ_ALLOC(vm, OBJ_FUNCTION, ObjFunction);
 
     function->globals = globals;
+    function->global_values = global_values;
     function->chunk = chunk;
     function->arity = arity;
     function->upvalues_count = upvalues_count;
+#ifdef NUR_JIT
+    function->jit = NULL;
+    function->hotness = 0;
+    function->loops = NULL;
+#endif
 
     return function;
 }
 
 ObjClosure *vm_new_closure(Vm *vm, ObjFunction *fn) {
-    vm->bytes_allocated += fn->upvalues_count * sizeof(ObjUpvalue);
-
-    if (vm->bytes_allocated > vm->next_gc) {
-        vm_gc(vm);
-    }
-
-    ObjClosure *closure = OBJ_ALLOC(vm, OBJ_CLOSURE, ObjClosure);
-
-    ObjUpvalue **upvalues = malloc(fn->upvalues_count * sizeof(ObjUpvalue));
+    ObjClosure *closure = (ObjClosure *)vm_alloc(
+        vm, OBJ_CLOSURE,
+        sizeof(ObjClosure) + fn->upvalues_count * sizeof(ObjUpvalue *));
 
     for (uint8_t i = 0; i < fn->upvalues_count; i++) {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = NULL;
     }
 
     closure->fn = fn;
-    closure->upvalues = upvalues;
     closure->upvalues_count = fn->upvalues_count;
 
     return closure;
@@ -321,31 +385,62 @@ ObjMap *vm_new_map(Vm *vm) {
     ObjMap *map = OBJ_ALLOC(vm, OBJ_MAP, ObjMap);
 
     map->entries = NULL;
+    map->controls = NULL;
     map->count = 0;
+    map->tombstones = 0;
     map->capacity = 0;
+    map->shape = 0;
 
     return map;
 }
 
-ObjString *vm_new_string(Vm *vm, char *items, uint32_t count, uint32_t hash) {
+ObjString *vm_new_string(Vm *vm, char *items, uint32_t count) {
     ObjString *string = OBJ_ALLOC(vm, OBJ_STRING, ObjString);
 
     string->items = items;
     string->count = count;
-    string->hash = hash;
+    string->hash = 0;
+    string->left = NULL;
+    string->right = NULL;
+    string->parent = NULL;
+    string->offsets = NULL;
+    string->indexed = false;
+    string->interned = false;
+    string->inlined = false;
 
-    vm_map_insert(vm, vm->strings, string, NULL_VAL);
+    return string;
+}
+
+// Allocates a flat string along with room for `count` characters
+static ObjString *vm_alloc_string(Vm *vm, uint32_t count) {
+    ObjString *string = (ObjString *)vm_alloc(
+        vm, OBJ_STRING, sizeof(ObjString) + count * sizeof(char));
+
+    string->items = string->chars;
+    string->count = count;
+    string->hash = 0;
+    string->left = NULL;
+    string->right = NULL;
+    string->parent = NULL;
+    string->offsets = NULL;
+    string->indexed = false;
+    string->interned = false;
+    string->inlined = true;
 
     return string;
 }
 
 ObjString *vm_copy_string(Vm *vm, const char *items, uint32_t count) {
-    vm->bytes_allocated += count * sizeof(*items);
+    ObjString *string = vm_alloc_string(vm, count);
 
-    if (vm->bytes_allocated > vm->next_gc) {
-        vm_gc(vm);
-    }
+    memcpy(string->chars, items, count * sizeof(*items));
 
+    return string;
+}
+
+// Used for the names and literals of the source and the builtins, which are
+// most likely to become keys, finding them first saves copying them again
+ObjString *vm_copy_interned_string(Vm *vm, const char *items, uint32_t count) {
     uint32_t hash = string_hash(items, count);
 
     ObjString *interned = vm_find_string(vm, items, count, hash);
@@ -354,100 +449,425 @@ ObjString *vm_copy_string(Vm *vm, const char *items, uint32_t count) {
         return interned;
     }
 
-    char *copied_items = malloc(count * sizeof(*items));
+    ObjString *string = vm_copy_string(vm, items, count);
+
+    string->hash = hash;
+
+    return vm_intern_string(vm, string);
+}
 
-    if (copied_items == NULL) {
+// Both strings have to be reachable, allocating the result can collect garbage
+ObjString *vm_concat_strings(Vm *vm, ObjString *lhs, ObjString *rhs) {
+    if (lhs->count == 0) {
+        return rhs;
+    }
+
+    if (rhs->count == 0) {
+        return lhs;
+    }
+
+    uint32_t count = lhs->count + rhs->count;
+
+    // Short strings are cheaper to copy than to keep as a rope
+    if (count <= VM_ROPE_MIN_COUNT) {
+        vm_flatten_string(lhs);
+        vm_flatten_string(rhs);
+
+        ObjString *string = vm_alloc_string(vm, count);
+
+        memcpy(string->chars, lhs->items, lhs->count);
+        memcpy(string->chars + lhs->count, rhs->items, rhs->count);
+
+        return string;
+    }
+
+    // Ropes count their items from the start, flattening them does not need
+    // the vm
+    vm->bytes_allocated += count * sizeof(char);
+
+    ObjString *string = OBJ_ALLOC(vm, OBJ_STRING, ObjString);
+
+    string->items = NULL;
+    string->count = count;
+    string->hash = 0;
+    string->left = lhs;
+    string->right = rhs;
+    string->parent = NULL;
+    string->offsets = NULL;
+    string->indexed = false;
+    string->interned = false;
+    string->inlined = false;
+
+    return string;
+}
+
+// Takes the items from byte `start` to byte `end` without copying them, the
+// string has to be reachable and indexed, allocating the slice can collect
+// garbage. Slices of slices share the items of the first parent
+ObjString *vm_slice_string(Vm *vm, ObjString *string, uint32_t start,
+                           uint32_t end) {
+    ObjString *slice = OBJ_ALLOC(vm, OBJ_STRING, ObjString);
+
+    slice->items = string->items + start;
+    slice->count = end - start;
+    slice->hash = 0;
+    slice->left = NULL;
+    slice->right = NULL;
+    slice->parent = string->parent != NULL ? string->parent : string;
+    slice->offsets = NULL;
+    slice->interned = false;
+    slice->inlined = false;
+
+    // Slices of ASCII strings are ASCII, just as slices of malformed strings
+    // are indexed by bytes too
+    slice->indexed = string->offsets == NULL;
+    slice->length = slice->count;
+
+    return slice;
+}
+
+// Copies the items of every flat string under the rope into place, walking it
+// with a stack of its own as ropes get as deep as the number of concatenations
+void vm_flatten_rope(ObjString *rope) {
+    char *items = malloc(rope->count * sizeof(char));
+    size_t capacity = 64;
+    ObjString **stack = malloc(capacity * sizeof(ObjString *));
+
+    if (items == NULL || stack == NULL) {
         fprintf(stderr, "error: out of memory\n");
 
         exit(1);
     }
 
-    memcpy(copied_items, items, count * sizeof(*items));
+    size_t depth = 0;
+    char *end = items;
+
+    stack[depth++] = rope;
+
+    while (depth > 0) {
+        ObjString *string = stack[--depth];
+
+        if (string->left == NULL) {
+            memcpy(end, string->items, string->count);
+            end += string->count;
+
+            continue;
+        }
+
+        if (depth + 2 > capacity) {
+            capacity *= 2;
+            stack = realloc(stack, capacity * sizeof(ObjString *));
+
+            if (stack == NULL) {
+                fprintf(stderr, "error: out of memory\n");
+
+                exit(1);
+            }
+        }
+
+        stack[depth++] = string->right;
+        stack[depth++] = string->left;
+    }
+
+    free(stack);
 
-    return vm_new_string(vm, copied_items, count, hash);
+    rope->items = items;
+    rope->left = NULL;
+    rope->right = NULL;
 }
 
-ObjString *vm_concat_strings(Vm *vm, ObjString *lhs, ObjString *rhs) {
-    vm->bytes_allocated += lhs->count + rhs->count;
+// Counts the characters of the string, those that are valid UTF-8 but not ASCII
+// also record where every VM_STRING_INDEX_STRIDE-th character starts, so that
+// finding any character skips at most that many instead of walking from the
+// start
+void vm_index_string(ObjString *string) {
+    vm_flatten_string(string);
 
-    if (vm->bytes_allocated > vm->next_gc) {
-        vm_gc(vm);
+    const char *start = string->items;
+    const char *end = start + string->count;
+    const char *ascii_end = start;
+
+    // Eight bytes at a time until one of them has the high bit set
+    while (end - ascii_end >= 8) {
+        uint64_t word;
+        memcpy(&word, ascii_end, sizeof(word));
+
+        if (word & 0x8080808080808080ull) {
+            break;
+        }
+
+        ascii_end += 8;
     }
 
-    char *items = malloc((lhs->count + rhs->count) * sizeof(char));
+    while (ascii_end < end && (*ascii_end & 0x80) == 0) {
+        ascii_end++;
+    }
 
-    if (items == NULL) {
+    string->indexed = true;
+
+    // Malformed strings are indexed as if every byte was a character
+    if (ascii_end == end || !string_utf8_validate(ascii_end, end)) {
+        string->length = string->count;
+
+        return;
+    }
+
+    uint32_t length = (ascii_end - start) +
+                      string_utf8_characters_count(ascii_end, end);
+
+    string->length = length;
+    string->offsets =
+        malloc((length / VM_STRING_INDEX_STRIDE + 1) * sizeof(uint32_t));
+
+    if (string->offsets == NULL) {
         fprintf(stderr, "error: out of memory\n");
 
         exit(1);
     }
 
-    memcpy(items, lhs->items, lhs->count);
-    memcpy(items + lhs->count, rhs->items, rhs->count);
+    const char *character = start;
 
-    uint32_t count = lhs->count + rhs->count;
+    for (uint32_t i = 0;; i++) {
+        if (i % VM_STRING_INDEX_STRIDE == 0) {
+            string->offsets[i / VM_STRING_INDEX_STRIDE] = character - start;
+        }
 
-    uint32_t hash = string_hash(items, count);
+        if (i == length) {
+            break;
+        }
 
-    ObjString *interned = vm_find_string(vm, items, count, hash);
+        character = string_utf8_skip_character(character);
+    }
+}
 
-    if (interned != NULL) {
-        free(items);
+// Returns the interned string equal to `string`, which becomes it if there is
+// none, so that it can be compared by identity
+ObjString *vm_intern_string(Vm *vm, ObjString *string) {
+    if (string->interned) {
+        return string;
+    }
+
+    uint32_t hash = vm_string_hash(string);
 
+    ObjString *interned =
+        vm_find_string(vm, string->items, string->count, hash);
+
+    if (interned != NULL) {
         return interned;
     }
 
-    return vm_new_string(vm, items, count, hash);
-}
+    // Interned strings may outlive their parent by far, so they get items of
+    // their own
+    if (string->parent != NULL) {
+        char *items = malloc(string->count * sizeof(char));
 
-ObjArray *vm_copy_array(Vm *vm, const Value *items, uint32_t count) {
-    vm->bytes_allocated += count * sizeof(*items);
+        if (items == NULL) {
+            fprintf(stderr, "error: out of memory\n");
 
-    if (vm->bytes_allocated > vm->next_gc) {
-        vm_gc(vm);
+            exit(1);
+        }
+
+        memcpy(items, string->items, string->count * sizeof(char));
+
+        vm->bytes_allocated += string->count * sizeof(char);
+
+        string->items = items;
+        string->parent = NULL;
     }
 
+    string->interned = true;
+
+    // Growing the table of strings can collect garbage
+    vm_push(vm, OBJ_VAL(string));
+    vm_map_insert(vm, vm->strings, string, NULL_VAL);
+    vm_pop(vm);
+
+    return string;
+}
+
+ObjArray *vm_new_array(Vm *vm) {
     ObjArray *array = OBJ_ALLOC(vm, OBJ_ARRAY, ObjArray);
 
-    array->items = malloc(count * sizeof(*items));
+    array->items = NULL;
+    array->count = 0;
+    array->capacity = 0;
+    array->parent = NULL;
+    array->inlined = 0;
 
-    if (array->items == NULL) {
-        fprintf(stderr, "error: out of memory\n");
+    return array;
+}
 
-        exit(1);
+// Allocates an array of `count` items, short ones along with room for them
+static ObjArray *vm_alloc_array(Vm *vm, uint32_t count) {
+    uint32_t inlined =
+        count <= VM_ARRAY_INLINE_CAPACITY ? VM_ARRAY_INLINE_CAPACITY : 0;
+
+    if (inlined == 0) {
+        vm->bytes_allocated += count * sizeof(Value);
     }
 
-    memcpy(array->items, items, count * sizeof(*items));
+    ObjArray *array = (ObjArray *)vm_alloc(
+        vm, OBJ_ARRAY, sizeof(ObjArray) + inlined * sizeof(Value));
 
+    array->items = array->values;
     array->count = count;
-    array->capacity = count;
+    array->capacity = inlined;
+    array->parent = NULL;
+    array->inlined = inlined;
+
+    if (inlined == 0) {
+        array->items = malloc(count * sizeof(Value));
+
+        if (array->items == NULL) {
+            fprintf(stderr, "error: out of memory\n");
+
+            exit(1);
+        }
+
+        array->capacity = count;
+    }
+
+    return array;
+}
+
+ObjArray *vm_copy_array(Vm *vm, const Value *items, uint32_t count) {
+    ObjArray *array = vm_alloc_array(vm, count);
+
+    memcpy(array->items, items, count * sizeof(*items));
 
     return array;
 }
 
 ObjArray *vm_concat_arrays(Vm *vm, ObjArray *lhs, ObjArray *rhs) {
-    vm->bytes_allocated += (lhs->count + rhs->count) * sizeof(Value);
+    ObjArray *array = vm_alloc_array(vm, lhs->count + rhs->count);
 
-    if (vm->bytes_allocated > vm->next_gc) {
-        vm_gc(vm);
+    memcpy(array->items, lhs->items, lhs->count * sizeof(Value));
+    memcpy(array->items + lhs->count, rhs->items, rhs->count * sizeof(Value));
+
+    return array;
+}
+
+// Takes the items from `start` to `end` without copying them, the array has to
+// be reachable since allocating the slice can collect garbage
+ObjArray *vm_slice_array(Vm *vm, ObjArray *array, uint32_t start,
+                         uint32_t end) {
+    // Short slices are cheaper to copy than to share, which also keeps inline
+    // items from being shared
+    if (end - start <= VM_ARRAY_INLINE_CAPACITY) {
+        return vm_copy_array(vm, array->items + start, end - start);
     }
 
-    ObjArray *array = OBJ_ALLOC(vm, OBJ_ARRAY, ObjArray);
+    if (array->parent == NULL) {
+        ObjArray *parent = OBJ_ALLOC(vm, OBJ_ARRAY, ObjArray);
 
-    array->items = malloc((lhs->count + rhs->count) * sizeof(Value));
+        parent->items = array->items;
+        parent->count = array->count;
+        parent->capacity = array->capacity;
+        parent->parent = NULL;
+        parent->inlined = 0;
 
-    if (array->items == NULL) {
-        fprintf(stderr, "error: out of memory\n");
+        array->capacity = 0;
+        array->parent = parent;
+    }
 
-        exit(1);
+    ObjArray *slice = OBJ_ALLOC(vm, OBJ_ARRAY, ObjArray);
+
+    slice->items = array->items + start;
+    slice->count = end - start;
+    slice->capacity = 0;
+    slice->parent = array->parent;
+    slice->inlined = 0;
+
+    return slice;
+}
+
+// Copies the items the array shares with its parent before it writes to them
+void vm_unshare_array(Vm *vm, ObjArray *array) {
+    if (array->parent == NULL) {
+        return;
     }
 
-    memcpy(array->items, lhs->items, lhs->count * sizeof(Value));
-    memcpy(array->items + lhs->count, rhs->items, rhs->count * sizeof(Value));
+    Value *items = NULL;
 
-    array->count = lhs->count + rhs->count;
+    if (array->count > 0) {
+        items = malloc(array->count * sizeof(Value));
+
+        if (items == NULL) {
+            fprintf(stderr, "error: out of memory\n");
+
+            exit(1);
+        }
 
+        memcpy(items, array->items, array->count * sizeof(Value));
+    }
+
+    vm->bytes_allocated += array->count * sizeof(Value);
+
+    array->items = items;
     array->capacity = array->count;
+    array->parent = NULL;
+}
+
+// Appends the value, the items are copied first if they are shared and moved
+// out of the array once they outgrow its inline ones
+void vm_array_push(Vm *vm, ObjArray *array, Value value) {
+    vm_unshare_array(vm, array);
+
+    if (array->count == array->capacity) {
+        bool inline_items = vm_array_inline(array);
+
+        uint32_t capacity = array->capacity > 0 ? array->capacity * 2
+                                                : VM_ARRAY_INLINE_CAPACITY;
+
+        // Inline items stay allocated with the array, they are copied out
+        Value *items = inline_items
+                           ? malloc(capacity * sizeof(Value))
+                           : realloc(array->items, capacity * sizeof(Value));
+
+        if (items == NULL) {
+            fprintf(stderr, "error: out of memory\n");
+
+            exit(1);
+        }
+
+        if (inline_items) {
+            memcpy(items, array->items, array->count * sizeof(Value));
+        }
+
+        vm->bytes_allocated +=
+            (capacity - (inline_items ? 0 : array->capacity)) * sizeof(Value);
+
+        array->items = items;
+        array->capacity = capacity;
+    }
+
+    array->items[array->count++] = value;
+}
+
+// Allocates a typed array of `count` zeros along with its items
+ObjTypedArray *vm_new_typed_array(Vm *vm, TypedKind kind, uint32_t count) {
+    size_t size = count * typed_element_size(kind);
+
+    ObjTypedArray *array = (ObjTypedArray *)vm_alloc(
+        vm, OBJ_TYPED_ARRAY, sizeof(ObjTypedArray) + size);
+
+    array->count = count;
+    array->kind = kind;
+
+    memset(array->items, 0, size);
 
     return array;
 }
+
+// Copies the items from `start` to `end`, the array has to be reachable since
+// allocating the slice can collect garbage
+ObjTypedArray *vm_slice_typed_array(Vm *vm, ObjTypedArray *array,
+                                    uint32_t start, uint32_t end) {
+    ObjTypedArray *slice = vm_new_typed_array(vm, array->kind, end - start);
+
+    size_t size = typed_element_size(array->kind);
+
+    memcpy(slice->items, array->items + start * size, (end - start) * size);
+
+    return slice;
+}
@@ -0,0 +1,1197 @@
+#pragma once
+
+vmcase(OP_POP) {
+    sp--;
+    vmbreak();
+}
+
+vmcase(OP_DUP) {
+    vmpush(vmpeek(0));
+    vmbreak();
+}
+
+vmcase(OP_SWP) {
+    Value a = vmpeek(0);
+    Value b = vmpeek(1);
+    vmpoke(0, b);
+    vmpoke(1, a);
+    vmbreak();
+}
+
+vmcase(OP_PUSH_NULL) {
+    vmpush(NULL_VAL);
+    vmbreak();
+}
+
+vmcase(OP_PUSH_TRUE) {
+    vmpush(BOOL_VAL(true));
+    vmbreak();
+}
+
+vmcase(OP_PUSH_FALSE) {
+    vmpush(BOOL_VAL(false));
+    vmbreak();
+}
+
+vmcase(OP_PUSH_CONST) {
+    vmpush(in->constant);
+    vmbreak();
+}
+
+vmcase(OP_GET_LOCAL) {
+    vmpush(slots[in->a]);
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL) {
+    slots[in->a] = vmpeek(0);
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+
+    vmquicken(OP_SET_LOCAL_WITH_MATH_NUM, *slot, vmpeek(0));
+
+    Value result;
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, *slot, vmpeek(0), &result)) {
+        return false;
+    }
+
+    *slot = result;
+
+    vmpoke(0, result);
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH_LOCAL) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+    Value rhs = slots[in->c];
+
+    vmquicken(OP_SET_LOCAL_WITH_MATH_LOCAL_NUM, *slot, rhs);
+
+    Value result;
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, *slot, rhs, &result)) {
+        return false;
+    }
+
+    *slot = result;
+
+    vmpush(result);
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH_CONST) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+    Value rhs = in->constant;
+
+    vmquicken(OP_SET_LOCAL_WITH_MATH_CONST_NUM, *slot, rhs);
+
+    Value result;
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, *slot, rhs, &result)) {
+        return false;
+    }
+
+    *slot = result;
+
+    vmpush(result);
+
+    vmbreak();
+}
+
+vmcase(OP_MATH_LOCAL_LOCAL) {
+    OpCode op = in->a;
+    Value lhs = slots[in->b];
+    Value rhs = slots[in->c];
+
+    vmquicken(OP_MATH_LOCAL_LOCAL_NUM, lhs, rhs);
+
+    Value result;
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, lhs, rhs, &result)) {
+        return false;
+    }
+
+    vmpush(result);
+
+    vmbreak();
+}
+
+vmcase(OP_MATH_LOCAL_CONST) {
+    OpCode op = in->a;
+    Value lhs = slots[in->b];
+    Value rhs = in->constant;
+
+    vmquicken(OP_MATH_LOCAL_CONST_NUM, lhs, rhs);
+
+    Value result;
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, lhs, rhs, &result)) {
+        return false;
+    }
+
+    vmpush(result);
+
+    vmbreak();
+}
+
+vmcase(OP_GET_UPVALUE) {
+    vmpush(*frame->closure->upvalues[in->a]->location);
+    vmbreak();
+}
+
+vmcase(OP_SET_UPVALUE) {
+    *frame->closure->upvalues[in->a]->location = vmpeek(0);
+    vmbreak();
+}
+
+vmcase(OP_SET_UPVALUE_WITH_MATH) {
+    OpCode op = in->a;
+    Value *location =
+        frame->closure->upvalues[in->b]->location;
+
+    vmquicken(OP_SET_UPVALUE_WITH_MATH_NUM, *location,
+              vmpeek(0));
+
+    Value result;
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, *location, vmpeek(0), &result)) {
+        return false;
+    }
+
+    *location = result;
+
+    vmpoke(0, result);
+
+    vmbreak();
+}
+
+vmcase(OP_CLOSE_UPVALUE) {
+    vm_close_upvalues(vm, sp - 1);
+    sp--;
+    vmbreak();
+}
+
+vmcase(OP_GET_GLOBAL) {
+    uint16_t slot = in->index;
+
+    Value value = frame->closure->fn->global_values->items[slot];
+
+    if (IS_UNDEFINED(value)) {
+        vmsave();
+
+        vm_undefined_global_error(vm, frame->closure->fn, slot);
+
+        return false;
+    }
+
+    vmpush(value);
+
+    vmbreak();
+}
+
+vmcase(OP_SET_GLOBAL) {
+    frame->closure->fn->global_values->items[in->index] =
+        vmpeek(0);
+
+    vmbreak();
+}
+
+vmcase(OP_SET_GLOBAL_WITH_MATH) {
+    OpCode op = in->a;
+    uint16_t slot = in->index;
+
+    Value *global = &frame->closure->fn->global_values->items[slot];
+
+    if (IS_UNDEFINED(*global)) {
+        vmsave();
+
+        vm_undefined_global_error(vm, frame->closure->fn, slot);
+
+        return false;
+    }
+
+    vmquicken(OP_SET_GLOBAL_WITH_MATH_NUM, *global, vmpeek(0));
+
+    Value result;
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, *global, vmpeek(0), &result)) {
+        return false;
+    }
+
+    *global = result;
+
+    vmpoke(0, result);
+
+    vmbreak();
+}
+
+vmcase(OP_GET_SUBSCRIPT) {
+    Value target = vmpop();
+    Value index = vmpop();
+
+    vmsave();
+
+    if (!vm_get_subscript(vm, target, index)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_SET_SUBSCRIPT) {
+    Value target = vmpop();
+    Value index = vmpop();
+
+    vmsave();
+
+    if (!vm_set_subscript(vm, target, index)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_SET_SUBSCRIPT_WITH_MATH) {
+    OpCode op = in->a;
+
+    Value target = vmpop();
+    Value index = vmpop();
+    Value rhs = vmpop();
+
+    vmsave();
+
+    if (!vm_get_subscript(vm, target, index)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmquicken(OP_SET_SUBSCRIPT_WITH_MATH_NUM, vmpeek(0), rhs);
+
+    vmpush(rhs);
+
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, op)) {
+        return false;
+    }
+
+    sp--;
+
+    vmsave();
+
+    if (!vm_set_subscript(vm, target, index)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_GET_MEMBER) {
+    ObjString *key = AS_STRING(in->constant);
+    InlineCache *cache = in->cache;
+
+    vmsave();
+
+    if (!vm_get_member(vm, key, cache)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_SET_MEMBER) {
+    ObjString *key = AS_STRING(in->constant);
+    InlineCache *cache = in->cache;
+
+    vmsave();
+
+    if (!vm_set_member(vm, key, cache)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_SET_MEMBER_WITH_MATH) {
+    OpCode op = in->a;
+    ObjString *key = AS_STRING(in->constant);
+    InlineCache *cache = in->cache;
+
+    vmsave();
+
+    if (!vm_set_member_with_math(vm, op, key, cache)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_MAKE_ARRAY) {
+    uint32_t count = in->index;
+
+    vmsave();
+
+    ObjArray *array = vm_copy_array(vm, sp - count, count);
+
+    sp -= count;
+
+    vmpush(OBJ_VAL(array));
+
+    vmbreak();
+}
+
+vmcase(OP_COPY_BY_SLICING) {
+    // Slicing can collect garbage, so the target stays on the stack
+    Value target = vmpeek(0);
+
+    vmsave();
+
+    if (IS_ARRAY(target)) {
+        ObjArray *array = AS_ARRAY(target);
+
+        ObjArray *copy = vm_slice_array(vm, array, 0, array->count);
+
+        sp--;
+
+        vmpush(OBJ_VAL(copy));
+    } else if (IS_TYPED_ARRAY(target)) {
+        ObjTypedArray *array = AS_TYPED_ARRAY(target);
+
+        ObjTypedArray *copy =
+            vm_slice_typed_array(vm, array, 0, array->count);
+
+        sp--;
+
+        vmpush(OBJ_VAL(copy));
+    } else if (IS_STRING(target)) {
+        // Strings are immutable, so the copy can be the string itself
+    } else {
+        vm_error(vm, "%s is not an array value",
+                 value_description(target));
+
+        return false;
+    }
+
+    vmbreak();
+}
+
+vmcase(OP_MAKE_SLICE) {
+    vmsave();
+
+    if (!vm_make_slice(vm)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_MAKE_SLICE_UNDER) {
+    vmsave();
+
+    if (!vm_make_slice_under(vm)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_MAKE_SLICE_ABOVE) {
+    vmsave();
+
+    if (!vm_make_slice_above(vm)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_MAKE_MAP) {
+    uint32_t count = in->index;
+
+    vmsave();
+
+    if (!vm_make_map(vm, count)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_MAKE_SHAPED_MAP) {
+    uint32_t count = in->index;
+    InlineCache *cache = in->cache;
+
+    vmsave();
+
+    if (!vm_make_map(vm, count)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    ObjMap *map = AS_MAP(vmpeek(0));
+
+    if (cache->shapes[0] == 0) {
+        cache->shapes[0] = vm_map_shape(map);
+    } else {
+        map->shape = cache->shapes[0];
+    }
+
+    vmbreak();
+}
+
+vmcase(OP_MAKE_CLOSURE) {
+    ObjFunction *fn = AS_FUNCTION(in->constant);
+
+    vmsave();
+
+    ObjClosure *closure = vm_new_closure(vm, fn);
+
+    // Capturing the upvalues can collect garbage
+    vmpush(OBJ_VAL(closure));
+    vmsave();
+
+    for (uint8_t i = 0; i < fn->upvalues_count; i++) {
+        uint8_t is_local = in->upvalues[i * 2];
+        uint8_t index = in->upvalues[i * 2 + 1];
+
+        if (is_local) {
+            closure->upvalues[i] =
+                vm_capture_upvalue(vm, slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+
+    vmbreak();
+}
+
+vmcase(OP_EQL) {
+    Value rhs = vmpop();
+    vmpoke(0, BOOL_VAL(values_equal(vmpeek(0), rhs)));
+    vmbreak();
+}
+
+vmcase(OP_NEQ) {
+    Value rhs = vmpop();
+    vmpoke(0, BOOL_VAL(!values_equal(vmpeek(0), rhs)));
+    vmbreak();
+}
+
+vmcase(OP_NOT) {
+    vmpoke(0, BOOL_VAL(value_is_falsey(vmpeek(0))));
+    vmbreak();
+}
+
+vmcase(OP_NEG) {
+    vmsave();
+
+    if (!vm_neg(vm)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_ADD) {
+    vmquicken(OP_ADD_NUM, vmpeek(1), vmpeek(0));
+
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_ADD)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_SUB) {
+    vmquicken(OP_SUB_NUM, vmpeek(1), vmpeek(0));
+
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_SUB)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_MUL) {
+    vmquicken(OP_MUL_NUM, vmpeek(1), vmpeek(0));
+
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_MUL)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_DIV) {
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_DIV)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_MOD) {
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_MOD)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_POW) {
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_POW)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_LT) {
+    vmquicken(OP_LT_NUM, vmpeek(1), vmpeek(0));
+
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_LT)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_GT) {
+    vmquicken(OP_GT_NUM, vmpeek(1), vmpeek(0));
+
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_GT)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_LTE) {
+    vmquicken(OP_LTE_NUM, vmpeek(1), vmpeek(0));
+
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_LTE)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_GTE) {
+    vmquicken(OP_GTE_NUM, vmpeek(1), vmpeek(0));
+
+    vmsave();
+
+    if (!vm_execute_math_on_stack(vm, sp, OP_GTE)) {
+        return false;
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_CALL) {
+    uint8_t argc = in->a;
+    Value callee = vmpop();
+
+    vmsave();
+
+    if (!vm_call_value(vm, callee, argc)) {
+        return false;
+    }
+
+    vmload();
+
+    vmjit();
+
+    vmbreak();
+}
+
+vmcase(OP_TAIL_CALL) {
+    uint8_t argc = in->a;
+    Value callee = vmpop();
+
+    vmsave();
+
+    if (!vm_tail_call_value(vm, callee, argc)) {
+        return false;
+    }
+
+    vmload();
+
+    vmjit();
+
+    vmbreak();
+}
+
+vmcase(OP_POP_JUMP_IF_FALSE) {
+    if (value_is_falsey(vmpop()))
+        pc = in->target;
+
+    vmbreak();
+}
+
+vmcase(OP_JUMP_IF_FALSE) {
+    if (value_is_falsey(vmpeek(0)))
+        pc = in->target;
+
+    vmbreak();
+}
+
+vmcase(OP_JUMP) {
+    pc = in->target;
+
+    vmbreak();
+}
+
+vmcase(OP_LOOP) {
+    pc = in->target;
+
+    vmjit();
+
+    vmbreak();
+}
+
+vmcase(OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE) {
+    OpCode op = in->a;
+    Value lhs = slots[in->b];
+    Value rhs = slots[in->c];
+
+    vmquicken(OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM, lhs, rhs);
+
+    Value result;
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, lhs, rhs, &result)) {
+        return false;
+    }
+
+    if (value_is_falsey(result))
+        pc = in->target;
+
+    vmbreak();
+}
+
+vmcase(OP_MATH_LOCAL_CONST_JUMP_IF_FALSE) {
+    OpCode op = in->a;
+    Value lhs = slots[in->b];
+    Value rhs = in->constant;
+
+    vmquicken(OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM, lhs, rhs);
+
+    Value result;
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, lhs, rhs, &result)) {
+        return false;
+    }
+
+    if (value_is_falsey(result))
+        pc = in->target;
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH_LOCAL_POP) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+    Value rhs = slots[in->c];
+
+    vmquicken(OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM, *slot, rhs);
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, *slot, rhs, slot)) {
+        return false;
+    }
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH_CONST_POP) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+    Value rhs = in->constant;
+
+    vmquicken(OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM, *slot, rhs);
+
+    vmsave();
+
+    if (!vm_execute_math(vm, op, *slot, rhs, slot)) {
+        return false;
+    }
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_POP) {
+    slots[in->a] = vmpop();
+    vmbreak();
+}
+
+vmcase(OP_GET_SUBSCRIPT_LOCAL_CONST) {
+    Value target = slots[in->a];
+    Value index = in->constant;
+
+    vmsave();
+
+    if (!vm_get_subscript(vm, target, index)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_CALL_UPVALUE) {
+    Value callee = *frame->closure->upvalues[in->a]->location;
+    uint8_t argc = in->b;
+
+    vmsave();
+
+    if (!vm_call_value(vm, callee, argc)) {
+        return false;
+    }
+
+    vmload();
+
+    vmjit();
+
+    vmbreak();
+}
+
+vmcase(OP_CALL_GLOBAL) {
+    uint16_t slot = in->index;
+
+    Value callee = frame->closure->fn->global_values->items[slot];
+
+    if (IS_UNDEFINED(callee)) {
+        vmsave();
+
+        // Errors are reported from the byte before frame->ip, the slot's last
+        // one has the source of the name while the argument count has the
+        // source of the call
+        frame->ip = bytes + in->offset + 3;
+
+        vm_undefined_global_error(vm, frame->closure->fn, slot);
+
+        return false;
+    }
+
+    uint8_t argc = in->a;
+
+    vmsave();
+
+    if (!vm_call_value(vm, callee, argc)) {
+        return false;
+    }
+
+    vmload();
+
+    vmjit();
+
+    vmbreak();
+}
+
+vmcase(OP_ADD_NUM) {
+    if (!vm_execute_num_on_stack(sp, OP_ADD)) {
+        vmdeopt(OP_ADD);
+        vmbreak();
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_SUB_NUM) {
+    if (!vm_execute_num_on_stack(sp, OP_SUB)) {
+        vmdeopt(OP_SUB);
+        vmbreak();
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_MUL_NUM) {
+    if (!vm_execute_num_on_stack(sp, OP_MUL)) {
+        vmdeopt(OP_MUL);
+        vmbreak();
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_LT_NUM) {
+    if (!vm_execute_num_on_stack(sp, OP_LT)) {
+        vmdeopt(OP_LT);
+        vmbreak();
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_GT_NUM) {
+    if (!vm_execute_num_on_stack(sp, OP_GT)) {
+        vmdeopt(OP_GT);
+        vmbreak();
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_LTE_NUM) {
+    if (!vm_execute_num_on_stack(sp, OP_LTE)) {
+        vmdeopt(OP_LTE);
+        vmbreak();
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_GTE_NUM) {
+    if (!vm_execute_num_on_stack(sp, OP_GTE)) {
+        vmdeopt(OP_GTE);
+        vmbreak();
+    }
+
+    sp--;
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH_NUM) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+
+    if (!vm_execute_num(op, *slot, vmpeek(0), slot)) {
+        vmdeopt(OP_SET_LOCAL_WITH_MATH);
+        vmbreak();
+    }
+
+    vmpoke(0, *slot);
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH_LOCAL_NUM) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+    Value rhs = slots[in->c];
+
+    if (!vm_execute_num(op, *slot, rhs, slot)) {
+        vmdeopt(OP_SET_LOCAL_WITH_MATH_LOCAL);
+        vmbreak();
+    }
+
+    vmpush(*slot);
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+    Value rhs = slots[in->c];
+
+    if (!vm_execute_num(op, *slot, rhs, slot)) {
+        vmdeopt(OP_SET_LOCAL_WITH_MATH_LOCAL_POP);
+    }
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH_CONST_NUM) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+    Value rhs = in->constant;
+
+    if (!vm_execute_num(op, *slot, rhs, slot)) {
+        vmdeopt(OP_SET_LOCAL_WITH_MATH_CONST);
+        vmbreak();
+    }
+
+    vmpush(*slot);
+
+    vmbreak();
+}
+
+vmcase(OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM) {
+    OpCode op = in->a;
+    Value *slot = &slots[in->b];
+    Value rhs = in->constant;
+
+    if (!vm_execute_num(op, *slot, rhs, slot)) {
+        vmdeopt(OP_SET_LOCAL_WITH_MATH_CONST_POP);
+    }
+
+    vmbreak();
+}
+
+vmcase(OP_SET_UPVALUE_WITH_MATH_NUM) {
+    OpCode op = in->a;
+    Value *location =
+        frame->closure->upvalues[in->b]->location;
+
+    if (!vm_execute_num(op, *location, vmpeek(0), location)) {
+        vmdeopt(OP_SET_UPVALUE_WITH_MATH);
+        vmbreak();
+    }
+
+    vmpoke(0, *location);
+
+    vmbreak();
+}
+
+vmcase(OP_SET_GLOBAL_WITH_MATH_NUM) {
+    OpCode op = in->a;
+    Value *global =
+        &frame->closure->fn->global_values->items[in->index];
+
+    if (!vm_execute_num(op, *global, vmpeek(0), global)) {
+        vmdeopt(OP_SET_GLOBAL_WITH_MATH);
+        vmbreak();
+    }
+
+    vmpoke(0, *global);
+
+    vmbreak();
+}
+
+vmcase(OP_SET_SUBSCRIPT_WITH_MATH_NUM) {
+    OpCode op = in->a;
+
+    Value target = vmpop();
+    Value index = vmpop();
+    Value rhs = vmpop();
+
+    vmsave();
+
+    if (!vm_get_subscript(vm, target, index)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    Value result;
+
+    // The operands were already consumed, so finish this execution
+    // on the generic path instead of rewinding
+    if (vm_execute_num(op, vmpeek(0), rhs, &result)) {
+        vmpoke(0, result);
+    } else {
+        vmrewrite(OP_SET_SUBSCRIPT_WITH_MATH);
+
+        vmpush(rhs);
+
+        vmsave();
+
+        if (!vm_execute_math_on_stack(vm, sp, op)) {
+            return false;
+        }
+
+        sp--;
+    }
+
+    vmsave();
+
+    if (!vm_set_subscript(vm, target, index)) {
+        return false;
+    }
+
+    sp = vm->sp;
+
+    vmbreak();
+}
+
+vmcase(OP_MATH_LOCAL_LOCAL_NUM) {
+    OpCode op = in->a;
+    Value lhs = slots[in->b];
+    Value rhs = slots[in->c];
+
+    Value result;
+
+    if (!vm_execute_num(op, lhs, rhs, &result)) {
+        vmdeopt(OP_MATH_LOCAL_LOCAL);
+        vmbreak();
+    }
+
+    vmpush(result);
+
+    vmbreak();
+}
+
+vmcase(OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM) {
+    OpCode op = in->a;
+    Value lhs = slots[in->b];
+    Value rhs = slots[in->c];
+
+    Value result;
+
+    if (!vm_execute_num(op, lhs, rhs, &result)) {
+        vmdeopt(OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE);
+        vmbreak();
+    }
+
+    if (value_is_falsey(result))
+        pc = in->target;
+
+    vmbreak();
+}
+
+vmcase(OP_MATH_LOCAL_CONST_NUM) {
+    OpCode op = in->a;
+    Value lhs = slots[in->b];
+    Value rhs = in->constant;
+
+    Value result;
+
+    if (!vm_execute_num(op, lhs, rhs, &result)) {
+        vmdeopt(OP_MATH_LOCAL_CONST);
+        vmbreak();
+    }
+
+    vmpush(result);
+
+    vmbreak();
+}
+
+vmcase(OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM) {
+    OpCode op = in->a;
+    Value lhs = slots[in->b];
+    Value rhs = in->constant;
+
+    Value result;
+
+    if (!vm_execute_num(op, lhs, rhs, &result)) {
+        vmdeopt(OP_MATH_LOCAL_CONST_JUMP_IF_FALSE);
+        vmbreak();
+    }
+
+    if (value_is_falsey(result))
+        pc = in->target;
+
+    vmbreak();
+}
+
+vmcase(OP_RETURN) {
+    Value returned = vmpop();
+
+    vm_close_upvalues(vm, slots);
+
+    vm->frame_count--;
+
+    if (vm->frame_count == 0) {
+        vm->sp = sp;
+
+        *out = returned;
+
+        return true;
+    }
+
+    vm->sp = slots;
+
+    vm_push(vm, returned);
+
+    vmload();
+
+    vmjit();
+
+    vmbreak();
+}
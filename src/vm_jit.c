@@ -0,0 +1,2019 @@
+#include "vm.h"
+
+#ifdef NUR_JIT
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "array.h"
+
+// A baseline JIT, each instruction of a hot function is translated on its own
+// into a template of x86-64 code that works on the same stack and frames as
+// vm_run, so the interpreter can enter the generated code at any instruction
+// and the generated code can leave back to the interpreter at any instruction.
+//
+// Common cases (numbers, locals, globals, upvalues and jumps) are handled
+// inline, everything else either calls the same helpers the interpreter uses
+// or leaves to the interpreter, which is also how unsupported instructions are
+// executed.
+//
+// Registers that live across the whole generated code:
+//
+//  rbx: Vm *
+//  r12: Value *, the stack pointer, it is only written back to vm->sp before
+//       calling a helper or leaving
+//  r13: Value *, the slots of the frame
+//  r14: CallFrame *
+//  r15: the QNAN mask used to check whether a value is a number
+//  rbp: scratch that survives calls to helpers
+//
+// Loops additionally get traced, once the start of a loop was jumped back to
+// often enough, one iteration of its body is recorded by executing it ahead of
+// time without side effects. When the recorded path only works on numbers it
+// is compiled into a loop of native code that keeps every variable unboxed in
+// an xmm register, guarded by side exits that store them back and resume the
+// interpreter wherever the path diverges.
+
+typedef struct JitCode {
+    uint8_t *code;
+    size_t size;
+    uint32_t *entries; // instruction offset -> code offset or JIT_NO_ENTRY
+} JitCode;
+
+#define JIT_NO_ENTRY UINT32_MAX
+
+typedef struct JitLoop {
+    struct JitLoop *next;
+    uint32_t header;    // offset of the instruction jumped back to
+    uint32_t countdown; // back jumps left until the trace is entered or recorded
+    uint32_t attempts;  // recordings that failed so far
+    uint8_t *trace;
+    size_t size;
+} JitLoop;
+
+typedef enum {
+    JIT_ERROR, // a runtime error was already reported
+    JIT_EXIT,  // the interpreter should execute the instruction at frame->ip
+    JIT_ENTER, // a call or a return changed the frame on top of the stack
+    JIT_TRACE, // a loop got hot, frame->ip is its header
+} JitStatus;
+
+typedef JitStatus (*JitFn)(Vm *vm, CallFrame *frame, const uint8_t *entry);
+typedef void (*JitTraceFn)(Vm *vm, CallFrame *frame);
+
+enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15,
+};
+
+enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7,
+    CC_P = 0xa,
+    CC_NP = 0xb,
+};
+
+typedef struct {
+    size_t at;     // offset of the 32-bit displacement to patch
+    size_t target; // instruction offset that is jumped to
+} JitFixup;
+
+typedef struct {
+    JitFixup *items;
+    size_t count;
+    size_t capacity;
+} JitFixups;
+
+typedef struct {
+    ObjFunction *fn;
+
+    struct {
+        uint8_t *items;
+        size_t count;
+        size_t capacity;
+    } code;
+
+    JitFixups fixups;
+
+    uint32_t *labels; // instruction offset -> code offset
+
+    size_t exit;
+    size_t exit_error;
+    size_t exit_enter;
+    size_t exit_trace;
+} JitCompiler;
+
+static void jit_byte(JitCompiler *c, uint8_t byte) {
+    ARRAY_PUSH(&c->code, byte);
+}
+
+static void jit_u32(JitCompiler *c, uint32_t value) {
+    for (size_t i = 0; i < 4; i++) {
+        jit_byte(c, value >> (i * 8));
+    }
+}
+
+static void jit_u64(JitCompiler *c, uint64_t value) {
+    for (size_t i = 0; i < 8; i++) {
+        jit_byte(c, value >> (i * 8));
+    }
+}
+
+static void jit_patch(JitCompiler *c, size_t at, size_t target) {
+    uint32_t rel = (uint32_t)(target - (at + 4));
+
+    for (size_t i = 0; i < 4; i++) {
+        c->code.items[at + i] = rel >> (i * 8);
+    }
+}
+
+static void jit_rex(JitCompiler *c, uint8_t reg, uint8_t rm) {
+    jit_byte(c, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+static void jit_modrm_reg(JitCompiler *c, uint8_t reg, uint8_t rm) {
+    jit_byte(c, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void jit_modrm_mem(JitCompiler *c, uint8_t reg, uint8_t base,
+                          int32_t disp) {
+    uint8_t mod;
+
+    if (disp == 0 && (base & 7) != RBP) {
+        mod = 0;
+    } else if (disp >= INT8_MIN && disp <= INT8_MAX) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+
+    jit_byte(c, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+
+    if ((base & 7) == RSP) {
+        jit_byte(c, 0x24);
+    }
+
+    if (mod == 1) {
+        jit_byte(c, (uint8_t)disp);
+    } else if (mod == 2) {
+        jit_u32(c, (uint32_t)disp);
+    }
+}
+
+// mov dst, [base + disp]
+static void jit_load(JitCompiler *c, uint8_t dst, uint8_t base, int32_t disp) {
+    jit_rex(c, dst, base);
+    jit_byte(c, 0x8b);
+    jit_modrm_mem(c, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void jit_store(JitCompiler *c, uint8_t base, int32_t disp, uint8_t src) {
+    jit_rex(c, src, base);
+    jit_byte(c, 0x89);
+    jit_modrm_mem(c, src, base, disp);
+}
+
+// mov dst, imm
+static void jit_mov_imm(JitCompiler *c, uint8_t dst, uint64_t imm) {
+    if (imm <= UINT32_MAX) {
+        if (dst >= 8) {
+            jit_byte(c, 0x41);
+        }
+
+        jit_byte(c, 0xb8 + (dst & 7));
+        jit_u32(c, imm);
+    } else {
+        jit_rex(c, 0, dst);
+        jit_byte(c, 0xb8 + (dst & 7));
+        jit_u64(c, imm);
+    }
+}
+
+// <op> dst, src where op is one of the two operand integer instructions
+static void jit_alu(JitCompiler *c, uint8_t opcode, uint8_t dst, uint8_t src) {
+    jit_rex(c, src, dst);
+    jit_byte(c, opcode);
+    jit_modrm_reg(c, src, dst);
+}
+
+#define jit_mov(c, dst, src) jit_alu(c, 0x89, dst, src)
+#define jit_add(c, dst, src) jit_alu(c, 0x01, dst, src)
+#define jit_and(c, dst, src) jit_alu(c, 0x21, dst, src)
+#define jit_or(c, dst, src) jit_alu(c, 0x09, dst, src)
+#define jit_xor(c, dst, src) jit_alu(c, 0x31, dst, src)
+#define jit_cmp(c, dst, src) jit_alu(c, 0x39, dst, src)
+#define jit_test(c, dst, src) jit_alu(c, 0x85, dst, src)
+
+// add dst, imm
+static void jit_add_imm(JitCompiler *c, uint8_t dst, int32_t imm) {
+    jit_rex(c, 0, dst);
+
+    if (imm >= INT8_MIN && imm <= INT8_MAX) {
+        jit_byte(c, 0x83);
+        jit_modrm_reg(c, 0, dst);
+        jit_byte(c, (uint8_t)imm);
+    } else {
+        jit_byte(c, 0x81);
+        jit_modrm_reg(c, 0, dst);
+        jit_u32(c, (uint32_t)imm);
+    }
+}
+
+// shr dst, imm
+static void jit_shr_imm(JitCompiler *c, uint8_t dst, uint8_t imm) {
+    jit_rex(c, 0, dst);
+    jit_byte(c, 0xc1);
+    jit_modrm_reg(c, 5, dst);
+    jit_byte(c, imm);
+}
+
+// cmp dst, imm
+static void jit_cmp_imm(JitCompiler *c, uint8_t dst, int32_t imm) {
+    jit_rex(c, 0, dst);
+    jit_byte(c, 0x81);
+    jit_modrm_reg(c, 7, dst);
+    jit_u32(c, (uint32_t)imm);
+}
+
+// movq xmm, src
+static void jit_movq_to_xmm(JitCompiler *c, uint8_t xmm, uint8_t src) {
+    jit_byte(c, 0x66);
+    jit_rex(c, xmm, src);
+    jit_byte(c, 0x0f);
+    jit_byte(c, 0x6e);
+    jit_modrm_reg(c, xmm, src);
+}
+
+// movq dst, xmm
+static void jit_movq_from_xmm(JitCompiler *c, uint8_t dst, uint8_t xmm) {
+    jit_byte(c, 0x66);
+    jit_rex(c, xmm, dst);
+    jit_byte(c, 0x0f);
+    jit_byte(c, 0x7e);
+    jit_modrm_reg(c, xmm, dst);
+}
+
+// <op> dst, src on xmm registers where the prefix and opcode select the
+// instruction
+static void jit_sse(JitCompiler *c, uint8_t prefix, uint8_t opcode, uint8_t dst,
+                    uint8_t src) {
+    jit_byte(c, prefix);
+
+    if (dst >= 8 || src >= 8) {
+        jit_byte(c, 0x40 | ((dst >> 3) << 2) | (src >> 3));
+    }
+
+    jit_byte(c, 0x0f);
+    jit_byte(c, opcode);
+    jit_modrm_reg(c, dst, src);
+}
+
+// <op> xmm, [base + disp] or the other way around depending on the opcode
+static void jit_sse_mem(JitCompiler *c, uint8_t prefix, uint8_t opcode,
+                        uint8_t xmm, uint8_t base, int32_t disp) {
+    jit_byte(c, prefix);
+
+    if (xmm >= 8 || base >= 8) {
+        jit_byte(c, 0x40 | ((xmm >> 3) << 2) | (base >> 3));
+    }
+
+    jit_byte(c, 0x0f);
+    jit_byte(c, opcode);
+    jit_modrm_mem(c, xmm, base, disp);
+}
+
+// Emits a conditional jump to a label that is bound later by jit_bind
+static size_t jit_jcc(JitCompiler *c, uint8_t cc) {
+    jit_byte(c, 0x0f);
+    jit_byte(c, 0x80 + cc);
+    jit_u32(c, 0);
+
+    return c->code.count - 4;
+}
+
+static size_t jit_jmp(JitCompiler *c) {
+    jit_byte(c, 0xe9);
+    jit_u32(c, 0);
+
+    return c->code.count - 4;
+}
+
+static void jit_bind(JitCompiler *c, size_t at) {
+    jit_patch(c, at, c->code.count);
+}
+
+static void jit_jcc_to(JitCompiler *c, uint8_t cc, size_t target) {
+    jit_patch(c, jit_jcc(c, cc), target);
+}
+
+static void jit_jmp_to(JitCompiler *c, size_t target) {
+    jit_patch(c, jit_jmp(c), target);
+}
+
+// Jumps to the code of another instruction, which is resolved once every
+// instruction was emitted
+static void jit_jcc_instruction(JitCompiler *c, uint8_t cc, size_t target) {
+    JitFixup fixup = {.at = jit_jcc(c, cc), .target = target};
+
+    ARRAY_PUSH(&c->fixups, fixup);
+}
+
+static void jit_jmp_instruction(JitCompiler *c, size_t target) {
+    JitFixup fixup = {.at = jit_jmp(c), .target = target};
+
+    ARRAY_PUSH(&c->fixups, fixup);
+}
+
+static void jit_call(JitCompiler *c, const void *fn) {
+    jit_mov_imm(c, RAX, (uint64_t)(uintptr_t)fn);
+
+    // call rax
+    jit_byte(c, 0xff);
+    jit_byte(c, 0xd0);
+}
+
+// test al, al
+static void jit_test_al(JitCompiler *c) {
+    jit_byte(c, 0x84);
+    jit_byte(c, 0xc0);
+}
+
+// movzx eax, al
+static void jit_movzx_al(JitCompiler *c) {
+    jit_byte(c, 0x0f);
+    jit_byte(c, 0xb6);
+    jit_byte(c, 0xc0);
+}
+
+// Turns the boolean in al into a Value in rax
+static void jit_box_al(JitCompiler *c) {
+    jit_movzx_al(c);
+
+    jit_mov_imm(c, RDX, BOOL_VAL(false));
+    jit_or(c, RAX, RDX);
+}
+
+static void jit_push(JitCompiler *c, uint8_t src) {
+    jit_store(c, R12, 0, src);
+    jit_add_imm(c, R12, sizeof(Value));
+}
+
+static void jit_pop(JitCompiler *c, uint8_t dst) {
+    jit_add_imm(c, R12, -(int32_t)sizeof(Value));
+    jit_load(c, dst, R12, 0);
+}
+
+static void jit_peek(JitCompiler *c, uint8_t dst, size_t distance) {
+    jit_load(c, dst, R12, -8 * (int32_t)(distance + 1));
+}
+
+static void jit_poke(JitCompiler *c, size_t distance, uint8_t src) {
+    jit_store(c, R12, -8 * (int32_t)(distance + 1), src);
+}
+
+static void jit_set_ip(JitCompiler *c, size_t offset) {
+    jit_mov_imm(c, RAX, (uint64_t)(uintptr_t)&c->fn->chunk.bytes[offset]);
+    jit_store(c, R14, offsetof(CallFrame, ip), RAX);
+}
+
+// Leaves to the interpreter so it executes the instruction at `offset`
+static void jit_exit_at(JitCompiler *c, size_t offset) {
+    jit_set_ip(c, offset);
+    jit_jmp_to(c, c->exit);
+}
+
+// Calls a helper that returns false on errors, the arguments should already be
+// in their registers and must not be in rax. The instruction pointer is set to
+// `next` so errors point at the current instruction and a call knows where to
+// return to
+static void jit_call_helper(JitCompiler *c, const void *fn, size_t next) {
+    jit_set_ip(c, next);
+    jit_store(c, RBX, offsetof(Vm, sp), R12);
+    jit_call(c, fn);
+    jit_load(c, R12, RBX, offsetof(Vm, sp));
+    jit_test_al(c);
+    jit_jcc_to(c, CC_E, c->exit_error);
+}
+
+// Jumps to `slow` unless the value in `reg` is a number, integers are
+// converted to doubles in place since the generated code only computes on
+// doubles. Clobbers rdx and xmm0
+static void jit_guard_num(JitCompiler *c, uint8_t reg, size_t *slow) {
+    jit_mov(c, RDX, reg);
+    jit_and(c, RDX, R15);
+    jit_cmp(c, RDX, R15);
+    size_t num = jit_jcc(c, CC_NE);
+
+    jit_mov(c, RDX, reg);
+    jit_shr_imm(c, RDX, 48);
+    jit_cmp_imm(c, RDX, INT_TAG >> 48);
+    *slow = jit_jcc(c, CC_NE);
+
+    // cvtsi2sd xmm0, reg32
+    jit_sse(c, 0xf2, 0x2a, 0, reg);
+    jit_movq_from_xmm(c, reg, 0);
+
+    jit_bind(c, num);
+}
+
+// The bits a number constant has as a double, other constants are unchanged
+static Value jit_double(Value constant) {
+    return IS_INT(constant) ? NUM_VAL(AS_INT(constant)) : constant;
+}
+
+// Computes `rax op rcx` into rax, numbers are handled inline and everything
+// else goes through vm_execute_math which writes the result to [rsp]
+static void jit_math(JitCompiler *c, OpCode op, size_t next) {
+    uint8_t sse = 0;
+    uint8_t cc = 0;
+    bool swap = false;
+
+    switch (op) {
+    case OP_ADD:
+        sse = 0x58;
+        break;
+
+    case OP_SUB:
+        sse = 0x5c;
+        break;
+
+    case OP_MUL:
+        sse = 0x59;
+        break;
+
+    case OP_DIV:
+        sse = 0x5e;
+        break;
+
+    // ucomisd sets the flags like an unsigned comparison and an unordered
+    // result sets CF, so only "above" conditions are false for NaN
+    case OP_LT:
+        cc = CC_A, swap = true;
+        break;
+
+    case OP_GT:
+        cc = CC_A;
+        break;
+
+    case OP_LTE:
+        cc = CC_AE, swap = true;
+        break;
+
+    case OP_GTE:
+        cc = CC_AE;
+        break;
+
+    default:
+        break;
+    }
+
+    size_t done = 0;
+    size_t slow_lhs = 0;
+    size_t slow_rhs = 0;
+
+    bool inline_num = sse != 0 || cc != 0;
+
+    if (inline_num) {
+        jit_guard_num(c, RAX, &slow_lhs);
+        jit_guard_num(c, RCX, &slow_rhs);
+
+        jit_movq_to_xmm(c, swap ? 1 : 0, RAX);
+        jit_movq_to_xmm(c, swap ? 0 : 1, RCX);
+
+        if (sse != 0) {
+            jit_sse(c, 0xf2, sse, 0, 1);
+            jit_movq_from_xmm(c, RAX, 0);
+        } else {
+            // ucomisd xmm0, xmm1
+            jit_sse(c, 0x66, 0x2e, 0, 1);
+
+            // setcc al
+            jit_byte(c, 0x0f);
+            jit_byte(c, 0x90 + cc);
+            jit_byte(c, 0xc0);
+
+            jit_box_al(c);
+        }
+
+        done = jit_jmp(c);
+
+        jit_bind(c, slow_lhs);
+        jit_bind(c, slow_rhs);
+    }
+
+    jit_mov(c, RDX, RAX);
+    jit_mov_imm(c, RSI, op);
+    jit_mov(c, RDI, RBX);
+    jit_mov(c, R8, RSP);
+    jit_call_helper(c, vm_execute_math, next);
+    jit_load(c, RAX, RSP, 0);
+
+    if (inline_num) {
+        jit_bind(c, done);
+    }
+}
+
+// Jumps to the instruction at `target` if the value in rax is falsey
+static void jit_jump_if_falsey(JitCompiler *c, size_t target) {
+    jit_mov_imm(c, RDX, BOOL_VAL(true));
+    jit_cmp(c, RAX, RDX);
+    size_t truthy = jit_jcc(c, CC_E);
+
+    jit_mov_imm(c, RDX, BOOL_VAL(false));
+    jit_cmp(c, RAX, RDX);
+    jit_jcc_instruction(c, CC_E, target);
+
+    jit_mov(c, RDI, RAX);
+    jit_call(c, value_is_falsey);
+    jit_test_al(c);
+    jit_jcc_instruction(c, CC_NE, target);
+
+    jit_bind(c, truthy);
+}
+
+// Loads the address of the value an upvalue points to into `dst`
+static void jit_upvalue_location(JitCompiler *c, uint8_t dst, uint8_t index) {
+    jit_load(c, dst, R14, offsetof(CallFrame, closure));
+    jit_load(c, dst, dst,
+             offsetof(ObjClosure, upvalues) + index * sizeof(ObjUpvalue *));
+    jit_load(c, dst, dst, offsetof(ObjUpvalue, location));
+}
+
+// Loads the address of a global slot into `dst`, global_values may grow when
+// other files get compiled so its items are always reloaded
+static void jit_global_location(JitCompiler *c, uint8_t dst, uint16_t slot) {
+    jit_mov_imm(c, dst, (uint64_t)(uintptr_t)c->fn->global_values);
+    jit_load(c, dst, dst, offsetof(ObjArray, items));
+    jit_add_imm(c, dst, slot * sizeof(Value));
+}
+
+// Leaves to the interpreter if the value in rax is an undefined global, it is
+// the one reporting the error
+static void jit_guard_defined(JitCompiler *c, size_t offset) {
+    jit_mov_imm(c, RDX, UNDEFINED_VAL);
+    jit_cmp(c, RAX, RDX);
+    size_t defined = jit_jcc(c, CC_NE);
+    jit_exit_at(c, offset);
+    jit_bind(c, defined);
+}
+
+// Calls the value in rsi with `argc` arguments, leaves when it was a closure
+// since its frame has to be entered
+static void jit_call_value(JitCompiler *c, uint8_t argc, size_t next) {
+    size_t frame_count = offsetof(Vm, frame_count);
+
+    jit_load(c, RBP, RBX, frame_count);
+    jit_mov_imm(c, RDX, argc);
+    jit_mov(c, RDI, RBX);
+    jit_call_helper(c, vm_call_value, next);
+    jit_load(c, RAX, RBX, frame_count);
+    jit_cmp(c, RAX, RBP);
+    jit_jcc_to(c, CC_NE, c->exit_enter);
+}
+
+static bool jit_set_subscript_with_math(Vm *vm, OpCode op) {
+    Value target = vm_pop(vm);
+    Value index = vm_pop(vm);
+    Value rhs = vm_pop(vm);
+
+    if (!vm_get_subscript(vm, target, index)) {
+        return false;
+    }
+
+    Value result;
+
+    if (!vm_execute_math(vm, op, vm_peek(vm, 0), rhs, &result)) {
+        return false;
+    }
+
+    vm_poke(vm, 0, result);
+
+    return vm_set_subscript(vm, target, index);
+}
+
+static OpCode jit_generic_opcode(OpCode op) {
+    switch (op) {
+    case OP_ADD_NUM:
+        return OP_ADD;
+    case OP_SUB_NUM:
+        return OP_SUB;
+    case OP_MUL_NUM:
+        return OP_MUL;
+    case OP_LT_NUM:
+        return OP_LT;
+    case OP_GT_NUM:
+        return OP_GT;
+    case OP_LTE_NUM:
+        return OP_LTE;
+    case OP_GTE_NUM:
+        return OP_GTE;
+    case OP_SET_LOCAL_WITH_MATH_NUM:
+        return OP_SET_LOCAL_WITH_MATH;
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_NUM:
+        return OP_SET_LOCAL_WITH_MATH_LOCAL;
+    case OP_SET_LOCAL_WITH_MATH_CONST_NUM:
+        return OP_SET_LOCAL_WITH_MATH_CONST;
+    case OP_SET_UPVALUE_WITH_MATH_NUM:
+        return OP_SET_UPVALUE_WITH_MATH;
+    case OP_SET_GLOBAL_WITH_MATH_NUM:
+        return OP_SET_GLOBAL_WITH_MATH;
+    case OP_SET_SUBSCRIPT_WITH_MATH_NUM:
+        return OP_SET_SUBSCRIPT_WITH_MATH;
+    case OP_MATH_LOCAL_LOCAL_NUM:
+        return OP_MATH_LOCAL_LOCAL;
+    case OP_MATH_LOCAL_CONST_NUM:
+        return OP_MATH_LOCAL_CONST;
+    case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM:
+        return OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE;
+    case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM:
+        return OP_MATH_LOCAL_CONST_JUMP_IF_FALSE;
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM:
+        return OP_SET_LOCAL_WITH_MATH_LOCAL_POP;
+    case OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM:
+        return OP_SET_LOCAL_WITH_MATH_CONST_POP;
+    default:
+        return op;
+    }
+}
+
+static JitLoop *jit_loop(ObjFunction *fn, uint32_t header) {
+    for (JitLoop *loop = fn->loops; loop != NULL; loop = loop->next) {
+        if (loop->header == header) {
+            return loop;
+        }
+    }
+
+    JitLoop *loop = malloc(sizeof(JitLoop));
+
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    *loop = (JitLoop){
+        .next = fn->loops,
+        .header = header,
+        .countdown = VM_JIT_TRACE_THRESHOLD,
+    };
+
+    fn->loops = loop;
+
+    return loop;
+}
+
+static const uint8_t jit_saved_registers[] = {RBP, RBX, R12, R13, R14, R15};
+
+// Saves the registers the generated code lives in and reserves `locals` bytes
+// on the native stack, which should be 8 modulo 16 to keep calls aligned
+static void jit_enter(JitCompiler *c, int32_t locals) {
+    for (size_t i = 0; i < sizeof(jit_saved_registers); i++) {
+        if (jit_saved_registers[i] >= 8) {
+            jit_byte(c, 0x41);
+        }
+
+        jit_byte(c, 0x50 + (jit_saved_registers[i] & 7));
+    }
+
+    jit_add_imm(c, RSP, -locals);
+
+    jit_mov(c, RBX, RDI);
+    jit_mov(c, R14, RSI);
+    jit_load(c, R12, RBX, offsetof(Vm, sp));
+    jit_load(c, R13, R14, offsetof(CallFrame, slots));
+    jit_mov_imm(c, R15, QNAN);
+}
+
+static void jit_leave(JitCompiler *c, int32_t locals) {
+    jit_add_imm(c, RSP, locals);
+
+    for (size_t i = sizeof(jit_saved_registers); i > 0; i--) {
+        if (jit_saved_registers[i - 1] >= 8) {
+            jit_byte(c, 0x41);
+        }
+
+        jit_byte(c, 0x58 + (jit_saved_registers[i - 1] & 7));
+    }
+
+    // ret
+    jit_byte(c, 0xc3);
+}
+
+static void jit_prologue(JitCompiler *c) {
+    // The only local is where vm_execute_math writes its result
+    jit_enter(c, 8);
+
+    // jmp rdx
+    jit_byte(c, 0xff);
+    jit_byte(c, 0xe2);
+
+    c->exit_error = c->code.count;
+    jit_mov_imm(c, RAX, JIT_ERROR);
+    size_t error = jit_jmp(c);
+
+    c->exit_enter = c->code.count;
+    jit_mov_imm(c, RAX, JIT_ENTER);
+    size_t call = jit_jmp(c);
+
+    c->exit_trace = c->code.count;
+    jit_mov_imm(c, RAX, JIT_TRACE);
+    size_t trace = jit_jmp(c);
+
+    c->exit = c->code.count;
+    jit_mov_imm(c, RAX, JIT_EXIT);
+
+    jit_bind(c, error);
+    jit_bind(c, call);
+    jit_bind(c, trace);
+
+    jit_store(c, RBX, offsetof(Vm, sp), R12);
+    jit_leave(c, 8);
+}
+
+// Emits the template of the instruction at `offset`, returns false if it is
+// not supported and the interpreter should always execute it
+static bool jit_instruction(JitCompiler *c, size_t offset) {
+    const Chunk *chunk = &c->fn->chunk;
+    const uint8_t *bytes = &chunk->bytes[offset];
+
+    size_t next = offset + chunk_instruction_size(chunk, offset);
+
+#define JIT_SHORT(i) (((uint16_t)bytes[i] << 8) | bytes[(i) + 1])
+#define JIT_CONSTANT(i) (chunk->constants.items[JIT_SHORT(i)])
+#define JIT_CACHE(i) (&chunk->caches.items[JIT_SHORT(i)])
+#define JIT_SLOT(i) ((int32_t)(bytes[i] * sizeof(Value)))
+
+    switch (jit_generic_opcode(bytes[0])) {
+    case OP_POP:
+        jit_add_imm(c, R12, -(int32_t)sizeof(Value));
+        break;
+
+    case OP_DUP:
+        jit_peek(c, RAX, 0);
+        jit_push(c, RAX);
+        break;
+
+    case OP_SWP:
+        jit_peek(c, RAX, 0);
+        jit_peek(c, RCX, 1);
+        jit_poke(c, 0, RCX);
+        jit_poke(c, 1, RAX);
+        break;
+
+    case OP_PUSH_NULL:
+        jit_mov_imm(c, RAX, NULL_VAL);
+        jit_push(c, RAX);
+        break;
+
+    case OP_PUSH_TRUE:
+        jit_mov_imm(c, RAX, BOOL_VAL(true));
+        jit_push(c, RAX);
+        break;
+
+    case OP_PUSH_FALSE:
+        jit_mov_imm(c, RAX, BOOL_VAL(false));
+        jit_push(c, RAX);
+        break;
+
+    case OP_PUSH_CONST:
+        jit_mov_imm(c, RAX, JIT_CONSTANT(1));
+        jit_push(c, RAX);
+        break;
+
+    case OP_GET_LOCAL:
+        jit_load(c, RAX, R13, JIT_SLOT(1));
+        jit_push(c, RAX);
+        break;
+
+    case OP_SET_LOCAL:
+        jit_peek(c, RAX, 0);
+        jit_store(c, R13, JIT_SLOT(1), RAX);
+        break;
+
+    case OP_SET_LOCAL_POP:
+        jit_pop(c, RAX);
+        jit_store(c, R13, JIT_SLOT(1), RAX);
+        break;
+
+    case OP_SET_LOCAL_WITH_MATH:
+        jit_load(c, RAX, R13, JIT_SLOT(2));
+        jit_peek(c, RCX, 0);
+        jit_math(c, bytes[1], next);
+        jit_store(c, R13, JIT_SLOT(2), RAX);
+        jit_poke(c, 0, RAX);
+        break;
+
+    case OP_SET_LOCAL_WITH_MATH_LOCAL:
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_POP:
+        jit_load(c, RAX, R13, JIT_SLOT(2));
+        jit_load(c, RCX, R13, JIT_SLOT(3));
+        jit_math(c, bytes[1], next);
+        jit_store(c, R13, JIT_SLOT(2), RAX);
+
+        if (bytes[0] != OP_SET_LOCAL_WITH_MATH_LOCAL_POP &&
+            bytes[0] != OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM) {
+            jit_push(c, RAX);
+        }
+
+        break;
+
+    case OP_SET_LOCAL_WITH_MATH_CONST:
+    case OP_SET_LOCAL_WITH_MATH_CONST_POP:
+        jit_load(c, RAX, R13, JIT_SLOT(2));
+        jit_mov_imm(c, RCX, jit_double(JIT_CONSTANT(3)));
+        jit_math(c, bytes[1], next);
+        jit_store(c, R13, JIT_SLOT(2), RAX);
+
+        if (bytes[0] != OP_SET_LOCAL_WITH_MATH_CONST_POP &&
+            bytes[0] != OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM) {
+            jit_push(c, RAX);
+        }
+
+        break;
+
+    case OP_MATH_LOCAL_LOCAL:
+        jit_load(c, RAX, R13, JIT_SLOT(2));
+        jit_load(c, RCX, R13, JIT_SLOT(3));
+        jit_math(c, bytes[1], next);
+        jit_push(c, RAX);
+        break;
+
+    case OP_MATH_LOCAL_CONST:
+        jit_load(c, RAX, R13, JIT_SLOT(2));
+        jit_mov_imm(c, RCX, jit_double(JIT_CONSTANT(3)));
+        jit_math(c, bytes[1], next);
+        jit_push(c, RAX);
+        break;
+
+    case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE:
+        jit_load(c, RAX, R13, JIT_SLOT(2));
+        jit_load(c, RCX, R13, JIT_SLOT(3));
+        jit_math(c, bytes[1], next);
+        jit_jump_if_falsey(c, next + JIT_SHORT(4));
+        break;
+
+    case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE:
+        jit_load(c, RAX, R13, JIT_SLOT(2));
+        jit_mov_imm(c, RCX, jit_double(JIT_CONSTANT(3)));
+        jit_math(c, bytes[1], next);
+        jit_jump_if_falsey(c, next + JIT_SHORT(5));
+        break;
+
+    case OP_GET_UPVALUE:
+        jit_upvalue_location(c, RAX, bytes[1]);
+        jit_load(c, RAX, RAX, 0);
+        jit_push(c, RAX);
+        break;
+
+    case OP_SET_UPVALUE:
+        jit_upvalue_location(c, RCX, bytes[1]);
+        jit_peek(c, RAX, 0);
+        jit_store(c, RCX, 0, RAX);
+        break;
+
+    case OP_SET_UPVALUE_WITH_MATH:
+        jit_upvalue_location(c, RBP, bytes[2]);
+        jit_load(c, RAX, RBP, 0);
+        jit_peek(c, RCX, 0);
+        jit_math(c, bytes[1], next);
+        jit_store(c, RBP, 0, RAX);
+        jit_poke(c, 0, RAX);
+        break;
+
+    case OP_GET_GLOBAL:
+        jit_global_location(c, RAX, JIT_SHORT(1));
+        jit_load(c, RAX, RAX, 0);
+        jit_guard_defined(c, offset);
+        jit_push(c, RAX);
+        break;
+
+    case OP_SET_GLOBAL:
+        jit_global_location(c, RCX, JIT_SHORT(1));
+        jit_peek(c, RAX, 0);
+        jit_store(c, RCX, 0, RAX);
+        break;
+
+    case OP_SET_GLOBAL_WITH_MATH:
+        jit_global_location(c, RBP, JIT_SHORT(2));
+        jit_load(c, RAX, RBP, 0);
+        jit_guard_defined(c, offset);
+        jit_peek(c, RCX, 0);
+        jit_math(c, bytes[1], next);
+        jit_store(c, RBP, 0, RAX);
+        jit_poke(c, 0, RAX);
+        break;
+
+    case OP_GET_SUBSCRIPT:
+        jit_peek(c, RSI, 0);
+        jit_peek(c, RDX, 1);
+        jit_add_imm(c, R12, -2 * (int32_t)sizeof(Value));
+        jit_mov(c, RDI, RBX);
+        jit_call_helper(c, vm_get_subscript, next);
+        break;
+
+    case OP_SET_SUBSCRIPT:
+        jit_peek(c, RSI, 0);
+        jit_peek(c, RDX, 1);
+        jit_add_imm(c, R12, -2 * (int32_t)sizeof(Value));
+        jit_mov(c, RDI, RBX);
+        jit_call_helper(c, vm_set_subscript, next);
+        break;
+
+    case OP_SET_SUBSCRIPT_WITH_MATH:
+        jit_mov_imm(c, RSI, bytes[1]);
+        jit_mov(c, RDI, RBX);
+        jit_call_helper(c, jit_set_subscript_with_math, next);
+        break;
+
+    case OP_GET_SUBSCRIPT_LOCAL_CONST:
+        jit_load(c, RSI, R13, JIT_SLOT(1));
+        jit_mov_imm(c, RDX, JIT_CONSTANT(2));
+        jit_mov(c, RDI, RBX);
+        jit_call_helper(c, vm_get_subscript, next);
+        break;
+
+    case OP_GET_MEMBER:
+        jit_mov_imm(c, RSI, (uint64_t)(uintptr_t)AS_STRING(JIT_CONSTANT(1)));
+        jit_mov_imm(c, RDX, (uint64_t)(uintptr_t)JIT_CACHE(3));
+        jit_mov(c, RDI, RBX);
+        jit_call_helper(c, vm_get_member, next);
+        break;
+
+    case OP_SET_MEMBER:
+        jit_mov_imm(c, RSI, (uint64_t)(uintptr_t)AS_STRING(JIT_CONSTANT(1)));
+        jit_mov_imm(c, RDX, (uint64_t)(uintptr_t)JIT_CACHE(3));
+        jit_mov(c, RDI, RBX);
+        jit_call_helper(c, vm_set_member, next);
+        break;
+
+    case OP_SET_MEMBER_WITH_MATH:
+        jit_mov_imm(c, RSI, bytes[1]);
+        jit_mov_imm(c, RDX, (uint64_t)(uintptr_t)AS_STRING(JIT_CONSTANT(2)));
+        jit_mov_imm(c, RCX, (uint64_t)(uintptr_t)JIT_CACHE(4));
+        jit_mov(c, RDI, RBX);
+        jit_call_helper(c, vm_set_member_with_math, next);
+        break;
+
+    case OP_NEG: {
+        jit_peek(c, RAX, 0);
+
+        size_t slow;
+        jit_guard_num(c, RAX, &slow);
+
+        jit_mov_imm(c, RDX, SIGN_BIT);
+        jit_xor(c, RAX, RDX);
+        jit_poke(c, 0, RAX);
+        size_t done = jit_jmp(c);
+
+        jit_bind(c, slow);
+        jit_exit_at(c, offset);
+
+        jit_bind(c, done);
+        break;
+    }
+
+    case OP_NOT:
+        jit_peek(c, RDI, 0);
+        jit_call(c, value_is_falsey);
+        jit_box_al(c);
+        jit_poke(c, 0, RAX);
+        break;
+
+    case OP_EQL:
+    case OP_NEQ:
+        jit_pop(c, RSI);
+        jit_peek(c, RDI, 0);
+        jit_call(c, values_equal);
+
+        if (bytes[0] == OP_NEQ) {
+            // xor al, 1
+            jit_byte(c, 0x34);
+            jit_byte(c, 0x01);
+        }
+
+        jit_box_al(c);
+        jit_poke(c, 0, RAX);
+        break;
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_POW:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTE:
+    case OP_GTE:
+        jit_peek(c, RAX, 1);
+        jit_peek(c, RCX, 0);
+        jit_math(c, jit_generic_opcode(bytes[0]), next);
+        jit_add_imm(c, R12, -(int32_t)sizeof(Value));
+        jit_poke(c, 0, RAX);
+        break;
+
+    case OP_CALL:
+        jit_pop(c, RSI);
+        jit_call_value(c, bytes[1], next);
+        break;
+
+    case OP_TAIL_CALL:
+        jit_pop(c, RSI);
+        jit_mov_imm(c, RDX, bytes[1]);
+        jit_mov(c, RDI, RBX);
+        jit_call_helper(c, vm_tail_call_value, next);
+
+        // Recursing goes straight back to the start, otherwise frame->ip is
+        // either the start of another function or the return after a native
+        // call. The stack may have moved when it had to grow
+        jit_load(c, R13, R14, offsetof(CallFrame, slots));
+        jit_load(c, RAX, R14, offsetof(CallFrame, ip));
+        jit_mov_imm(c, RDX, (uint64_t)(uintptr_t)chunk->bytes);
+        jit_cmp(c, RAX, RDX);
+        jit_jcc_instruction(c, CC_E, 0);
+        jit_jmp_to(c, c->exit_enter);
+        break;
+
+    case OP_CALL_UPVALUE:
+        jit_upvalue_location(c, RSI, bytes[1]);
+        jit_load(c, RSI, RSI, 0);
+        jit_call_value(c, bytes[2], next);
+        break;
+
+    case OP_CALL_GLOBAL:
+        jit_global_location(c, RAX, JIT_SHORT(1));
+        jit_load(c, RAX, RAX, 0);
+        jit_guard_defined(c, offset);
+        jit_mov(c, RSI, RAX);
+        jit_call_value(c, bytes[3], next);
+        break;
+
+    case OP_RETURN: {
+        // The interpreter takes care of closing upvalues and of returning from
+        // the last frame
+        jit_load(c, RAX, RBX, offsetof(Vm, open_upvalues));
+        jit_test(c, RAX, RAX);
+        size_t no_upvalues = jit_jcc(c, CC_E);
+        jit_load(c, RAX, RAX, offsetof(ObjUpvalue, location));
+        jit_cmp(c, RAX, R13);
+        size_t below = jit_jcc(c, CC_B);
+        jit_exit_at(c, offset);
+        jit_bind(c, no_upvalues);
+        jit_bind(c, below);
+
+        jit_load(c, RAX, RBX, offsetof(Vm, frame_count));
+        jit_add_imm(c, RAX, -1);
+        size_t not_last = jit_jcc(c, CC_NE);
+        jit_exit_at(c, offset);
+        jit_bind(c, not_last);
+
+        jit_store(c, RBX, offsetof(Vm, frame_count), RAX);
+        jit_peek(c, RAX, 0);
+        jit_mov(c, R12, R13);
+        jit_push(c, RAX);
+        jit_jmp_to(c, c->exit_enter);
+        break;
+    }
+
+    case OP_POP_JUMP_IF_FALSE:
+        jit_pop(c, RAX);
+        jit_jump_if_falsey(c, next + JIT_SHORT(1));
+        break;
+
+    case OP_JUMP_IF_FALSE:
+        jit_peek(c, RAX, 0);
+        jit_jump_if_falsey(c, next + JIT_SHORT(1));
+        break;
+
+    case OP_JUMP:
+        jit_jmp_instruction(c, next + JIT_SHORT(1));
+        break;
+
+    case OP_LOOP: {
+        size_t header = next - JIT_SHORT(1);
+
+        JitLoop *loop = jit_loop(c->fn, header);
+
+        if (loop != NULL) {
+            // sub dword [rax], 1
+            jit_mov_imm(c, RAX, (uint64_t)(uintptr_t)&loop->countdown);
+            jit_byte(c, 0x83);
+            jit_byte(c, 0x28);
+            jit_byte(c, 0x01);
+
+            size_t hot = jit_jcc(c, CC_E);
+            jit_jmp_instruction(c, header);
+
+            jit_bind(c, hot);
+            jit_set_ip(c, header);
+            jit_jmp_to(c, c->exit_trace);
+        } else {
+            jit_jmp_instruction(c, header);
+        }
+
+        break;
+    }
+
+    default:
+        jit_exit_at(c, offset);
+        return false;
+    }
+
+#undef JIT_SHORT
+#undef JIT_CONSTANT
+#undef JIT_CACHE
+#undef JIT_SLOT
+
+    return true;
+}
+
+// Copies the generated code into executable memory and frees the buffer
+static uint8_t *jit_install(JitCompiler *c) {
+    uint8_t *code = mmap(NULL, c->code.count, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (code == MAP_FAILED) {
+        free(c->code.items);
+
+        return NULL;
+    }
+
+    memcpy(code, c->code.items, c->code.count);
+
+    free(c->code.items);
+
+    if (mprotect(code, c->code.count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, c->code.count);
+
+        return NULL;
+    }
+
+    return code;
+}
+
+static JitCode *jit_compile(ObjFunction *fn) {
+    const Chunk *chunk = &fn->chunk;
+
+    JitCompiler c = {
+        .fn = fn,
+        .labels = malloc(chunk->count * sizeof(uint32_t)),
+    };
+
+    uint32_t *entries = malloc(chunk->count * sizeof(uint32_t));
+
+    if (c.labels == NULL || entries == NULL) {
+        free(c.labels);
+        free(entries);
+
+        return NULL;
+    }
+
+    for (size_t i = 0; i < chunk->count; i++) {
+        entries[i] = JIT_NO_ENTRY;
+    }
+
+    jit_prologue(&c);
+
+    for (size_t offset = 0; offset < chunk->count;
+         offset += chunk_instruction_size(chunk, offset)) {
+        c.labels[offset] = c.code.count;
+
+        if (jit_instruction(&c, offset)) {
+            entries[offset] = c.labels[offset];
+        }
+    }
+
+    for (size_t i = 0; i < c.fixups.count; i++) {
+        jit_patch(&c, c.fixups.items[i].at,
+                  c.labels[c.fixups.items[i].target]);
+    }
+
+    free(c.labels);
+    free(c.fixups.items);
+
+    uint8_t *code = jit_install(&c);
+
+    if (code == NULL) {
+        free(entries);
+
+        return NULL;
+    }
+
+    JitCode *jit = malloc(sizeof(JitCode));
+
+    if (jit == NULL) {
+        munmap(code, c.code.count);
+        free(entries);
+
+        return NULL;
+    }
+
+    jit->code = code;
+    jit->size = c.code.count;
+    jit->entries = entries;
+
+    return jit;
+}
+
+// Traces of loops, the registers are the same as in the baseline code and
+// besides them:
+//
+//  xmm15 down to xmm8: the variables of the loop, unboxed
+//  xmm2 up to xmm7: the values on the stack, numbers are unboxed and booleans
+//                   are 0 or 1
+//  xmm0, xmm1: scratch
+//  rbp: the items of global_values
+
+#define JIT_TRACE_STEPS 256
+#define JIT_TRACE_VARS 8
+#define JIT_TRACE_STACK 6
+#define JIT_TRACE_ATTEMPTS 4
+
+// Every xmm register has a slot where it is spilled around calls
+#define JIT_TRACE_LOCALS 136
+
+#define JIT_VAR_XMM(i) ((uint8_t)(15 - (i)))
+#define JIT_STACK_XMM(k) ((uint8_t)(2 + (k)))
+
+typedef struct {
+    bool global;
+    uint16_t slot;
+    Value value;
+    bool read;    // read before being written, so it is guarded on entry
+    bool written; // stored back on every exit
+} JitVar;
+
+typedef struct {
+    size_t at;       // jump to patch
+    uint32_t target; // instruction the interpreter continues with
+    uint8_t depth;
+    uint8_t bools; // bit k is set when the value k on the stack is a boolean
+} JitExit;
+
+typedef struct {
+    JitCompiler c;
+    const CallFrame *frame;
+
+    JitVar vars[JIT_TRACE_VARS];
+    size_t vars_count;
+
+    // The values of the iteration being recorded that are on the stack above
+    // the locals that were live at the header
+    Value stack[JIT_TRACE_STACK];
+    size_t depth;
+    size_t base;
+
+    struct {
+        JitExit *items;
+        size_t count;
+        size_t capacity;
+    } exits;
+
+    bool closed; // the loop jumped back to the header
+} JitTracer;
+
+// Called by traces for the operators that have no instruction, vm_execute_math
+// never touches the vm when both operands are numbers
+static double jit_num(OpCode op, double lhs, double rhs) {
+    Value result;
+    vm_execute_math(NULL, op, NUM_VAL(lhs), NUM_VAL(rhs), &result);
+
+    return AS_NUM(result);
+}
+
+// movapd dst, src
+static void jit_movapd(JitCompiler *c, uint8_t dst, uint8_t src) {
+    if (dst != src) {
+        jit_sse(c, 0x66, 0x28, dst, src);
+    }
+}
+
+// Loads the bits of a value into an xmm register
+static void jit_movq_imm(JitCompiler *c, uint8_t xmm, uint64_t imm) {
+    jit_mov_imm(c, RAX, imm);
+    jit_movq_to_xmm(c, xmm, RAX);
+}
+
+// setcc reg where reg is al or cl
+static void jit_setcc(JitCompiler *c, uint8_t cc, uint8_t reg) {
+    jit_byte(c, 0x0f);
+    jit_byte(c, 0x90 + cc);
+    jit_byte(c, 0xc0 | reg);
+}
+
+// Finds the variable of a local or a global slot, adding it the first time
+static JitVar *jit_trace_var(JitTracer *t, bool global, uint16_t slot) {
+    for (size_t i = 0; i < t->vars_count; i++) {
+        if (t->vars[i].global == global && t->vars[i].slot == slot) {
+            return &t->vars[i];
+        }
+    }
+
+    if (t->vars_count == JIT_TRACE_VARS) {
+        return NULL;
+    }
+
+    ObjArray *globals = t->c.fn->global_values;
+
+    JitVar *var = &t->vars[t->vars_count++];
+
+    // Globals are always guarded since they may still be undefined
+    *var = (JitVar){
+        .global = global,
+        .slot = slot,
+        .value = global ? globals->items[slot] : t->frame->slots[slot],
+        .read = global,
+    };
+
+    return var;
+}
+
+// Returns the register that holds a local or a global, locals declared inside
+// of the loop are on the stack. Returns -1 if it can not be traced
+static int jit_trace_get(JitTracer *t, bool global, uint16_t slot,
+                         Value *value) {
+    if (!global && slot >= t->base) {
+        size_t k = slot - t->base;
+
+        if (k >= t->depth) {
+            return -1;
+        }
+
+        *value = t->stack[k];
+
+        return JIT_STACK_XMM(k);
+    }
+
+    JitVar *var = jit_trace_var(t, global, slot);
+
+    if (var == NULL || !IS_NUM(var->value)) {
+        return -1;
+    }
+
+    if (!var->written) {
+        var->read = true;
+    }
+
+    *value = var->value;
+
+    return JIT_VAR_XMM(var - t->vars);
+}
+
+static bool jit_trace_set(JitTracer *t, bool global, uint16_t slot,
+                          uint8_t xmm, Value value) {
+    if (!global && slot >= t->base) {
+        size_t k = slot - t->base;
+
+        if (k >= t->depth) {
+            return false;
+        }
+
+        t->stack[k] = value;
+        jit_movapd(&t->c, JIT_STACK_XMM(k), xmm);
+
+        return true;
+    }
+
+    JitVar *var = jit_trace_var(t, global, slot);
+
+    if (var == NULL || !IS_NUM(value)) {
+        return false;
+    }
+
+    var->value = value;
+    var->written = true;
+    jit_movapd(&t->c, JIT_VAR_XMM(var - t->vars), xmm);
+
+    return true;
+}
+
+static bool jit_trace_push(JitTracer *t, uint8_t xmm, Value value) {
+    if (t->depth == JIT_TRACE_STACK) {
+        return false;
+    }
+
+    jit_movapd(&t->c, JIT_STACK_XMM(t->depth), xmm);
+    t->stack[t->depth++] = value;
+
+    return true;
+}
+
+// Loads a constant number into `xmm`, returns -1 for any other constant
+static int jit_trace_constant(JitTracer *t, Value constant, uint8_t xmm,
+                              Value *value) {
+    if (!IS_NUM(constant)) {
+        return -1;
+    }
+
+    jit_movq_imm(&t->c, xmm, jit_double(constant));
+    *value = constant;
+
+    return xmm;
+}
+
+// Computes `a op b` into xmm0, where `a` is never in xmm1 and `b` is never in
+// xmm0
+static bool jit_trace_math(JitTracer *t, OpCode op, int a, int b, Value lhs,
+                           Value rhs, Value *result) {
+    JitCompiler *c = &t->c;
+
+    if (a < 0 || b < 0 || !IS_NUM(lhs) || !IS_NUM(rhs)) {
+        return false;
+    }
+
+    op = jit_generic_opcode(op);
+
+    uint8_t sse = 0;
+    uint8_t cc = 0;
+
+    switch (op) {
+    case OP_ADD:
+        sse = 0x58;
+        break;
+
+    case OP_SUB:
+        sse = 0x5c;
+        break;
+
+    case OP_MUL:
+        sse = 0x59;
+        break;
+
+    case OP_DIV:
+        sse = 0x5e;
+        break;
+
+    case OP_LT:
+        cc = CC_A;
+        jit_sse(c, 0x66, 0x2e, b, a);
+        break;
+
+    case OP_GT:
+        cc = CC_A;
+        jit_sse(c, 0x66, 0x2e, a, b);
+        break;
+
+    case OP_LTE:
+        cc = CC_AE;
+        jit_sse(c, 0x66, 0x2e, b, a);
+        break;
+
+    case OP_GTE:
+        cc = CC_AE;
+        jit_sse(c, 0x66, 0x2e, a, b);
+        break;
+
+    case OP_EQL:
+    case OP_NEQ:
+        // Unordered comparisons set ZF and PF
+        jit_sse(c, 0x66, 0x2e, a, b);
+        jit_setcc(c, op == OP_EQL ? CC_E : CC_NE, RAX);
+        jit_setcc(c, op == OP_EQL ? CC_NP : CC_P, RCX);
+
+        // and al, cl or or al, cl
+        jit_byte(c, op == OP_EQL ? 0x20 : 0x08);
+        jit_byte(c, 0xc8);
+        break;
+
+    case OP_MOD:
+    case OP_POW: {
+        // Every xmm register is clobbered by calls
+        for (uint8_t xmm = 2; xmm < 16; xmm++) {
+            jit_sse_mem(c, 0xf2, 0x11, xmm, RSP, xmm * 8);
+        }
+
+        jit_movapd(c, 0, a);
+        jit_movapd(c, 1, b);
+        jit_mov_imm(c, RDI, op);
+        jit_call(c, jit_num);
+
+        for (uint8_t xmm = 2; xmm < 16; xmm++) {
+            jit_sse_mem(c, 0xf2, 0x10, xmm, RSP, xmm * 8);
+        }
+
+        break;
+    }
+
+    default:
+        return false;
+    }
+
+    if (sse != 0) {
+        jit_movapd(c, 0, a);
+        jit_sse(c, 0xf2, sse, 0, b);
+    } else if (op != OP_MOD && op != OP_POW) {
+        if (cc != 0) {
+            jit_setcc(c, cc, RAX);
+        }
+
+        jit_movzx_al(c);
+
+        jit_movq_to_xmm(c, 0, RAX);
+    }
+
+    return vm_execute_math(NULL, op, lhs, rhs, result);
+}
+
+// Continues with the direction the jump took while recording and guards that
+// the value in `xmm` keeps the same truthiness, otherwise the trace exits to
+// where the interpreter would have continued
+static void jit_trace_branch(JitTracer *t, uint8_t xmm, Value value,
+                             size_t next, size_t target, size_t *ip) {
+    JitCompiler *c = &t->c;
+
+    bool falsey = value_is_falsey(value);
+
+    jit_movq_from_xmm(c, RAX, xmm);
+
+    if (IS_NUM(value)) {
+        // Shifting out the sign leaves zero only for 0 and -0
+        jit_add(c, RAX, RAX);
+    } else {
+        jit_test(c, RAX, RAX);
+    }
+
+    JitExit side = {
+        .at = jit_jcc(c, falsey ? CC_NE : CC_E),
+        .target = falsey ? next : target,
+        .depth = t->depth,
+    };
+
+    for (size_t k = 0; k < t->depth; k++) {
+        if (IS_BOOL(t->stack[k])) {
+            side.bools |= 1 << k;
+        }
+    }
+
+    ARRAY_PUSH(&t->exits, side);
+
+    *ip = falsey ? target : next;
+}
+
+// Records the instruction at `offset` and emits its code, `ip` is set to the
+// instruction executed after it. Returns false if it can not be traced
+static bool jit_trace_instruction(JitTracer *t, uint32_t header, size_t offset,
+                                  size_t *ip) {
+    JitCompiler *c = &t->c;
+    const Chunk *chunk = &c->fn->chunk;
+    const uint8_t *bytes = &chunk->bytes[offset];
+
+    size_t next = offset + chunk_instruction_size(chunk, offset);
+    *ip = next;
+
+#define JIT_SHORT(i) (((uint16_t)bytes[i] << 8) | bytes[(i) + 1])
+#define JIT_CONSTANT(i) (chunk->constants.items[JIT_SHORT(i)])
+
+    Value lhs = NULL_VAL;
+    Value rhs = NULL_VAL;
+    Value result;
+
+    OpCode op = jit_generic_opcode(bytes[0]);
+
+    switch (op) {
+    case OP_POP:
+        if (t->depth == 0) {
+            return false;
+        }
+
+        t->depth--;
+        return true;
+
+    case OP_PUSH_CONST: {
+        int xmm = jit_trace_constant(t, JIT_CONSTANT(1), 0, &result);
+
+        return xmm >= 0 && jit_trace_push(t, xmm, result);
+    }
+
+    case OP_PUSH_TRUE:
+    case OP_PUSH_FALSE:
+        jit_movq_imm(c, 0, op == OP_PUSH_TRUE);
+
+        return jit_trace_push(t, 0, BOOL_VAL(op == OP_PUSH_TRUE));
+
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL: {
+        bool global = op == OP_GET_GLOBAL;
+        int xmm = jit_trace_get(t, global, global ? JIT_SHORT(1) : bytes[1],
+                                &result);
+
+        return xmm >= 0 && jit_trace_push(t, xmm, result);
+    }
+
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL: {
+        bool global = op == OP_SET_GLOBAL;
+
+        return t->depth > 0 &&
+               jit_trace_set(t, global, global ? JIT_SHORT(1) : bytes[1],
+                             JIT_STACK_XMM(t->depth - 1),
+                             t->stack[t->depth - 1]);
+    }
+
+    case OP_SET_LOCAL_POP:
+        if (t->depth == 0) {
+            return false;
+        }
+
+        t->depth--;
+
+        return jit_trace_set(t, false, bytes[1], JIT_STACK_XMM(t->depth),
+                             t->stack[t->depth]);
+
+    case OP_NEG:
+        if (t->depth == 0 || !IS_NUM(t->stack[t->depth - 1])) {
+            return false;
+        }
+
+        jit_movq_imm(c, 0, SIGN_BIT);
+
+        // xorpd
+        jit_sse(c, 0x66, 0x57, JIT_STACK_XMM(t->depth - 1), 0);
+
+        t->stack[t->depth - 1] = NUM_VAL(-AS_NUM(t->stack[t->depth - 1]));
+        return true;
+
+    case OP_NOT: {
+        if (t->depth == 0) {
+            return false;
+        }
+
+        uint8_t top = JIT_STACK_XMM(t->depth - 1);
+        Value value = t->stack[t->depth - 1];
+
+        jit_movq_from_xmm(c, RAX, top);
+
+        if (IS_NUM(value)) {
+            // Shifting out the sign leaves zero only for 0 and -0
+            jit_add(c, RAX, RAX);
+            jit_setcc(c, CC_E, RAX);
+
+            jit_movzx_al(c);
+        } else {
+            // xor eax, 1
+            jit_byte(c, 0x83);
+            jit_byte(c, 0xf0);
+            jit_byte(c, 0x01);
+        }
+
+        jit_movq_to_xmm(c, top, RAX);
+
+        t->stack[t->depth - 1] = BOOL_VAL(value_is_falsey(value));
+        return true;
+    }
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_POW:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTE:
+    case OP_GTE:
+    case OP_EQL:
+    case OP_NEQ:
+        if (t->depth < 2 ||
+            !jit_trace_math(t, op, JIT_STACK_XMM(t->depth - 2),
+                            JIT_STACK_XMM(t->depth - 1),
+                            t->stack[t->depth - 2], t->stack[t->depth - 1],
+                            &result)) {
+            return false;
+        }
+
+        t->depth -= 2;
+
+        return jit_trace_push(t, 0, result);
+
+    case OP_SET_LOCAL_WITH_MATH:
+    case OP_SET_GLOBAL_WITH_MATH: {
+        bool global = op == OP_SET_GLOBAL_WITH_MATH;
+        uint16_t slot = global ? JIT_SHORT(2) : bytes[2];
+
+        if (t->depth == 0) {
+            return false;
+        }
+
+        uint8_t top = JIT_STACK_XMM(t->depth - 1);
+        int a = jit_trace_get(t, global, slot, &lhs);
+
+        if (!jit_trace_math(t, bytes[1], a, top, lhs, t->stack[t->depth - 1],
+                            &result) ||
+            !jit_trace_set(t, global, slot, 0, result)) {
+            return false;
+        }
+
+        jit_movapd(c, top, 0);
+        t->stack[t->depth - 1] = result;
+        return true;
+    }
+
+    case OP_SET_LOCAL_WITH_MATH_LOCAL:
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_POP:
+    case OP_SET_LOCAL_WITH_MATH_CONST:
+    case OP_SET_LOCAL_WITH_MATH_CONST_POP:
+    case OP_MATH_LOCAL_LOCAL:
+    case OP_MATH_LOCAL_CONST:
+    case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE:
+    case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE: {
+        bool constant = op == OP_SET_LOCAL_WITH_MATH_CONST ||
+                        op == OP_SET_LOCAL_WITH_MATH_CONST_POP ||
+                        op == OP_MATH_LOCAL_CONST ||
+                        op == OP_MATH_LOCAL_CONST_JUMP_IF_FALSE;
+
+        int a = jit_trace_get(t, false, bytes[2], &lhs);
+        int b = constant ? jit_trace_constant(t, JIT_CONSTANT(3), 1, &rhs)
+                         : jit_trace_get(t, false, bytes[3], &rhs);
+
+        if (!jit_trace_math(t, bytes[1], a, b, lhs, rhs, &result)) {
+            return false;
+        }
+
+        switch (op) {
+        case OP_SET_LOCAL_WITH_MATH_LOCAL:
+        case OP_SET_LOCAL_WITH_MATH_CONST:
+            return jit_trace_set(t, false, bytes[2], 0, result) &&
+                   jit_trace_push(t, 0, result);
+
+        case OP_SET_LOCAL_WITH_MATH_LOCAL_POP:
+        case OP_SET_LOCAL_WITH_MATH_CONST_POP:
+            return jit_trace_set(t, false, bytes[2], 0, result);
+
+        case OP_MATH_LOCAL_LOCAL:
+        case OP_MATH_LOCAL_CONST:
+            return jit_trace_push(t, 0, result);
+
+        default:
+            jit_trace_branch(t, 0, result, next,
+                             next + JIT_SHORT(constant ? 5 : 4), ip);
+            return true;
+        }
+    }
+
+    case OP_POP_JUMP_IF_FALSE:
+        if (t->depth == 0) {
+            return false;
+        }
+
+        t->depth--;
+
+        jit_trace_branch(t, JIT_STACK_XMM(t->depth), t->stack[t->depth], next,
+                         next + JIT_SHORT(1), ip);
+        return true;
+
+    case OP_JUMP_IF_FALSE:
+        if (t->depth == 0) {
+            return false;
+        }
+
+        jit_trace_branch(t, JIT_STACK_XMM(t->depth - 1),
+                         t->stack[t->depth - 1], next, next + JIT_SHORT(1), ip);
+        return true;
+
+    case OP_JUMP:
+        *ip = next + JIT_SHORT(1);
+        return true;
+
+    case OP_LOOP:
+        // Inner loops are traced on their own
+        t->closed = next - JIT_SHORT(1) == header && t->depth == 0;
+        return t->closed;
+
+    default:
+        return false;
+    }
+
+#undef JIT_SHORT
+#undef JIT_CONSTANT
+}
+
+// Where a variable lives is [base + var->slot * sizeof(Value)]
+static uint8_t jit_trace_base(const JitVar *var) {
+    return var->global ? RBP : R13;
+}
+
+// Records one iteration of the loop starting at the current instruction of
+// `frame` without executing it, and compiles it if it could be traced
+static uint8_t *jit_trace(ObjFunction *fn, const CallFrame *frame,
+                          const Value *sp, size_t *size) {
+    JitTracer t = {
+        .c = {.fn = fn},
+        .frame = frame,
+        .base = sp - frame->slots,
+    };
+
+    JitCompiler *c = &t.c;
+
+    uint32_t header = frame->ip - fn->chunk.bytes;
+
+    jit_enter(c, JIT_TRACE_LOCALS);
+    size_t entry = jit_jmp(c);
+
+    size_t loop_start = c->code.count;
+
+    size_t ip = header;
+
+    for (size_t steps = 0; steps < JIT_TRACE_STEPS && !t.closed; steps++) {
+        if (!jit_trace_instruction(&t, header, ip, &ip)) {
+            break;
+        }
+    }
+
+    if (!t.closed) {
+        free(c->code.items);
+        free(t.exits.items);
+
+        return NULL;
+    }
+
+    jit_jmp_to(c, loop_start);
+
+    size_t leave = c->code.count;
+    jit_leave(c, JIT_TRACE_LOCALS);
+
+    // Side exits store back the variables and the stack the interpreter expects
+    // at their target
+    for (size_t i = 0; i < t.exits.count; i++) {
+        JitExit *side = &t.exits.items[i];
+
+        jit_bind(c, side->at);
+
+        for (size_t j = 0; j < t.vars_count; j++) {
+            if (t.vars[j].written) {
+                jit_movq_from_xmm(c, RAX, JIT_VAR_XMM(j));
+                jit_store(c, jit_trace_base(&t.vars[j]),
+                          t.vars[j].slot * sizeof(Value), RAX);
+            }
+        }
+
+        jit_mov_imm(c, RDX, BOOL_VAL(false));
+
+        for (size_t k = 0; k < side->depth; k++) {
+            jit_movq_from_xmm(c, RAX, JIT_STACK_XMM(k));
+
+            if (side->bools & (1 << k)) {
+                jit_or(c, RAX, RDX);
+            }
+
+            jit_store(c, R12, k * sizeof(Value), RAX);
+        }
+
+        jit_add_imm(c, R12, side->depth * sizeof(Value));
+        jit_store(c, RBX, offsetof(Vm, sp), R12);
+        jit_set_ip(c, side->target);
+        jit_jmp_to(c, leave);
+    }
+
+    // Entering loads every variable, the ones that are read before being
+    // written have to be numbers or the trace is left right away
+    jit_bind(c, entry);
+
+    for (size_t i = 0; i < t.vars_count; i++) {
+        if (t.vars[i].global) {
+            jit_mov_imm(c, RBP, (uint64_t)(uintptr_t)fn->global_values);
+            jit_load(c, RBP, RBP, offsetof(ObjArray, items));
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < t.vars_count; i++) {
+        jit_load(c, RAX, jit_trace_base(&t.vars[i]),
+                 t.vars[i].slot * sizeof(Value));
+
+        if (t.vars[i].read) {
+            size_t slow;
+            jit_guard_num(c, RAX, &slow);
+            jit_patch(c, slow, leave);
+        }
+
+        jit_movq_to_xmm(c, JIT_VAR_XMM(i), RAX);
+    }
+
+    jit_jmp_to(c, loop_start);
+
+    free(t.exits.items);
+
+    *size = c->code.count;
+
+    return jit_install(c);
+}
+
+// Called whenever the back jump of a loop got hot, records and compiles the
+// loop the first time and runs the trace from then on
+static void jit_loop_hot(Vm *vm, CallFrame *frame) {
+    ObjFunction *fn = frame->closure->fn;
+    const uint8_t *header = frame->ip;
+
+    JitLoop *loop = jit_loop(fn, header - fn->chunk.bytes);
+
+    if (loop == NULL) {
+        return;
+    }
+
+    if (loop->trace == NULL) {
+        loop->trace = jit_trace(fn, frame, vm->sp, &loop->size);
+    }
+
+    if (loop->trace != NULL) {
+        ((JitTraceFn)(void *)loop->trace)(vm, frame);
+
+        // The trace was left right away, the variables are no longer numbers
+        if (frame->ip != header) {
+            loop->countdown = 1;
+
+            return;
+        }
+
+        munmap(loop->trace, loop->size);
+        loop->trace = NULL;
+    }
+
+    // Give up after a few tries, the baseline code still runs the loop
+    loop->countdown = ++loop->attempts < JIT_TRACE_ATTEMPTS
+                          ? VM_JIT_TRACE_THRESHOLD
+                          : UINT32_MAX;
+}
+
+void vm_jit_free(ObjFunction *fn) {
+    if (fn->jit != NULL) {
+        munmap(fn->jit->code, fn->jit->size);
+        free(fn->jit->entries);
+        free(fn->jit);
+    }
+
+    for (JitLoop *loop = fn->loops; loop != NULL;) {
+        JitLoop *next = loop->next;
+
+        if (loop->trace != NULL) {
+            munmap(loop->trace, loop->size);
+        }
+
+        free(loop);
+        loop = next;
+    }
+}
+
+// Runs the generated code of the function on top of the call stack from its
+// current instruction, compiling it first if it got hot. Returns false on
+// runtime errors, otherwise the interpreter continues from the current frame
+bool vm_jit_execute(Vm *vm) {
+    for (;;) {
+        CallFrame *frame = &vm->frames[vm->frame_count - 1];
+
+        ObjFunction *fn = frame->closure->fn;
+
+        if (fn->jit == NULL) {
+            if (fn->hotness == UINT32_MAX ||
+                ++fn->hotness < VM_JIT_THRESHOLD) {
+                return true;
+            }
+
+            fn->jit = jit_compile(fn);
+
+            if (fn->jit == NULL) {
+                // Never retry, the interpreter can run everything anyway
+                fn->hotness = UINT32_MAX;
+
+                return true;
+            }
+        }
+
+        uint32_t entry = fn->jit->entries[frame->ip - fn->chunk.bytes];
+
+        if (entry == JIT_NO_ENTRY) {
+            return true;
+        }
+
+        JitFn run = (JitFn)(void *)fn->jit->code;
+
+        switch (run(vm, frame, fn->jit->code + entry)) {
+        case JIT_ERROR:
+            return false;
+
+        case JIT_EXIT:
+            return true;
+
+        case JIT_ENTER:
+            break;
+
+        case JIT_TRACE:
+            jit_loop_hot(vm, frame);
+            break;
+        }
+    }
+}
+
+#endif
@@ -4,7 +4,9 @@
 #undef vmcase
 #undef vmbreak
 
-#define vmdispatch() goto *dispatch_table[op];
+#define vmdispatch() goto *in->handler;
+
+#define vmhandlers dispatch_table
 
 #define vmcase(op) L_##op:
 
@@ -23,6 +25,8 @@ static void *dispatch_table[] = {
     [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
     [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
     [OP_SET_LOCAL_WITH_MATH] = &&L_OP_SET_LOCAL_WITH_MATH,
+    [OP_SET_LOCAL_WITH_MATH_LOCAL] = &&L_OP_SET_LOCAL_WITH_MATH_LOCAL,
+    [OP_SET_LOCAL_WITH_MATH_CONST] = &&L_OP_SET_LOCAL_WITH_MATH_CONST,
     [OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
     [OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
     [OP_SET_UPVALUE_WITH_MATH] = &&L_OP_SET_UPVALUE_WITH_MATH,
@@ -33,8 +37,12 @@ static void *dispatch_table[] = {
     [OP_GET_SUBSCRIPT] = &&L_OP_GET_SUBSCRIPT,
     [OP_SET_SUBSCRIPT] = &&L_OP_SET_SUBSCRIPT,
     [OP_SET_SUBSCRIPT_WITH_MATH] = &&L_OP_SET_SUBSCRIPT_WITH_MATH,
+    [OP_GET_MEMBER] = &&L_OP_GET_MEMBER,
+    [OP_SET_MEMBER] = &&L_OP_SET_MEMBER,
+    [OP_SET_MEMBER_WITH_MATH] = &&L_OP_SET_MEMBER_WITH_MATH,
     [OP_MAKE_ARRAY] = &&L_OP_MAKE_ARRAY,
     [OP_MAKE_MAP] = &&L_OP_MAKE_MAP,
+    [OP_MAKE_SHAPED_MAP] = &&L_OP_MAKE_SHAPED_MAP,
     [OP_MAKE_CLOSURE] = &&L_OP_MAKE_CLOSURE,
     [OP_MAKE_SLICE] = &&L_OP_MAKE_SLICE,             // a[s:e]
     [OP_MAKE_SLICE_ABOVE] = &&L_OP_MAKE_SLICE_ABOVE, // a[s:]
@@ -54,10 +62,44 @@ static void *dispatch_table[] = {
     [OP_GT] = &&L_OP_GT,
     [OP_LTE] = &&L_OP_LTE,
     [OP_GTE] = &&L_OP_GTE,
+    [OP_MATH_LOCAL_LOCAL] = &&L_OP_MATH_LOCAL_LOCAL,
+    [OP_MATH_LOCAL_CONST] = &&L_OP_MATH_LOCAL_CONST,
     [OP_CALL] = &&L_OP_CALL,
+    [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
     [OP_POP_JUMP_IF_FALSE] = &&L_OP_POP_JUMP_IF_FALSE,
     [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
     [OP_JUMP] = &&L_OP_JUMP,
     [OP_LOOP] = &&L_OP_LOOP,
     [OP_RETURN] = &&L_OP_RETURN,
+    [OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE] = &&L_OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE,
+    [OP_MATH_LOCAL_CONST_JUMP_IF_FALSE] = &&L_OP_MATH_LOCAL_CONST_JUMP_IF_FALSE,
+    [OP_SET_LOCAL_WITH_MATH_LOCAL_POP] = &&L_OP_SET_LOCAL_WITH_MATH_LOCAL_POP,
+    [OP_SET_LOCAL_WITH_MATH_CONST_POP] = &&L_OP_SET_LOCAL_WITH_MATH_CONST_POP,
+    [OP_SET_LOCAL_POP] = &&L_OP_SET_LOCAL_POP,
+    [OP_GET_SUBSCRIPT_LOCAL_CONST] = &&L_OP_GET_SUBSCRIPT_LOCAL_CONST,
+    [OP_CALL_UPVALUE] = &&L_OP_CALL_UPVALUE,
+    [OP_CALL_GLOBAL] = &&L_OP_CALL_GLOBAL,
+    [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+    [OP_SUB_NUM] = &&L_OP_SUB_NUM,
+    [OP_MUL_NUM] = &&L_OP_MUL_NUM,
+    [OP_LT_NUM] = &&L_OP_LT_NUM,
+    [OP_GT_NUM] = &&L_OP_GT_NUM,
+    [OP_LTE_NUM] = &&L_OP_LTE_NUM,
+    [OP_GTE_NUM] = &&L_OP_GTE_NUM,
+    [OP_SET_LOCAL_WITH_MATH_NUM] = &&L_OP_SET_LOCAL_WITH_MATH_NUM,
+    [OP_SET_LOCAL_WITH_MATH_LOCAL_NUM] = &&L_OP_SET_LOCAL_WITH_MATH_LOCAL_NUM,
+    [OP_SET_LOCAL_WITH_MATH_CONST_NUM] = &&L_OP_SET_LOCAL_WITH_MATH_CONST_NUM,
+    [OP_SET_UPVALUE_WITH_MATH_NUM] = &&L_OP_SET_UPVALUE_WITH_MATH_NUM,
+    [OP_SET_GLOBAL_WITH_MATH_NUM] = &&L_OP_SET_GLOBAL_WITH_MATH_NUM,
+    [OP_SET_SUBSCRIPT_WITH_MATH_NUM] = &&L_OP_SET_SUBSCRIPT_WITH_MATH_NUM,
+    [OP_MATH_LOCAL_LOCAL_NUM] = &&L_OP_MATH_LOCAL_LOCAL_NUM,
+    [OP_MATH_LOCAL_CONST_NUM] = &&L_OP_MATH_LOCAL_CONST_NUM,
+    [OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM] =
+        &&L_OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM,
+    [OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM] =
+        &&L_OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM,
+    [OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM] =
+        &&L_OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM,
+    [OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM] =
+        &&L_OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM,
 };
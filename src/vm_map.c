@@ -1,52 +1,137 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "vm.h"
 
-static ObjMapEntry *vm_map_find_entry(ObjMapEntry *entries, uint32_t capacity,
-                                      ObjString *key) {
-    uint32_t index = key->hash & (capacity - 1);
+// Every entry has a control byte, a full one holds the top 7 bits of its key's
+// hash so most mismatches are ruled out without touching the entries. Probing
+// goes a group of control bytes at a time and stops at the first group with an
+// empty one
+#define VM_MAP_EMPTY 0x80
+#define VM_MAP_DELETED 0xfe
+
+static inline uint8_t vm_map_tag(uint32_t hash) { return hash >> 25; }
+
+// Returns a bit for each control byte of the group at `controls` that is `byte`
+static inline uint32_t vm_map_match(const uint8_t *controls, uint8_t byte) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)controls);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+    uint32_t mask = 0;
+
+    for (uint32_t i = 0; i < VM_MAP_GROUP; i++) {
+        mask |= (uint32_t)(controls[i] == byte) << i;
+    }
+
+    return mask;
+#endif
+}
+
+// Returns a bit for each control byte of the group that is empty or deleted,
+// full ones are below 0x80
+static inline uint32_t vm_map_match_free(const uint8_t *controls) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)controls));
+#else
+    uint32_t mask = 0;
 
-    ObjMapEntry *tombstone = NULL;
+    for (uint32_t i = 0; i < VM_MAP_GROUP; i++) {
+        mask |= (uint32_t)(controls[i] >> 7) << i;
+    }
+
+    return mask;
+#endif
+}
+
+// Returns the mask that wraps group indexes around, groups are visited in
+// triangular steps which reaches all of them as their count is a power of 2
+static inline uint32_t vm_map_groups_mask(uint32_t capacity) {
+    return capacity < VM_MAP_GROUP ? 0 : capacity / VM_MAP_GROUP - 1;
+}
 
-    for (;;) {
-        ObjMapEntry *entry = &entries[index];
+// Returns the index of the entry with `key`, or UINT32_MAX
+static uint32_t vm_map_find_index(const ObjMap *map, ObjString *key) {
+    uint8_t tag = vm_map_tag(key->hash);
 
-        if (entry->key == NULL) {
-            if (IS_NULL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else if (tombstone == NULL) {
-                tombstone = entry;
+    uint32_t mask = vm_map_groups_mask(map->capacity);
+
+    for (uint32_t group = key->hash & mask, step = 1;;
+         group = (group + step++) & mask) {
+        const uint8_t *controls = &map->controls[group * VM_MAP_GROUP];
+
+        for (uint32_t match = vm_map_match(controls, tag); match != 0;
+             match &= match - 1) {
+            uint32_t index = group * VM_MAP_GROUP + __builtin_ctz(match);
+
+            if (map->entries[index].key == key) { // The benefit of interning
+                return index;
             }
-        } else if (entry->key == key) { // The benefit of string interning
-            return entry;
         }
 
-        index = (index + 1) & (capacity - 1);
+        if (vm_map_match(controls, VM_MAP_EMPTY) != 0) {
+            return UINT32_MAX;
+        }
+    }
+}
+
+// Returns the index of the first empty or deleted entry `hash` probes
+static uint32_t vm_map_find_free(const ObjMap *map, uint32_t hash) {
+    // The control bytes past the end of a table smaller than a group are empty
+    // but have no entries
+    uint32_t valid = map->capacity < VM_MAP_GROUP ? (1u << map->capacity) - 1
+                                                  : UINT32_MAX;
+
+    uint32_t mask = vm_map_groups_mask(map->capacity);
+
+    for (uint32_t group = hash & mask, step = 1;;
+         group = (group + step++) & mask) {
+        uint32_t match =
+            vm_map_match_free(&map->controls[group * VM_MAP_GROUP]) & valid;
+
+        if (match != 0) {
+            return group * VM_MAP_GROUP + __builtin_ctz(match);
+        }
     }
 }
 
 ObjString *vm_find_string(Vm *vm, const char *key, uint32_t count,
                           uint32_t hash) {
-    if (vm->strings->count == 0) {
+    ObjMap *strings = vm->strings;
+
+    if (strings->count == 0) {
         return NULL;
     }
 
-    uint32_t index = hash & (vm->strings->capacity - 1);
+    uint8_t tag = vm_map_tag(hash);
+
+    uint32_t mask = vm_map_groups_mask(strings->capacity);
 
-    for (;;) {
-        ObjMapEntry *entry = &vm->strings->entries[index];
+    for (uint32_t group = hash & mask, step = 1;;
+         group = (group + step++) & mask) {
+        const uint8_t *controls = &strings->controls[group * VM_MAP_GROUP];
 
-        if (entry->key == NULL) {
-            if (IS_NULL(entry->value)) {
-                return NULL;
+        for (uint32_t match = vm_map_match(controls, tag); match != 0;
+             match &= match - 1) {
+            ObjString *string =
+                strings->entries[group * VM_MAP_GROUP + __builtin_ctz(match)]
+                    .key;
+
+            if (string->hash == hash && string->count == count &&
+                memcmp(string->items, key, count) == 0) {
+                return string;
             }
-        } else if (entry->key->hash == hash && entry->key->count == count &&
-                   memcmp(entry->key->items, key, count) == 0) {
-            return entry->key;
         }
 
-        index = (index + 1) & (vm->strings->capacity - 1);
+        if (vm_map_match(controls, VM_MAP_EMPTY) != 0) {
+            return NULL;
+        }
     }
 }
 
@@ -55,32 +140,67 @@ bool vm_map_lookup(const ObjMap *map, ObjString *key, Value *value) {
         return false;
     }
 
-    ObjMapEntry *entry = vm_map_find_entry(map->entries, map->capacity, key);
+    uint32_t index = vm_map_find_index(map, key);
 
-    if (entry->key == NULL) {
+    if (index == UINT32_MAX) {
         return false;
     }
 
-    *value = entry->value;
+    *value = map->entries[index].value;
 
     return true;
 }
 
-void vm_map_adjust_capacity(Vm *vm, ObjMap *map, uint32_t capacity) {
-    vm->bytes_allocated += capacity * sizeof(ObjMapEntry);
+bool vm_map_lookup_index(const ObjMap *map, ObjString *key, uint32_t *index) {
+    if (map->count == 0) {
+        return false;
+    }
 
-    if (vm->bytes_allocated > vm->next_gc) {
-        vm_gc(vm);
+    *index = vm_map_find_index(map, key);
+
+    return *index != UINT32_MAX;
+}
+
+// Shapes are handed out lazily and dropped whenever the entries move or a key is
+// added or deleted, so two maps share a shape only if they were built from the
+// same map literal and none of them had their keys changed since. Shapes are
+// never reused, once they run out every map is left with 0 which no cache hits
+uint32_t vm_map_shape(ObjMap *map) {
+    static uint32_t shapes_count = 0;
+
+    if (map->shape == 0 && shapes_count < UINT32_MAX) {
+        map->shape = ++shapes_count;
+    }
+
+    return map->shape;
+}
+
+// Moves the entries to a table of `capacity` and drops the deleted ones, it
+// never triggers the garbage collector so it is safe to call while collecting
+static void vm_map_rehash(Vm *vm, ObjMap *map, uint32_t capacity) {
+    size_t size = vm_map_table_size(capacity);
+
+    ObjMapEntry *entries = malloc(size);
+
+    if (entries == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+
+        exit(1);
     }
 
-    ObjMapEntry *entries = malloc(capacity * sizeof(ObjMapEntry));
+    vm->bytes_allocated += size;
+
+    ObjMap table = {
+        .entries = entries,
+        .controls = (uint8_t *)&entries[capacity],
+        .capacity = capacity,
+    };
 
     for (uint32_t i = 0; i < capacity; i++) {
         entries[i].key = NULL;
-        entries[i].value = NULL_VAL;
     }
 
-    map->count = 0;
+    memset(table.controls, VM_MAP_EMPTY, size - capacity * sizeof(ObjMapEntry));
 
     for (uint32_t i = 0; i < map->capacity; i++) {
         ObjMapEntry *entry = &map->entries[i];
@@ -88,58 +208,111 @@ void vm_map_adjust_capacity(Vm *vm, ObjMap *map, uint32_t capacity) {
         if (entry->key == NULL)
             continue;
 
-        ObjMapEntry *dest = vm_map_find_entry(entries, capacity, entry->key);
-
-        dest->key = entry->key;
-        dest->value = entry->value;
+        uint32_t index = vm_map_find_free(&table, entry->key->hash);
 
-        map->count++;
+        table.entries[index] = *entry;
+        table.controls[index] = vm_map_tag(entry->key->hash);
     }
 
     free(map->entries);
 
-    vm->bytes_allocated -= map->capacity * sizeof(ObjMapEntry);
+    vm->bytes_allocated -= vm_map_table_size(map->capacity);
 
-    map->entries = entries;
+    map->entries = table.entries;
+    map->controls = table.controls;
     map->capacity = capacity;
+    map->tombstones = 0;
+    map->shape = 0;
 }
 
-#define VM_MAP_MAX_LOAD 0.75
+// Returns the smallest capacity where `count` entries take at most half of the
+// maximum load
+static uint32_t vm_map_capacity_for(uint32_t count) {
+    uint32_t capacity = 8;
+
+    while (count > capacity * 7 / 16) {
+        capacity *= 2;
+    }
+
+    return capacity;
+}
+
+void vm_map_adjust_capacity(Vm *vm, ObjMap *map, uint32_t capacity) {
+    if (vm->bytes_allocated + vm_map_table_size(capacity) > vm->next_gc) {
+        vm_gc(vm);
+    }
+
+    vm_map_rehash(vm, map, capacity);
+}
+
+// Tombstones are counted as well since probing only stops at an empty entry
+static inline bool vm_map_full(const ObjMap *map) {
+    return map->count + map->tombstones + 1 > map->capacity - map->capacity / 8;
+}
 
 bool vm_map_insert(Vm *vm, ObjMap *map, ObjString *key, Value value) {
+    uint32_t index = map->count > 0 ? vm_map_find_index(map, key) : UINT32_MAX;
 
-    if (map->count + 1 > map->capacity * VM_MAP_MAX_LOAD) {
-        vm_map_adjust_capacity(vm, map,
-                               map->capacity == 0 ? 8 : map->capacity * 2);
+    if (index != UINT32_MAX) {
+        map->entries[index].value = value;
+
+        return false;
     }
 
-    ObjMapEntry *entry = vm_map_find_entry(map->entries, map->capacity, key);
+    // Rehashing drops the tombstones, so the map only grows if it is still
+    // half full, and shrinks if deletions left it mostly empty
+    if (map->capacity == 0 || vm_map_full(map)) {
+        vm_map_adjust_capacity(vm, map, vm_map_capacity_for(map->count));
+    }
 
-    bool is_new_key = entry->key == NULL;
+    index = vm_map_find_free(map, key->hash);
 
-    if (is_new_key && IS_NULL(entry->value)) {
-        map->count++;
+    if (map->controls[index] == VM_MAP_DELETED) {
+        map->tombstones--;
     }
 
-    entry->key = key;
-    entry->value = value;
+    map->entries[index].key = key;
+    map->entries[index].value = value;
+    map->controls[index] = vm_map_tag(key->hash);
+
+    map->shape = 0;
+    map->count++;
 
-    return is_new_key;
+    return true;
 }
 
 bool vm_map_delete(ObjMap *map, ObjString *key) {
     if (map->count == 0)
         return false;
 
-    ObjMapEntry *entry = vm_map_find_entry(map->entries, map->capacity, key);
+    uint32_t index = vm_map_find_index(map, key);
 
-    if (entry->key == NULL)
+    if (index == UINT32_MAX)
         return false;
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    uint32_t group = index & ~(VM_MAP_GROUP - 1);
+
+    // A group with an empty entry never made a probe go on to the next one, so
+    // the deleted entry can be empty too
+    bool empty = vm_map_match(&map->controls[group], VM_MAP_EMPTY) != 0;
+
+    map->entries[index].key = NULL;
+    map->controls[index] = empty ? VM_MAP_EMPTY : VM_MAP_DELETED;
+
+    map->shape = 0;
 
     map->count--;
+    map->tombstones += !empty;
 
     return true;
 }
+
+void vm_map_shrink(Vm *vm, ObjMap *map) {
+    uint32_t capacity = vm_map_capacity_for(map->count);
+
+    // Only when the table is at least 4 times too big, so that a map whose
+    // size goes back and forth is not rehashed every time
+    if (capacity * 4 <= map->capacity) {
+        vm_map_rehash(vm, map, capacity);
+    }
+}
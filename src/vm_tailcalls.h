@@ -0,0 +1,139 @@
+#pragma once
+
+// Runs every opcode in a function of its own that gets the state of vm_run in
+// its arguments and ends by tail calling the handler of the next instruction,
+// so that the compiler allocates the registers of each handler on its own
+#if defined(__has_attribute) && __has_attribute(musttail)
+#define VM_MUSTTAIL __attribute__((musttail))
+#elif defined(__GNUC__) && defined(__OPTIMIZE__) &&                            \
+    !defined(__SANITIZE_ADDRESS__)
+// Older GCC has no way to demand a tail call, the handlers are compiled with
+// the optimization that turns them into jumps and left to it
+#define VM_MUSTTAIL
+#pragma GCC optimize("optimize-sibling-calls")
+#else
+#error "NUR_TAIL_CALLS needs musttail or an optimizing build without ASan"
+#endif
+
+typedef bool (*VmHandler)(Vm *vm, Instruction *pc, Value *sp, Value *slots,
+                          CallFrame *frame, uint8_t *bytes);
+
+static void *const vmhandlers[UINT8_MAX + 1];
+
+#define in (pc - 1)
+
+// The last frame leaves what it returns just above the stack for vm_run, which
+// keeps the handlers at the six arguments passed in registers on x86-64 and
+// AArch64, one more and the compiler may no longer turn the calls into jumps
+#define out (vm->sp)
+
+#define vmcase(op)                                                             \
+    static bool vm_##op(Vm *vm, Instruction *pc, Value *sp, Value *slots,      \
+                        CallFrame *frame, uint8_t *bytes)
+
+#define vmbreak()                                                              \
+    vmprofile(pc->op);                                                         \
+    VM_MUSTTAIL return ((VmHandler)pc->handler)(vm, pc + 1, sp, slots, frame,  \
+                                                bytes)
+
+#include "vm_handlers.h"
+
+#undef in
+#undef out
+
+static void *const vmhandlers[UINT8_MAX + 1] = {
+    [OP_POP] = (void *)vm_OP_POP,
+    [OP_DUP] = (void *)vm_OP_DUP,
+    [OP_SWP] = (void *)vm_OP_SWP,
+    [OP_PUSH_NULL] = (void *)vm_OP_PUSH_NULL,
+    [OP_PUSH_TRUE] = (void *)vm_OP_PUSH_TRUE,
+    [OP_PUSH_FALSE] = (void *)vm_OP_PUSH_FALSE,
+    [OP_PUSH_CONST] = (void *)vm_OP_PUSH_CONST,
+    [OP_GET_LOCAL] = (void *)vm_OP_GET_LOCAL,
+    [OP_SET_LOCAL] = (void *)vm_OP_SET_LOCAL,
+    [OP_SET_LOCAL_WITH_MATH] = (void *)vm_OP_SET_LOCAL_WITH_MATH,
+    [OP_SET_LOCAL_WITH_MATH_LOCAL] = (void *)vm_OP_SET_LOCAL_WITH_MATH_LOCAL,
+    [OP_SET_LOCAL_WITH_MATH_CONST] = (void *)vm_OP_SET_LOCAL_WITH_MATH_CONST,
+    [OP_GET_UPVALUE] = (void *)vm_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE] = (void *)vm_OP_SET_UPVALUE,
+    [OP_SET_UPVALUE_WITH_MATH] = (void *)vm_OP_SET_UPVALUE_WITH_MATH,
+    [OP_CLOSE_UPVALUE] = (void *)vm_OP_CLOSE_UPVALUE,
+    [OP_GET_GLOBAL] = (void *)vm_OP_GET_GLOBAL,
+    [OP_SET_GLOBAL] = (void *)vm_OP_SET_GLOBAL,
+    [OP_SET_GLOBAL_WITH_MATH] = (void *)vm_OP_SET_GLOBAL_WITH_MATH,
+    [OP_GET_SUBSCRIPT] = (void *)vm_OP_GET_SUBSCRIPT,
+    [OP_SET_SUBSCRIPT] = (void *)vm_OP_SET_SUBSCRIPT,
+    [OP_SET_SUBSCRIPT_WITH_MATH] = (void *)vm_OP_SET_SUBSCRIPT_WITH_MATH,
+    [OP_GET_MEMBER] = (void *)vm_OP_GET_MEMBER,
+    [OP_SET_MEMBER] = (void *)vm_OP_SET_MEMBER,
+    [OP_SET_MEMBER_WITH_MATH] = (void *)vm_OP_SET_MEMBER_WITH_MATH,
+    [OP_MAKE_ARRAY] = (void *)vm_OP_MAKE_ARRAY,
+    [OP_MAKE_MAP] = (void *)vm_OP_MAKE_MAP,
+    [OP_MAKE_SHAPED_MAP] = (void *)vm_OP_MAKE_SHAPED_MAP,
+    [OP_MAKE_CLOSURE] = (void *)vm_OP_MAKE_CLOSURE,
+    [OP_MAKE_SLICE] = (void *)vm_OP_MAKE_SLICE,
+    [OP_MAKE_SLICE_ABOVE] = (void *)vm_OP_MAKE_SLICE_ABOVE,
+    [OP_MAKE_SLICE_UNDER] = (void *)vm_OP_MAKE_SLICE_UNDER,
+    [OP_COPY_BY_SLICING] = (void *)vm_OP_COPY_BY_SLICING,
+    [OP_NEG] = (void *)vm_OP_NEG,
+    [OP_NOT] = (void *)vm_OP_NOT,
+    [OP_ADD] = (void *)vm_OP_ADD,
+    [OP_SUB] = (void *)vm_OP_SUB,
+    [OP_MUL] = (void *)vm_OP_MUL,
+    [OP_DIV] = (void *)vm_OP_DIV,
+    [OP_POW] = (void *)vm_OP_POW,
+    [OP_MOD] = (void *)vm_OP_MOD,
+    [OP_EQL] = (void *)vm_OP_EQL,
+    [OP_NEQ] = (void *)vm_OP_NEQ,
+    [OP_LT] = (void *)vm_OP_LT,
+    [OP_GT] = (void *)vm_OP_GT,
+    [OP_LTE] = (void *)vm_OP_LTE,
+    [OP_GTE] = (void *)vm_OP_GTE,
+    [OP_MATH_LOCAL_LOCAL] = (void *)vm_OP_MATH_LOCAL_LOCAL,
+    [OP_MATH_LOCAL_CONST] = (void *)vm_OP_MATH_LOCAL_CONST,
+    [OP_CALL] = (void *)vm_OP_CALL,
+    [OP_TAIL_CALL] = (void *)vm_OP_TAIL_CALL,
+    [OP_POP_JUMP_IF_FALSE] = (void *)vm_OP_POP_JUMP_IF_FALSE,
+    [OP_JUMP_IF_FALSE] = (void *)vm_OP_JUMP_IF_FALSE,
+    [OP_JUMP] = (void *)vm_OP_JUMP,
+    [OP_LOOP] = (void *)vm_OP_LOOP,
+    [OP_RETURN] = (void *)vm_OP_RETURN,
+    [OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE] =
+        (void *)vm_OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE,
+    [OP_MATH_LOCAL_CONST_JUMP_IF_FALSE] =
+        (void *)vm_OP_MATH_LOCAL_CONST_JUMP_IF_FALSE,
+    [OP_SET_LOCAL_WITH_MATH_LOCAL_POP] =
+        (void *)vm_OP_SET_LOCAL_WITH_MATH_LOCAL_POP,
+    [OP_SET_LOCAL_WITH_MATH_CONST_POP] =
+        (void *)vm_OP_SET_LOCAL_WITH_MATH_CONST_POP,
+    [OP_SET_LOCAL_POP] = (void *)vm_OP_SET_LOCAL_POP,
+    [OP_GET_SUBSCRIPT_LOCAL_CONST] = (void *)vm_OP_GET_SUBSCRIPT_LOCAL_CONST,
+    [OP_CALL_UPVALUE] = (void *)vm_OP_CALL_UPVALUE,
+    [OP_CALL_GLOBAL] = (void *)vm_OP_CALL_GLOBAL,
+    [OP_ADD_NUM] = (void *)vm_OP_ADD_NUM,
+    [OP_SUB_NUM] = (void *)vm_OP_SUB_NUM,
+    [OP_MUL_NUM] = (void *)vm_OP_MUL_NUM,
+    [OP_LT_NUM] = (void *)vm_OP_LT_NUM,
+    [OP_GT_NUM] = (void *)vm_OP_GT_NUM,
+    [OP_LTE_NUM] = (void *)vm_OP_LTE_NUM,
+    [OP_GTE_NUM] = (void *)vm_OP_GTE_NUM,
+    [OP_SET_LOCAL_WITH_MATH_NUM] = (void *)vm_OP_SET_LOCAL_WITH_MATH_NUM,
+    [OP_SET_LOCAL_WITH_MATH_LOCAL_NUM] =
+        (void *)vm_OP_SET_LOCAL_WITH_MATH_LOCAL_NUM,
+    [OP_SET_LOCAL_WITH_MATH_CONST_NUM] =
+        (void *)vm_OP_SET_LOCAL_WITH_MATH_CONST_NUM,
+    [OP_SET_UPVALUE_WITH_MATH_NUM] = (void *)vm_OP_SET_UPVALUE_WITH_MATH_NUM,
+    [OP_SET_GLOBAL_WITH_MATH_NUM] = (void *)vm_OP_SET_GLOBAL_WITH_MATH_NUM,
+    [OP_SET_SUBSCRIPT_WITH_MATH_NUM] =
+        (void *)vm_OP_SET_SUBSCRIPT_WITH_MATH_NUM,
+    [OP_MATH_LOCAL_LOCAL_NUM] = (void *)vm_OP_MATH_LOCAL_LOCAL_NUM,
+    [OP_MATH_LOCAL_CONST_NUM] = (void *)vm_OP_MATH_LOCAL_CONST_NUM,
+    [OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM] =
+        (void *)vm_OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM,
+    [OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM] =
+        (void *)vm_OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM,
+    [OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM] =
+        (void *)vm_OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM,
+    [OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM] =
+        (void *)vm_OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM,
+};
@@ -1,5 +1,11 @@
 #include <stdio.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "array.h"
 #include "vm.h"
 
@@ -33,9 +39,25 @@ bool objects_equal(Obj *a, Obj *b) {
     }
 
     switch (a->tag) {
-    case OBJ_STRING:
-        return false; // a == b must be true if they were equal strings, another
-                      // benefit of string interning
+    case OBJ_STRING: {
+        ObjString *sa = (ObjString *)a;
+        ObjString *sb = (ObjString *)b;
+
+        // Equal interned strings are the same object
+        if ((sa->interned && sb->interned) || sa->count != sb->count) {
+            return false;
+        }
+
+        // Hashes are only worth comparing if both are already known
+        if (sa->hash != 0 && sb->hash != 0 && sa->hash != sb->hash) {
+            return false;
+        }
+
+        vm_flatten_string(sa);
+        vm_flatten_string(sb);
+
+        return memcmp(sa->items, sb->items, sa->count) == 0;
+    }
 
     case OBJ_FUNCTION:
         if (((ObjFunction *)a)->arity != ((ObjFunction *)b)->arity) {
@@ -76,7 +98,7 @@ bool objects_equal(Obj *a, Obj *b) {
             return true;
         }
 
-        for (uint32_t i = 0; i < ((ObjMap *)a)->count; i++) {
+        for (uint32_t i = 0; i < ((ObjMap *)a)->capacity; i++) {
             ObjMapEntry ae = ((ObjMap *)a)->entries[i];
 
             if (ae.key != NULL) {
@@ -97,6 +119,23 @@ bool objects_equal(Obj *a, Obj *b) {
     case OBJ_NATIVE:
         return ((ObjNative *)a)->fn == ((ObjNative *)b)->fn;
 
+    case OBJ_TYPED_ARRAY: {
+        ObjTypedArray *ta = (ObjTypedArray *)a;
+        ObjTypedArray *tb = (ObjTypedArray *)b;
+
+        if (ta->kind != tb->kind || ta->count != tb->count) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < ta->count; i++) {
+            if (vm_typed_get(ta, i) != vm_typed_get(tb, i)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
     case OBJ_UPVALUE:
         return false;
 
@@ -107,6 +146,10 @@ bool objects_equal(Obj *a, Obj *b) {
 
 bool values_equal(Value a, Value b) {
 #ifdef NUR_NO_NAN_BOXING
+    if (IS_NUM(a) && IS_NUM(b)) {
+        return AS_NUM(a) == AS_NUM(b);
+    }
+
     if (a.tag != b.tag) {
         return false;
     }
@@ -118,9 +161,6 @@ bool values_equal(Value a, Value b) {
     case VAL_BOOL:
         return AS_BOOL(a) == AS_BOOL(b);
 
-    case VAL_NUM:
-        return AS_NUM(a) == AS_NUM(b);
-
     case VAL_OBJ:
         return objects_equal(AS_OBJ(a), AS_OBJ(b));
 
@@ -128,15 +168,21 @@ bool values_equal(Value a, Value b) {
         return false;
     }
 #else
-    if (IS_NUM(a) && IS_NUM(b)) {
-        return AS_NUM(a) == AS_NUM(b);
+    // Equal bits are equal values unless they are a NaN, and an integer can
+    // only equal a double with the same value
+    if (IS_DOUBLE(a) || IS_DOUBLE(b)) {
+        return IS_NUM(a) && IS_NUM(b) && AS_NUM(a) == AS_NUM(b);
+    }
+
+    if (a == b) {
+        return true;
     }
 
     if (IS_OBJ(a) && IS_OBJ(b)) {
         return objects_equal(AS_OBJ(a), AS_OBJ(b));
     }
 
-    return a == b;
+    return false;
 #endif
 }
 
@@ -145,6 +191,7 @@ bool value_is_falsey(Value v) {
            (IS_NUM(v) && AS_NUM(v) == 0) ||
            (IS_STRING(v) && AS_STRING(v)->count == 0) ||
            (IS_ARRAY(v) && AS_ARRAY(v)->count == 0) ||
+           (IS_TYPED_ARRAY(v) && AS_TYPED_ARRAY(v)->count == 0) ||
            (IS_MAP(v) && AS_MAP(v)->count == 0);
 }
 
@@ -156,6 +203,7 @@ const char *value_description(Value value) {
     case VAL_BOOL:
         return "a boolean";
     case VAL_NUM:
+    case VAL_INT:
         return "a number";
     case VAL_OBJ:
         switch (AS_OBJ(value)->tag) {
@@ -165,6 +213,9 @@ const char *value_description(Value value) {
         case OBJ_ARRAY:
             return "an array";
 
+        case OBJ_TYPED_ARRAY:
+            return "a typed array";
+
         case OBJ_MAP:
             return "a map";
 
@@ -202,6 +253,9 @@ const char *value_description(Value value) {
         case OBJ_ARRAY:
             return "an array";
 
+        case OBJ_TYPED_ARRAY:
+            return "a typed array";
+
         case OBJ_MAP:
             return "a map";
 
@@ -225,7 +279,7 @@ const char *value_description(Value value) {
 void object_display(Obj *obj) {
     switch (obj->tag) {
     case OBJ_STRING: {
-        ObjString *str = (ObjString *)obj;
+        ObjString *str = vm_flatten_string((ObjString *)obj);
         printf("\"%.*s\"", (int)str->count, str->items);
         break;
     }
@@ -304,6 +358,24 @@ void object_display(Obj *obj) {
         printf("<upvalue>");
 
         break;
+
+    case OBJ_TYPED_ARRAY: {
+        ObjTypedArray *arr = (ObjTypedArray *)obj;
+
+        printf("[");
+
+        for (uint32_t i = 0; i < arr->count; i++) {
+            if (i > 0) {
+                printf(", ");
+            }
+
+            value_display(NUMBER_VAL(vm_typed_get(arr, i)));
+        }
+
+        printf("]");
+
+        break;
+    }
     }
 }
 
@@ -319,8 +391,12 @@ void value_display(Value value) {
         break;
 
     case VAL_NUM:
-        printf("%g", AS_NUM(value));
+    case VAL_INT: {
+        char buffer[NUMBER_FORMAT_MAX];
+        number_format(AS_NUM(value), buffer);
+        printf("%s", buffer);
         break;
+    }
 
     case VAL_OBJ:
         object_display(AS_OBJ(value));
@@ -332,13 +408,21 @@ void value_display(Value value) {
     } else if (IS_BOOL(value)) {
         printf(AS_BOOL(value) ? "true" : "false");
     } else if (IS_NUM(value)) {
-        printf("%g", AS_NUM(value));
+        char buffer[NUMBER_FORMAT_MAX];
+        number_format(AS_NUM(value), buffer);
+        printf("%s", buffer);
     } else if (IS_OBJ(value)) {
         object_display(AS_OBJ(value));
     }
 #endif
 }
 
+size_t chunk_add_cache(Chunk *chunk) {
+    ARRAY_PUSH(&chunk->caches, (InlineCache){0});
+
+    return chunk->caches.count - 1;
+}
+
 size_t chunk_add_constant(Chunk *chunk, Value value) {
     for (size_t i = 0; i < chunk->constants.count; i++) {
         if (values_equal(chunk->constants.items[i], value)) {
@@ -379,28 +463,734 @@ size_t chunk_add_byte(Chunk *chunk, uint8_t byte, uint32_t source) {
     return chunk->count++;
 }
 
+size_t chunk_instruction_size(const Chunk *chunk, size_t offset) {
+    switch ((OpCode)chunk->bytes[offset]) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_SET_SUBSCRIPT_WITH_MATH:
+    case OP_SET_SUBSCRIPT_WITH_MATH_NUM:
+    case OP_SET_LOCAL_POP:
+        return 2;
+
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_PUSH_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL_WITH_MATH:
+    case OP_SET_LOCAL_WITH_MATH_NUM:
+    case OP_SET_UPVALUE_WITH_MATH:
+    case OP_SET_UPVALUE_WITH_MATH_NUM:
+    case OP_CALL_UPVALUE:
+        return 3;
+
+    case OP_SET_GLOBAL_WITH_MATH:
+    case OP_SET_GLOBAL_WITH_MATH_NUM:
+    case OP_SET_LOCAL_WITH_MATH_LOCAL:
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_NUM:
+    case OP_MATH_LOCAL_LOCAL:
+    case OP_MATH_LOCAL_LOCAL_NUM:
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_POP:
+    case OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM:
+    case OP_GET_SUBSCRIPT_LOCAL_CONST:
+    case OP_CALL_GLOBAL:
+        return 4;
+
+    case OP_SET_LOCAL_WITH_MATH_CONST:
+    case OP_SET_LOCAL_WITH_MATH_CONST_NUM:
+    case OP_MATH_LOCAL_CONST:
+    case OP_MATH_LOCAL_CONST_NUM:
+    case OP_GET_MEMBER:
+    case OP_SET_MEMBER:
+    case OP_MAKE_ARRAY:
+    case OP_MAKE_MAP:
+    case OP_SET_LOCAL_WITH_MATH_CONST_POP:
+    case OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM:
+        return 5;
+
+    case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE:
+    case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM:
+    case OP_SET_MEMBER_WITH_MATH:
+        return 6;
+
+    case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE:
+    case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM:
+    case OP_MAKE_SHAPED_MAP:
+        return 7;
+
+    case OP_MAKE_CLOSURE: {
+        uint16_t index = ((uint16_t)chunk->bytes[offset + 1] << 8) |
+                         chunk->bytes[offset + 2];
+
+        ObjFunction *fn = AS_FUNCTION(chunk->constants.items[index]);
+
+        return 3 + fn->upvalues_count * 2;
+    }
+
+    default:
+        return 1;
+    }
+}
+
+bool chunk_jump_target(const Chunk *chunk, size_t offset, size_t *target) {
+    OpCode opcode = chunk->bytes[offset];
+
+    switch (opcode) {
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE:
+    case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE:
+    case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM:
+    case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM: {
+        // The jump offset is always the last operand
+        size_t next = offset + chunk_instruction_size(chunk, offset);
+
+        uint16_t jump =
+            ((uint16_t)chunk->bytes[next - 2] << 8) | chunk->bytes[next - 1];
+
+        *target = opcode == OP_LOOP ? next - jump : next + jump;
+
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+// Decodes the chunk into instructions that hold their handler from `handlers`
+// and their operands:
+//
+//   a          the first byte operand, the operator of the ones doing math
+//              and the argument count of CALL_GLOBAL
+//   b, c       the following byte operands
+//   constant   the constant operand, already loaded
+//   index      a global slot or the number of elements of a literal
+//   target     the instruction a jump lands on
+//   cache      the inline cache of a member access or a shaped map
+//   upvalues   the (is local, index) pairs of MAKE_CLOSURE, in the bytes
+void chunk_decode(Chunk *chunk, void *const handlers[]) {
+    size_t count = 0;
+
+    chunk->code_index = malloc((chunk->count + 1) * sizeof(uint32_t));
+
+    if (chunk->code_index == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+
+        exit(1);
+    }
+
+    for (size_t offset = 0; offset < chunk->count;
+         offset += chunk_instruction_size(chunk, offset)) {
+        chunk->code_index[offset] = count++;
+    }
+
+    chunk->code_index[chunk->count] = count;
+
+    chunk->code = calloc(count + 1, sizeof(Instruction));
+
+    if (chunk->code == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+
+        exit(1);
+    }
+
+    for (size_t offset = 0; offset < chunk->count;
+         offset += chunk_instruction_size(chunk, offset)) {
+        Instruction *instruction = &chunk->code[chunk->code_index[offset]];
+        const uint8_t *bytes = &chunk->bytes[offset];
+
+#define DECODE_SHORT(i) (((uint16_t)bytes[i] << 8) | bytes[(i) + 1])
+#define DECODE_WORD(i)                                                         \
+    (((uint32_t)bytes[i] << 24) | ((uint32_t)bytes[(i) + 1] << 16) |           \
+     ((uint32_t)bytes[(i) + 2] << 8) | bytes[(i) + 3])
+#define DECODE_CONSTANT(i) (chunk->constants.items[DECODE_SHORT(i)])
+#define DECODE_CACHE(i) (&chunk->caches.items[DECODE_SHORT(i)])
+
+        instruction->handler = handlers[bytes[0]];
+        instruction->op = bytes[0];
+        instruction->offset = offset;
+
+        size_t target;
+
+        if (chunk_jump_target(chunk, offset, &target)) {
+            instruction->target = &chunk->code[chunk->code_index[target]];
+        }
+
+        switch (instruction->op) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_SET_SUBSCRIPT_WITH_MATH:
+        case OP_SET_SUBSCRIPT_WITH_MATH_NUM:
+        case OP_SET_LOCAL_POP:
+            instruction->a = bytes[1];
+            break;
+
+        case OP_PUSH_CONST:
+            instruction->constant = DECODE_CONSTANT(1);
+            break;
+
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            instruction->index = DECODE_SHORT(1);
+            break;
+
+        case OP_SET_LOCAL_WITH_MATH:
+        case OP_SET_LOCAL_WITH_MATH_NUM:
+        case OP_SET_UPVALUE_WITH_MATH:
+        case OP_SET_UPVALUE_WITH_MATH_NUM:
+        case OP_CALL_UPVALUE:
+            instruction->a = bytes[1];
+            instruction->b = bytes[2];
+            break;
+
+        case OP_SET_GLOBAL_WITH_MATH:
+        case OP_SET_GLOBAL_WITH_MATH_NUM:
+            instruction->a = bytes[1];
+            instruction->index = DECODE_SHORT(2);
+            break;
+
+        case OP_SET_LOCAL_WITH_MATH_LOCAL:
+        case OP_SET_LOCAL_WITH_MATH_LOCAL_NUM:
+        case OP_MATH_LOCAL_LOCAL:
+        case OP_MATH_LOCAL_LOCAL_NUM:
+        case OP_SET_LOCAL_WITH_MATH_LOCAL_POP:
+        case OP_SET_LOCAL_WITH_MATH_LOCAL_POP_NUM:
+        case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE:
+        case OP_MATH_LOCAL_LOCAL_JUMP_IF_FALSE_NUM:
+            instruction->a = bytes[1];
+            instruction->b = bytes[2];
+            instruction->c = bytes[3];
+            break;
+
+        case OP_GET_SUBSCRIPT_LOCAL_CONST:
+            instruction->a = bytes[1];
+            instruction->constant = DECODE_CONSTANT(2);
+            break;
+
+        case OP_CALL_GLOBAL:
+            instruction->index = DECODE_SHORT(1);
+            instruction->a = bytes[3];
+            break;
+
+        case OP_SET_LOCAL_WITH_MATH_CONST:
+        case OP_SET_LOCAL_WITH_MATH_CONST_NUM:
+        case OP_MATH_LOCAL_CONST:
+        case OP_MATH_LOCAL_CONST_NUM:
+        case OP_SET_LOCAL_WITH_MATH_CONST_POP:
+        case OP_SET_LOCAL_WITH_MATH_CONST_POP_NUM:
+        case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE:
+        case OP_MATH_LOCAL_CONST_JUMP_IF_FALSE_NUM:
+            instruction->a = bytes[1];
+            instruction->b = bytes[2];
+            instruction->constant = DECODE_CONSTANT(3);
+            break;
+
+        case OP_GET_MEMBER:
+        case OP_SET_MEMBER:
+            instruction->constant = DECODE_CONSTANT(1);
+            instruction->cache = DECODE_CACHE(3);
+            break;
+
+        case OP_SET_MEMBER_WITH_MATH:
+            instruction->a = bytes[1];
+            instruction->constant = DECODE_CONSTANT(2);
+            instruction->cache = DECODE_CACHE(4);
+            break;
+
+        case OP_MAKE_ARRAY:
+        case OP_MAKE_MAP:
+            instruction->index = DECODE_WORD(1);
+            break;
+
+        case OP_MAKE_SHAPED_MAP:
+            instruction->index = DECODE_WORD(1);
+            instruction->cache = DECODE_CACHE(5);
+            break;
+
+        case OP_MAKE_CLOSURE:
+            instruction->constant = DECODE_CONSTANT(1);
+            instruction->upvalues = &bytes[3];
+            break;
+
+        default:
+            break;
+        }
+
+#undef DECODE_SHORT
+#undef DECODE_WORD
+#undef DECODE_CONSTANT
+#undef DECODE_CACHE
+    }
+
+    chunk->code[count].offset = chunk->count;
+}
+
+// Multiplies both words into 128 bits and folds the halves together, which is
+// what spreads every input bit into the low bits masked by the maps
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    unsigned __int128 p = (unsigned __int128)a * b;
+
+    return (uint64_t)p ^ (uint64_t)(p >> 64);
+}
+
+static inline uint64_t hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// wyhash, it reads 8 bytes at a time and mixes 48 bytes per iteration in three
+// independent lanes, short keys are covered by a few overlapping reads
 uint32_t string_hash(const char *key, uint32_t count) {
-    uint32_t hash = 2166136261u;
+    static const uint64_t secret[4] = {
+        0x2d358dccaa6c78a5ull,
+        0x8bb84b93962eacc9ull,
+        0x4b33a62ed433d4a3ull,
+        0x4d5a2da51de1aa47ull,
+    };
+
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t seed = hash_mix(secret[0], secret[1]) ^ secret[0];
+    uint64_t a;
+    uint64_t b;
+
+    if (count <= 16) {
+        if (count >= 4) {
+            size_t middle = (count >> 3) << 2;
+
+            a = (hash_read32(p) << 32) | hash_read32(p + middle);
+            b = (hash_read32(p + count - 4) << 32) |
+                hash_read32(p + count - 4 - middle);
+        } else if (count > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[count >> 1] << 8) |
+                p[count - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        size_t i = count;
+
+        if (i > 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+
+            do {
+                seed = hash_mix(hash_read64(p) ^ secret[1],
+                                hash_read64(p + 8) ^ seed);
+                seed1 = hash_mix(hash_read64(p + 16) ^ secret[2],
+                                 hash_read64(p + 24) ^ seed1);
+                seed2 = hash_mix(hash_read64(p + 32) ^ secret[3],
+                                 hash_read64(p + 40) ^ seed2);
+
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+
+            seed ^= seed1 ^ seed2;
+        }
 
-    for (uint32_t i = 0; i < count; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+        while (i > 16) {
+            seed = hash_mix(hash_read64(p) ^ secret[1],
+                            hash_read64(p + 8) ^ seed);
+
+            p += 16;
+            i -= 16;
+        }
+
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
     }
 
-    return hash;
+    unsigned __int128 ab = (unsigned __int128)(a ^ secret[1]) * (b ^ seed);
+
+    return (uint32_t)hash_mix((uint64_t)ab ^ secret[0] ^ count,
+                              (uint64_t)(ab >> 64) ^ secret[1]);
 }
 
+// The kernels below take whole strings, each has an AVX2 or SSE2 loop over
+// blocks of bytes and finishes the rest one byte or character at a time
+
 uint32_t string_utf8_characters_count(const char *start, const char *end) {
+    const uint8_t *p = (const uint8_t *)start;
+    const uint8_t *e = (const uint8_t *)end;
     uint32_t count = 0;
 
-    while (start < end) {
-        start = string_utf8_skip_character(start);
-        count++;
+    // Every byte that is not a continuation byte starts a character, those are
+    // 0x80 to 0xbf which compare as less than -64 when signed. Each lane counts
+    // the starts in a byte, which holds up to 255 blocks before being summed
+#if defined(__AVX2__)
+    while (e - p >= 32) {
+        __m256i counts = _mm256_setzero_si256();
+
+        for (size_t i = 0; i < 255 && e - p >= 32; i++) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)p);
+            __m256i starts = _mm256_cmpgt_epi8(block, _mm256_set1_epi8(-65));
+
+            counts = _mm256_sub_epi8(counts, starts);
+            p += 32;
+        }
+
+        __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+#elif defined(__SSE2__)
+    while (e - p >= 16) {
+        __m128i counts = _mm_setzero_si128();
+
+        for (size_t i = 0; i < 255 && e - p >= 16; i++) {
+            __m128i block = _mm_loadu_si128((const __m128i *)p);
+            __m128i starts = _mm_cmpgt_epi8(block, _mm_set1_epi8(-65));
+
+            counts = _mm_sub_epi8(counts, starts);
+            p += 16;
+        }
+
+        __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+#endif
+
+    // Continuation bytes have the high bit set and the next one clear, the
+    // multiplication adds up the flags of all eight bytes in the top one
+    while (e - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+
+        uint64_t continuations = (word & ~(word << 1)) & 0x8080808080808080ull;
+
+        count += 8 - (((continuations >> 7) * 0x0101010101010101ull) >> 56);
+        p += 8;
+    }
+
+    while (p < e) {
+        count += (*p++ & 0xc0) != 0x80;
     }
 
     return count;
 }
 
+static inline bool string_utf8_is_ascii16(const uint8_t *p) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)) == 0;
+#else
+    uint64_t words[2];
+    memcpy(words, p, sizeof(words));
+
+    return ((words[0] | words[1]) & 0x8080808080808080ull) == 0;
+#endif
+}
+
+#if !defined(__AVX2__)
+
+// Returns where the next character starts, or NULL if the one at `p` is not
+// well formed, overlong encodings and surrogates included
+static const uint8_t *string_utf8_validate_character(const uint8_t *p,
+                                                     const uint8_t *end) {
+    uint8_t lead = p[0];
+
+    if (lead < 0x80) {
+        return p + 1;
+    }
+
+    size_t size;
+    uint8_t min = 0x80;
+    uint8_t max = 0xbf;
+
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        size = 2;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        size = 3;
+        min = lead == 0xe0 ? 0xa0 : 0x80;
+        max = lead == 0xed ? 0x9f : 0xbf;
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        size = 4;
+        min = lead == 0xf0 ? 0x90 : 0x80;
+        max = lead == 0xf4 ? 0x8f : 0xbf;
+    } else {
+        return NULL;
+    }
+
+    if ((size_t)(end - p) < size || p[1] < min || p[1] > max) {
+        return NULL;
+    }
+
+    for (size_t i = 2; i < size; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return NULL;
+        }
+    }
+
+    return p + size;
+}
+
+#else
+
+// Validates 32 bytes at a time with the lookup tables of Keiser and Lemire,
+// "Validating UTF-8 In Less Than One Instruction Per Byte", each error is a
+// bit set by a table indexed by the high nibble of the previous byte, one by
+// its low nibble and one by the high nibble of the current byte
+#define UTF8_TOO_SHORT (1 << 0)
+#define UTF8_TOO_LONG (1 << 1)
+#define UTF8_OVERLONG_3 (1 << 2)
+#define UTF8_TOO_LARGE (1 << 3)
+#define UTF8_SURROGATE (1 << 4)
+#define UTF8_OVERLONG_2 (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4 (1 << 6)
+#define UTF8_TWO_CONTS (1 << 7)
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static inline __m256i utf8_lookup(__m256i nibbles, __m128i table) {
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(table), nibbles);
+}
+
+static inline __m256i utf8_high_nibbles(__m256i bytes) {
+    return _mm256_and_si256(_mm256_srli_epi16(bytes, 4),
+                            _mm256_set1_epi8(0x0f));
+}
+
+// The bytes of `input` shifted right by `n`, taking the first from `previous`
+#define UTF8_PREVIOUS(input, previous, n)                                      \
+    _mm256_alignr_epi8(                                                        \
+        (input), _mm256_permute2x128_si256((previous), (input), 0x21), 16 - (n))
+
+static inline __m256i utf8_block_errors(__m256i input, __m256i previous) {
+    const __m128i byte_1_high = _mm_setr_epi8(
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+            UTF8_OVERLONG_4);
+
+    const __m128i byte_1_low = _mm_setr_epi8(
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2, UTF8_CARRY, UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+
+    const __m128i byte_2_high = _mm_setr_epi8(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+            UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+
+    __m256i prev1 = UTF8_PREVIOUS(input, previous, 1);
+
+    __m256i special =
+        _mm256_and_si256(
+            _mm256_and_si256(
+                utf8_lookup(utf8_high_nibbles(prev1), byte_1_high),
+                utf8_lookup(_mm256_and_si256(prev1, _mm256_set1_epi8(0x0f)),
+                            byte_1_low)),
+            utf8_lookup(utf8_high_nibbles(input), byte_2_high));
+
+    // The third and fourth bytes of a character must be continuation bytes,
+    // where TWO_CONTS is expected instead of being an error
+    __m256i prev2 = UTF8_PREVIOUS(input, previous, 2);
+    __m256i prev3 = UTF8_PREVIOUS(input, previous, 3);
+
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80));
+
+    // Only the leads of three and four byte characters keep the high bit
+    __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                             _mm256_set1_epi8((char)0x80));
+
+    return _mm256_xor_si256(must_continue, special);
+}
+
+// Nonzero where the block ends in the middle of a character
+static inline __m256i utf8_block_incomplete(__m256i input) {
+    const __m256i max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)(0xf0 - 1),
+        (char)(0xe0 - 1), (char)(0xc0 - 1));
+
+    return _mm256_subs_epu8(input, max);
+}
+
+static bool string_utf8_validate_blocks(const uint8_t *p, const uint8_t *end) {
+    __m256i error = _mm256_setzero_si256();
+    __m256i previous = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+
+    while (p < end) {
+        __m256i input;
+
+        if (end - p >= 32) {
+            input = _mm256_loadu_si256((const __m256i *)p);
+        } else {
+            // Zeros are ASCII, so a character cut by the end is still found
+            uint8_t tail[32] = {0};
+            memcpy(tail, p, end - p);
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        }
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+        } else {
+            error = _mm256_or_si256(error, utf8_block_errors(input, previous));
+            incomplete = utf8_block_incomplete(input);
+        }
+
+        previous = input;
+        p += 32;
+    }
+
+    error = _mm256_or_si256(error, incomplete);
+
+    return _mm256_testz_si256(error, error);
+}
+
+#undef UTF8_PREVIOUS
+
+#endif
+
+bool string_utf8_validate(const char *start, const char *end) {
+    const uint8_t *p = (const uint8_t *)start;
+    const uint8_t *e = (const uint8_t *)end;
+
+#if defined(__AVX2__)
+    return string_utf8_validate_blocks(p, e);
+#else
+    while (p < e) {
+        if (e - p >= 16 && string_utf8_is_ascii16(p)) {
+            p += 16;
+        } else if ((p = string_utf8_validate_character(p, e)) == NULL) {
+            return false;
+        }
+    }
+
+    return true;
+#endif
+}
+
+// The string must be valid, see string_utf8_validate, `runes` must have room
+// for every character
+uint32_t string_utf8_decode(const char *start, const char *end,
+                            uint32_t *runes) {
+    const uint8_t *p = (const uint8_t *)start;
+    const uint8_t *e = (const uint8_t *)end;
+    uint32_t count = 0;
+
+    while (p < e) {
+        if (e - p >= 16 && string_utf8_is_ascii16(p)) {
+#if defined(__SSE2__)
+            __m128i block = _mm_loadu_si128((const __m128i *)p);
+            __m128i low = _mm_unpacklo_epi8(block, _mm_setzero_si128());
+            __m128i high = _mm_unpackhi_epi8(block, _mm_setzero_si128());
+            __m128i *out = (__m128i *)(runes + count);
+
+            _mm_storeu_si128(out + 0,
+                             _mm_unpacklo_epi16(low, _mm_setzero_si128()));
+            _mm_storeu_si128(out + 1,
+                             _mm_unpackhi_epi16(low, _mm_setzero_si128()));
+            _mm_storeu_si128(out + 2,
+                             _mm_unpacklo_epi16(high, _mm_setzero_si128()));
+            _mm_storeu_si128(out + 3,
+                             _mm_unpackhi_epi16(high, _mm_setzero_si128()));
+#else
+            for (size_t i = 0; i < 16; i++) {
+                runes[count + i] = p[i];
+            }
+#endif
+
+            p += 16;
+            count += 16;
+        } else {
+            p = (const uint8_t *)string_utf8_decode_character((const char *)p,
+                                                              &runes[count]);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// The runes must be valid code points, `result` must have room for four bytes
+// per rune, returns the number of bytes written
+uint32_t string_utf8_encode(const uint32_t *runes, uint32_t count,
+                            char *result) {
+    char *out = result;
+    uint32_t i = 0;
+
+    while (i < count) {
+#if defined(__SSE2__)
+        if (count - i >= 16) {
+            const __m128i *in = (const __m128i *)(runes + i);
+            __m128i a = _mm_loadu_si128(in + 0);
+            __m128i b = _mm_loadu_si128(in + 1);
+            __m128i c = _mm_loadu_si128(in + 2);
+            __m128i d = _mm_loadu_si128(in + 3);
+
+            __m128i all = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+            __m128i wide = _mm_and_si128(all, _mm_set1_epi32(~0x7f));
+
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+                    wide, _mm_setzero_si128())) == 0xffff) {
+                __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b),
+                                                 _mm_packs_epi32(c, d));
+
+                _mm_storeu_si128((__m128i *)out, bytes);
+
+                out += 16;
+                i += 16;
+
+                continue;
+            }
+        }
+#endif
+
+        out += string_utf8_encode_character(runes[i++], out);
+    }
+
+    return out - result;
+}
+
 const char *string_utf8_skip_character(const char *start) {
     if ((*start & 0b10000000) == 0b00000000) {
         return start + 1;
@@ -479,3 +1269,430 @@ const char *string_utf8_decode_character(const char *start, uint32_t *rune) {
 
     return next;
 }
+
+// The kernels below take whole typed arrays of one kind, each has an AVX2 or
+// SSE2 loop over blocks of elements and finishes the rest one at a time.
+// Integers wrap around, which is also what storing them does
+
+static inline void typed_f64_binary(const double *a, const double *b,
+                                    double *r, uint32_t n, bool mul) {
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d y = _mm256_loadu_pd(b + i);
+
+        _mm256_storeu_pd(r + i,
+                         mul ? _mm256_mul_pd(x, y) : _mm256_add_pd(x, y));
+    }
+#elif defined(__SSE2__)
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        __m128d y = _mm_loadu_pd(b + i);
+
+        _mm_storeu_pd(r + i, mul ? _mm_mul_pd(x, y) : _mm_add_pd(x, y));
+    }
+#endif
+
+    for (; i < n; i++) {
+        r[i] = mul ? a[i] * b[i] : a[i] + b[i];
+    }
+}
+
+static inline void typed_i32_binary(const int32_t *a, const int32_t *b,
+                                    int32_t *r, uint32_t n, bool mul) {
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+
+        _mm256_storeu_si256((__m256i *)(r + i), mul ? _mm256_mullo_epi32(x, y)
+                                                    : _mm256_add_epi32(x, y));
+    }
+#elif defined(__SSE2__)
+    // SSE2 has no multiplication keeping the low halves of 32 bits lanes
+    for (; !mul && i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+
+        _mm_storeu_si128((__m128i *)(r + i), _mm_add_epi32(x, y));
+    }
+#endif
+
+    for (; i < n; i++) {
+        uint32_t x = a[i];
+        uint32_t y = b[i];
+
+        r[i] = (int32_t)(mul ? x * y : x + y);
+    }
+}
+
+static inline void typed_u8_binary(const uint8_t *a, const uint8_t *b,
+                                   uint8_t *r, uint32_t n, bool mul) {
+    uint32_t i = 0;
+
+    // There is no multiplication of 8 bits lanes at all
+#if defined(__AVX2__)
+    for (; !mul && i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+
+        _mm256_storeu_si256((__m256i *)(r + i), _mm256_add_epi8(x, y));
+    }
+#elif defined(__SSE2__)
+    for (; !mul && i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+
+        _mm_storeu_si128((__m128i *)(r + i), _mm_add_epi8(x, y));
+    }
+#endif
+
+    for (; i < n; i++) {
+        r[i] = (uint8_t)(mul ? a[i] * b[i] : a[i] + b[i]);
+    }
+}
+
+static void typed_binary(const ObjTypedArray *lhs, const ObjTypedArray *rhs,
+                         ObjTypedArray *result, bool mul) {
+    switch (lhs->kind) {
+    case TYPED_FLOAT64:
+        typed_f64_binary((const double *)lhs->items,
+                         (const double *)rhs->items, (double *)result->items,
+                         lhs->count, mul);
+
+        break;
+
+    case TYPED_INT32:
+        typed_i32_binary((const int32_t *)lhs->items,
+                         (const int32_t *)rhs->items, (int32_t *)result->items,
+                         lhs->count, mul);
+
+        break;
+
+    case TYPED_UINT8:
+        typed_u8_binary(lhs->items, rhs->items, result->items, lhs->count,
+                        mul);
+
+        break;
+    }
+}
+
+void typed_add(const ObjTypedArray *lhs, const ObjTypedArray *rhs,
+               ObjTypedArray *result) {
+    typed_binary(lhs, rhs, result, false);
+}
+
+void typed_mul(const ObjTypedArray *lhs, const ObjTypedArray *rhs,
+               ObjTypedArray *result) {
+    typed_binary(lhs, rhs, result, true);
+}
+
+void typed_scale(const ObjTypedArray *array, double factor,
+                 ObjTypedArray *result) {
+    uint32_t n = array->count;
+
+    if (array->kind != TYPED_FLOAT64) {
+        for (uint32_t i = 0; i < n; i++) {
+            vm_typed_set(result, i, vm_typed_get(array, i) * factor);
+        }
+
+        return;
+    }
+
+    const double *a = (const double *)array->items;
+    double *r = (double *)result->items;
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    __m256d k = _mm256_set1_pd(factor);
+
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(r + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), k));
+    }
+#elif defined(__SSE2__)
+    __m128d k = _mm_set1_pd(factor);
+
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(r + i, _mm_mul_pd(_mm_loadu_pd(a + i), k));
+    }
+#endif
+
+    for (; i < n; i++) {
+        r[i] = a[i] * factor;
+    }
+}
+
+// Element i is added to lane i % 8 and the lanes are added up in the same
+// order whatever the instructions, so every build rounds the same way
+static double typed_f64_sum(const double *a, uint32_t n) {
+    double lanes[8] = {0};
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    __m256d low = _mm256_setzero_pd();
+    __m256d high = _mm256_setzero_pd();
+
+    for (; i + 8 <= n; i += 8) {
+        low = _mm256_add_pd(low, _mm256_loadu_pd(a + i));
+        high = _mm256_add_pd(high, _mm256_loadu_pd(a + i + 4));
+    }
+
+    _mm256_storeu_pd(lanes, low);
+    _mm256_storeu_pd(lanes + 4, high);
+#elif defined(__SSE2__)
+    __m128d sums[4] = {_mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd(),
+                       _mm_setzero_pd()};
+
+    for (; i + 8 <= n; i += 8) {
+        for (uint32_t j = 0; j < 4; j++) {
+            sums[j] = _mm_add_pd(sums[j], _mm_loadu_pd(a + i + j * 2));
+        }
+    }
+
+    for (uint32_t j = 0; j < 4; j++) {
+        _mm_storeu_pd(lanes + j * 2, sums[j]);
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        for (uint32_t j = 0; j < 8; j++) {
+            lanes[j] += a[i + j];
+        }
+    }
+#endif
+
+    double sum = ((lanes[0] + lanes[4]) + (lanes[2] + lanes[6])) +
+                 ((lanes[1] + lanes[5]) + (lanes[3] + lanes[7]));
+
+    for (; i < n; i++) {
+        sum += a[i];
+    }
+
+    return sum;
+}
+
+static int64_t typed_i32_sum(const int32_t *a, uint32_t n) {
+    int64_t sum = 0;
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i sums = _mm256_setzero_si256();
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(a + i));
+
+        sums = _mm256_add_epi64(sums, _mm256_cvtepi32_epi64(block));
+    }
+
+    sum = _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+          _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+#endif
+
+    for (; i < n; i++) {
+        sum += a[i];
+    }
+
+    return sum;
+}
+
+static uint64_t typed_u8_sum(const uint8_t *a, uint32_t n) {
+    uint64_t sum = 0;
+    uint32_t i = 0;
+
+    // Summing the absolute differences to zero adds up every 8 bytes
+#if defined(__AVX2__)
+    __m256i sums = _mm256_setzero_si256();
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(a + i));
+
+        sums = _mm256_add_epi64(sums,
+                                _mm256_sad_epu8(block, _mm256_setzero_si256()));
+    }
+
+    sum = _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+          _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+#elif defined(__SSE2__)
+    __m128i sums = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(a + i));
+
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(block, _mm_setzero_si128()));
+    }
+
+    uint64_t halves[2];
+
+    _mm_storeu_si128((__m128i *)halves, sums);
+
+    sum = halves[0] + halves[1];
+#endif
+
+    for (; i < n; i++) {
+        sum += a[i];
+    }
+
+    return sum;
+}
+
+double typed_sum(const ObjTypedArray *array) {
+    switch (array->kind) {
+    case TYPED_FLOAT64:
+        return typed_f64_sum((const double *)array->items, array->count);
+
+    case TYPED_INT32:
+        return typed_i32_sum((const int32_t *)array->items, array->count);
+
+    default:
+        return typed_u8_sum(array->items, array->count);
+    }
+}
+
+// Lanes start from the infinity on the other side and only take numbers that
+// compare as less (or greater), so NaN is skipped as min_pd and max_pd do
+static double typed_f64_extremum(const double *a, uint32_t n, bool max) {
+    double result = max ? -INFINITY : INFINITY;
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    __m256d lanes = _mm256_set1_pd(result);
+
+    for (; i + 4 <= n; i += 4) {
+        __m256d block = _mm256_loadu_pd(a + i);
+
+        lanes = max ? _mm256_max_pd(block, lanes) : _mm256_min_pd(block, lanes);
+    }
+
+    double values[4];
+
+    _mm256_storeu_pd(values, lanes);
+#elif defined(__SSE2__)
+    __m128d lanes = _mm_set1_pd(result);
+
+    for (; i + 2 <= n; i += 2) {
+        __m128d block = _mm_loadu_pd(a + i);
+
+        lanes = max ? _mm_max_pd(block, lanes) : _mm_min_pd(block, lanes);
+    }
+
+    double values[2];
+
+    _mm_storeu_pd(values, lanes);
+#else
+    double values[1] = {result};
+#endif
+
+    for (size_t j = 0; j < sizeof(values) / sizeof(double); j++) {
+        result = (max ? values[j] > result : values[j] < result) ? values[j]
+                                                                 : result;
+    }
+
+    for (; i < n; i++) {
+        result = (max ? a[i] > result : a[i] < result) ? a[i] : result;
+    }
+
+    return result;
+}
+
+static int32_t typed_i32_extremum(const int32_t *a, uint32_t n, bool max) {
+    int32_t result = max ? INT32_MIN : INT32_MAX;
+    uint32_t i = 0;
+
+    // SSE2 has no comparison of 32 bits lanes keeping the lesser one
+#if defined(__AVX2__)
+    __m256i lanes = _mm256_set1_epi32(result);
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(a + i));
+
+        lanes = max ? _mm256_max_epi32(block, lanes)
+                    : _mm256_min_epi32(block, lanes);
+    }
+
+    int32_t values[8];
+
+    _mm256_storeu_si256((__m256i *)values, lanes);
+
+    for (size_t j = 0; j < 8; j++) {
+        result = (max ? values[j] > result : values[j] < result) ? values[j]
+                                                                 : result;
+    }
+#endif
+
+    for (; i < n; i++) {
+        result = (max ? a[i] > result : a[i] < result) ? a[i] : result;
+    }
+
+    return result;
+}
+
+static uint8_t typed_u8_extremum(const uint8_t *a, uint32_t n, bool max) {
+    uint8_t result = max ? 0 : UINT8_MAX;
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i lanes = _mm256_set1_epi8((char)result);
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(a + i));
+
+        lanes =
+            max ? _mm256_max_epu8(block, lanes) : _mm256_min_epu8(block, lanes);
+    }
+
+    uint8_t values[32];
+
+    _mm256_storeu_si256((__m256i *)values, lanes);
+#elif defined(__SSE2__)
+    __m128i lanes = _mm_set1_epi8((char)result);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(a + i));
+
+        lanes = max ? _mm_max_epu8(block, lanes) : _mm_min_epu8(block, lanes);
+    }
+
+    uint8_t values[16];
+
+    _mm_storeu_si128((__m128i *)values, lanes);
+#else
+    uint8_t values[1] = {result};
+#endif
+
+    for (size_t j = 0; j < sizeof(values); j++) {
+        result = (max ? values[j] > result : values[j] < result) ? values[j]
+                                                                 : result;
+    }
+
+    for (; i < n; i++) {
+        result = (max ? a[i] > result : a[i] < result) ? a[i] : result;
+    }
+
+    return result;
+}
+
+static double typed_extremum(const ObjTypedArray *array, bool max) {
+    switch (array->kind) {
+    case TYPED_FLOAT64:
+        return typed_f64_extremum((const double *)array->items, array->count,
+                                  max);
+
+    case TYPED_INT32:
+        return typed_i32_extremum((const int32_t *)array->items, array->count,
+                                  max);
+
+    default:
+        return typed_u8_extremum(array->items, array->count, max);
+    }
+}
+
+double typed_min(const ObjTypedArray *array) {
+    return typed_extremum(array, false);
+}
+
+double typed_max(const ObjTypedArray *array) {
+    return typed_extremum(array, true);
+}